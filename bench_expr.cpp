@@ -0,0 +1,441 @@
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <chrono>
+#include <thread>
+#include "expr.h"
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#define BENCH_COUNTERS
+#endif
+
+// Benchmark suite: for each expression of the corpus measures parse
+// time, scalar evaluation (interpreted and native), batch throughput
+// (double and float) and scaling of batch evaluation with the number of threads, then for
+// each math function the batch time per value and the largest error
+// against the C library with each accuracy, and finally the time of a
+// culled grid against a plain one. Results are written as JSON
+// (default bench.json) and summarized on stdout.
+//
+//     bench_expr [-o output.json] [-t seconds] [-q]
+//
+// -t is the minimum time of each measurement (default 0.05s) and -q
+// skips the thread scaling measurements.
+
+static double clamp01(double x) {
+    return x < 0 ? 0 : x > 1 ? 1 : x;
+}
+
+static double smooth(double x) {
+    x = clamp01(x);
+    return x*x*(3 - 2*x);
+}
+
+static double hyp(double a, double b) {
+    return sqrt(a*a + b*b);
+}
+
+struct Case {
+    std::string name, category, text;
+};
+
+static std::vector<Case> corpus(int nvars) {
+    std::vector<Case> res;
+    struct { const char *name, *category, *text; } fixed[] = {
+        {"linear", "short", "x + 1"},
+        {"poly2", "short", "a*x*x + b*x + c"},
+        {"mix", "short", "(x - y)*(x + y) / (z + 2)"},
+        {"trig", "transcendental", "sin(x)*cos(y) + exp(-x*x)*log(1 + y*y)"},
+        {"angles", "transcendental", "atan2(y, x) + pow(abs(x), 2.5) + tan(z*0.1)"},
+        {"ripple", "transcendental", "sin(sqrt(x*x + y*y)*10) / (1 + sqrt(x*x + y*y))"},
+        {"select", "branchy", "x > 0 ? (y > 0 ? x*y : -x*y) : (z > 0 ? sqrt(z) : -z)"},
+        {"guards", "branchy", "x > 0.5 && y < 0.3 || z > 0.9 && x < 0.1"},
+        {"guarded_math", "branchy", "x > 0 && log(x) > -1 ? exp(y)*sin(z) : 0"},
+        {"functions", "user-functions", "clamp01(x) + smooth(y) + hyp(x, y)*clamp01(z)"},
+        {"nested_functions", "user-functions", "smooth(clamp01(hyp(x, y) - smooth(z)))"},
+    };
+    for (int i=0,n=sizeof(fixed)/sizeof(fixed[0]); i<n; i++) {
+        Case c = { fixed[i].name, fixed[i].category, fixed[i].text };
+        res.push_back(c);
+    }
+    // Deep nesting of arithmetic and function calls
+    const char *xyz[] = { "x", "y", "z" };
+    std::string deep = "x", calls = "x";
+    for (int i=0; i<40; i++) {
+        char buf[64];
+        snprintf(buf, sizeof(buf), "*%s + %i)", xyz[i%3], i);
+        deep = "(" + deep + buf;
+        calls = (i%2 ? "sqrt(abs(" : "sin(cos(") + calls + "))";
+    }
+    Case d1 = { "deep_arith", "nested", deep };
+    Case d2 = { "deep_calls", "nested", calls };
+    res.push_back(d1);
+    res.push_back(d2);
+    // Many variables
+    std::string sum, prod;
+    for (int i=0; i<nvars; i++) {
+        char buf[64];
+        snprintf(buf, sizeof(buf), "%sv%i*%0.2f", i ? " + " : "", i, 1 + i*0.25);
+        sum += buf;
+        snprintf(buf, sizeof(buf), "%s(v%i - v%i)", i ? "*" : "", i, (i+1) % nvars);
+        prod += buf;
+    }
+    Case m1 = { "weighted_sum", "many-variables", sum };
+    Case m2 = { "differences", "many-variables", prod };
+    res.push_back(m1);
+    res.push_back(m2);
+    return res;
+}
+
+// Runs f(iterations) with an increasing number of iterations until it
+// takes at least min_time; returns the time per iteration in seconds
+template<typename F>
+double measure(double min_time, F f) {
+    for (long n=1; ; n*=2) {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        f(n);
+        double t = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if (t >= min_time || n >= (1L << 40)) return t / n;
+    }
+}
+
+// Optional hardware counters (cycles, instructions, branch misses)
+struct Counters {
+    enum { CYCLES, INSTRUCTIONS, BRANCH_MISSES, COUNT };
+    int fd[COUNT];
+    bool ok;
+
+    Counters() : ok(false) {
+        for (int i=0; i<COUNT; i++) fd[i] = -1;
+#if defined(BENCH_COUNTERS)
+        const unsigned long long configs[COUNT] = {
+            PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_BRANCH_MISSES };
+        ok = true;
+        for (int i=0; i<COUNT; i++) {
+            perf_event_attr attr;
+            memset(&attr, 0, sizeof(attr));
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.size = sizeof(attr);
+            attr.config = configs[i];
+            attr.disabled = 1;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            fd[i] = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+            if (fd[i] == -1) ok = false;
+        }
+#endif
+    }
+
+    ~Counters() {
+#if defined(BENCH_COUNTERS)
+        for (int i=0; i<COUNT; i++) if (fd[i] != -1) close(fd[i]);
+#endif
+    }
+
+    void start() {
+#if defined(BENCH_COUNTERS)
+        for (int i=0; ok && i<COUNT; i++) {
+            ioctl(fd[i], PERF_EVENT_IOC_RESET, 0);
+            ioctl(fd[i], PERF_EVENT_IOC_ENABLE, 0);
+        }
+#endif
+    }
+
+    void stop(double *values) {
+#if defined(BENCH_COUNTERS)
+        for (int i=0; ok && i<COUNT; i++) {
+            ioctl(fd[i], PERF_EVENT_IOC_DISABLE, 0);
+            long long v = 0;
+            if (read(fd[i], &v, sizeof(v)) != sizeof(v)) ok = false;
+            values[i] = double(v);
+        }
+#else
+        (void)values;
+#endif
+    }
+};
+
+static std::string quoted(const std::string& s) {
+    std::string res = "\"";
+    for (int i=0,n=s.size(); i<n; i++) {
+        char c = s[i];
+        if (c == '"' || c == '\\') {
+            res += '\\';
+            res += c;
+        } else if ((unsigned char)c < 32) {
+            char buf[8];
+            snprintf(buf, sizeof(buf), "\\u%04x", c);
+            res += buf;
+        } else {
+            res += c;
+        }
+    }
+    return res + "\"";
+}
+
+static std::string number(double x) {
+    if (x != x) return "null";
+    char buf[64];
+    snprintf(buf, sizeof(buf), "%.6g", x);
+    return buf;
+}
+
+volatile double sink;
+
+int main(int argc, char *argv[]) {
+    const char *output = "bench.json";
+    double min_time = 0.05;
+    bool scaling = true;
+    for (int i=1; i<argc; i++) {
+        if (strcmp(argv[i], "-o") == 0 && i+1 < argc) {
+            output = argv[++i];
+        } else if (strcmp(argv[i], "-t") == 0 && i+1 < argc) {
+            min_time = atof(argv[++i]);
+        } else if (strcmp(argv[i], "-q") == 0) {
+            scaling = false;
+        } else {
+            fprintf(stderr, "Usage: %s [-o output.json] [-t seconds] [-q]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    Expr::addFunction("clamp01", clamp01);
+    Expr::addFunction("smooth", smooth);
+    Expr::addFunction("hyp", hyp);
+
+    // Frames with random values in [-1, 1] for all variables
+    const int nvars = 20, nframes = 1024, rows = 1 << 16;
+    const char *names[] = { "x", "y", "z", "a", "b", "c" };
+    Expr::Symbols symbols;
+    std::map<std::string, double> vars;
+    for (int i=0; i<6; i++) {
+        symbols.add(names[i]);
+        vars[names[i]] = 0.5;
+    }
+    for (int i=0; i<nvars; i++) {
+        char name[16];
+        snprintf(name, sizeof(name), "v%i", i);
+        symbols.add(name);
+        vars[name] = 0.5;
+    }
+    int fs = symbols.size();
+    std::vector<double> frames(rows * fs);
+    srand(42);
+    for (int i=0,n=frames.size(); i<n; i++) frames[i] = rand() * 2.0 / RAND_MAX - 1;
+    std::vector<float> fframes(frames.begin(), frames.end());
+
+    int hw = std::max(1, int(std::thread::hardware_concurrency()));
+    Counters counters;
+#if defined(EXPR_THREADED_DISPATCH)
+    const char *dispatch = "threaded";
+#else
+    const char *dispatch = "switch";
+#endif
+
+    std::vector<Case> cases = corpus(nvars);
+    std::string json = "{\n  \"version\": 1,\n";
+    json += "  \"dispatch\": " + quoted(dispatch) + ",\n";
+    json += "  \"hardware_threads\": " + number(hw) + ",\n";
+    json += std::string("  \"counters\": ") + (counters.ok ? "true" : "false") + ",\n";
+    json += "  \"min_time\": " + number(min_time) + ",\n";
+    json += "  \"expressions\": [\n";
+
+    printf("%-18s %-15s %9s %9s %9s %9s %11s %11s", "name", "category", "parse_us",
+           "eval_ns", "frame_ns", "native_ns", "batch_Mrows", "float_Mrows");
+    if (counters.ok) printf(" %8s %8s %8s", "cycles", "instr", "br_miss");
+    printf("\n");
+
+    for (int ci=0,nc=cases.size(); ci<nc; ci++) {
+        const Case& c = cases[ci];
+        const char *text = c.text.c_str();
+
+        double parse_s = measure(min_time, [&](long n) {
+            for (long i=0; i<n; i++) Expr::parse(text, symbols);
+        });
+
+        Expr e = Expr::parse(text, symbols);
+        Expr em = Expr::parse(text, vars);
+        std::string code = e.disassemble();
+        int instructions = std::count(code.begin(), code.end(), '\n');
+
+        double eval_s = measure(min_time, [&](long n) {
+            double acc = 0;
+            for (long i=0; i<n; i++) acc += em.eval();
+            sink = acc;
+        });
+
+        std::vector<double> regs(e.registerCount());
+        e.initRegisters(&regs[0]);
+        double frame_s = measure(min_time, [&](long n) {
+            double acc = 0;
+            for (long i=0; i<n; i++) acc += e.evalFrame(&frames[(i & (nframes-1)) * fs], &regs[0]);
+            sink = acc;
+        });
+
+        double counts[Counters::COUNT] = { NAN, NAN, NAN };
+        if (counters.ok) {
+            long n = 100000;
+            double acc = 0;
+            counters.start();
+            for (long i=0; i<n; i++) acc += e.evalFrame(&frames[(i & (nframes-1)) * fs], &regs[0]);
+            counters.stop(counts);
+            sink = acc;
+            for (int k=0; k<Counters::COUNT; k++) counts[k] /= n;
+        }
+
+        Expr ej = e;
+        double native_s = NAN;
+        if (ej.jit()) {
+            native_s = measure(min_time, [&](long n) {
+                double acc = 0;
+                for (long i=0; i<n; i++) acc += ej.evalFrame(&frames[(i & (nframes-1)) * fs], &regs[0]);
+                sink = acc;
+            });
+        }
+
+        // Batch evaluation of all rows split among a number of threads
+        std::vector<double> out(rows);
+        std::string scale;
+        double batch_rows = 0;
+        for (int t=1; t<=hw; t = (t < hw && t*2 > hw) ? hw : t*2) {
+            double s = measure(min_time, [&](long n) {
+                for (long i=0; i<n; i++) {
+                    std::vector<std::thread> workers;
+                    for (int k=1; k<t; k++) {
+                        workers.push_back(std::thread([&, k]() {
+                            int r0 = rows*k/t, r1 = rows*(k+1)/t;
+                            e.evalFrames(r1 - r0, &frames[r0*fs], fs, &out[r0]);
+                        }));
+                    }
+                    e.evalFrames(rows/t, &frames[0], fs, &out[0]);
+                    for (int k=0,nw=workers.size(); k<nw; k++) workers[k].join();
+                }
+            });
+            if (t == 1) batch_rows = rows / s;
+            scale += std::string(t > 1 ? ", " : "") + "{\"threads\": " + number(t) +
+                ", \"rows_per_sec\": " + number(rows / s) +
+                ", \"speedup\": " + number(rows / s / batch_rows) + "}";
+            if (!scaling || t == hw) break;
+        }
+
+        // Single precision batch (one thread)
+        std::vector<float> fout(rows);
+        double float_s = measure(min_time, [&](long n) {
+            for (long i=0; i<n; i++) e.evalFrames(rows, &fframes[0], fs, &fout[0]);
+        });
+
+        printf("%-18s %-15s %9.3f %9.2f %9.2f %9.2f %11.2f %11.2f", c.name.c_str(),
+               c.category.c_str(), parse_s*1E6, eval_s*1E9, frame_s*1E9, native_s*1E9,
+               batch_rows/1E6, rows/float_s/1E6);
+        if (counters.ok) printf(" %8.1f %8.1f %8.3f", counts[0], counts[1], counts[2]);
+        printf("\n");
+
+        json += "    {\"name\": " + quoted(c.name) +
+            ", \"category\": " + quoted(c.category) +
+            ", \"text\": " + quoted(c.text) +
+            ",\n     \"instructions\": " + number(instructions) +
+            ", \"parse_ns\": " + number(parse_s*1E9) +
+            ", \"eval_ns\": " + number(eval_s*1E9) +
+            ", \"frame_ns\": " + number(frame_s*1E9) +
+            ", \"native_ns\": " + number(native_s*1E9) +
+            ",\n     \"batch_rows_per_sec\": " + number(batch_rows) +
+            ", \"float_batch_rows_per_sec\": " + number(rows / float_s) +
+            ", \"cycles_per_eval\": " + number(counts[0]) +
+            ", \"instructions_per_eval\": " + number(counts[1]) +
+            ", \"branch_misses_per_eval\": " + number(counts[2]) +
+            ",\n     \"scaling\": [" + scale + "]}" + (ci+1 < nc ? ",\n" : "\n");
+    }
+    json += "  ],\n  \"math\": [\n";
+
+    struct { const char *text; double xlo, xhi, ylo, yhi; } fns[] = {
+        {"sin(x)", -100, 100, 0, 0}, {"cos(x)", -100, 100, 0, 0}, {"tan(x)", -100, 100, 0, 0},
+        {"atan(x)", -10, 10, 0, 0}, {"atan2(x, y)", -1, 1, -1, 1}, {"exp(x)", -700, 700, 0, 0},
+        {"log(x)", 1e-6, 1e6, 0, 0}, {"pow(x, y)", 0, 10, -20, 20}, {"floor(x)", -1e3, 1e3, 0, 0},
+    };
+    const char *accuracies[] = { "exact", "accurate", "fast" };
+    printf("\n%-12s %-9s %9s %9s\n", "function", "accuracy", "ns_value", "max_ulp");
+    std::vector<double> xs(rows), ys(rows), ref(rows), out(rows);
+    for (int i=0; i<rows; i++) {
+        xs[i] = rand() / double(RAND_MAX);
+        ys[i] = rand() / double(RAND_MAX);
+    }
+    int nf = sizeof(fns)/sizeof(fns[0]);
+    for (int fi=0; fi<nf; fi++) {
+        std::vector<double> x(rows), y(rows);
+        for (int i=0; i<rows; i++) {
+            x[i] = fns[fi].xlo + (fns[fi].xhi - fns[fi].xlo)*xs[i];
+            y[i] = fns[fi].ylo + (fns[fi].yhi - fns[fi].ylo)*ys[i];
+        }
+        Expr e = Expr::parse(fns[fi].text, vars);
+        std::vector<const double *> cols(e.variableCount());
+        cols[e.variableIndex(&vars["x"])] = &x[0];
+        if (e.variableCount() > 1) cols[e.variableIndex(&vars["y"])] = &y[0];
+        for (int a=Expr::EXACT; a<=Expr::FAST; a++) {
+            e.setAccuracy(Expr::Accuracy(a));
+            double s = measure(min_time, [&](long n) {
+                for (long i=0; i<n; i++) e.eval(rows, &cols[0], &out[0]);
+            });
+            if (a == Expr::EXACT) ref = out;
+            double max_ulp = 0;
+            for (int i=0; i<rows; i++) {
+                double ulp = nextafter(fabs(ref[i]), INFINITY) - fabs(ref[i]);
+                max_ulp = std::max(max_ulp, fabs(out[i] - ref[i]) / ulp);
+            }
+            printf("%-12s %-9s %9.2f %9.2f\n", fns[fi].text, accuracies[a], s/rows*1E9, max_ulp);
+            json += "    {\"function\": " + quoted(fns[fi].text) +
+                ", \"accuracy\": " + quoted(accuracies[a]) +
+                ", \"ns_per_value\": " + number(s/rows*1E9) +
+                ", \"max_ulp\": " + number(max_ulp) + "}" +
+                (fi+1 < nf || a < Expr::FAST ? ",\n" : "\n");
+        }
+    }
+    json += "  ],\n  \"grid\": [\n";
+
+    // Culled grids (one thread) against evalGrid: "disc" has large uniform
+    // areas, no block of "ripple" can be skipped (only the interval
+    // evaluation of the blocks is added)
+    struct { const char *name, *text; } grids[] = {
+        {"disc", "x*x + y*y < 0.5 ? 1 : 0"},
+        {"ripple", "sin(sqrt(x*x + y*y)*10) / (1 + sqrt(x*x + y*y))"},
+    };
+    std::vector<Expr::Axis> axes;
+    axes.push_back(Expr::Axis("x", -1, 2.0/512, 512));
+    axes.push_back(Expr::Axis("y", -1, 2.0/512, 512));
+    std::vector<double> grid(512*512);
+    printf("\n%-12s %9s %9s %9s %9s\n", "grid", "plain_ms", "culled_ms", "ratio", "evaluated");
+    int ng = sizeof(grids)/sizeof(grids[0]);
+    for (int gi=0; gi<ng; gi++) {
+        Expr e = Expr::parse(grids[gi].text, vars);
+        double plain = measure(min_time, [&](long n) {
+            for (long i=0; i<n; i++) e.evalGrid(vars, axes, &grid[0], 1);
+        });
+        int evaluated = 0;
+        double culled = measure(min_time, [&](long n) {
+            for (long i=0; i<n; i++) {
+                evaluated = e.evalGridCulled(vars, axes, &grid[0], -INFINITY, INFINITY, 1);
+            }
+        });
+        printf("%-12s %9.3f %9.3f %9.2f %9i\n", grids[gi].name, plain*1E3, culled*1E3,
+               culled/plain, evaluated);
+        json += "    {\"grid\": " + quoted(grids[gi].name) +
+            ", \"text\": " + quoted(grids[gi].text) +
+            ", \"plain_ms\": " + number(plain*1E3) +
+            ", \"culled_ms\": " + number(culled*1E3) +
+            ", \"evaluated\": " + number(evaluated) + "}" + (gi+1 < ng ? ",\n" : "\n");
+    }
+    json += "  ]\n}\n";
+
+    FILE *f = fopen(output, "w");
+    if (!f) {
+        fprintf(stderr, "Error writing %s\n", output);
+        return 1;
+    }
+    fputs(json.c_str(), f);
+    fclose(f);
+    printf("Results written to %s\n", output);
+    return 0;
+}
@@ -1,248 +1,3250 @@
+// Multiply-add instructions must round like separate operations (as
+// native code and interval evaluation do): no contraction into fused
+// multiply-add, whatever the compiler options
+#if defined(__clang__)
+#pragma STDC FP_CONTRACT OFF
+#elif defined(__GNUC__)
+#pragma GCC optimize("fp-contract=off")
+#elif defined(_MSC_VER)
+#pragma fp_contract(off)
+#endif
+
 #include "expr.h"
 #include <math.h>
+#include <cmath>
 #include <stdio.h>
+#include <float.h>
+#include <algorithm>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <chrono>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define EXPR_RDTSC
+#include <x86intrin.h>
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#define EXPR_MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#if defined(__x86_64__) && (defined(__linux__) || defined(__APPLE__) || defined(__FreeBSD__))
+#define EXPR_JIT
+#include <sys/mman.h>
+#endif
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define EXPR_SIMD
+#endif
+
+/*
+The MIT License (MIT)
+
+Copyright (c) 2014 Andrea Griffini
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+std::map<std::string, std::pair<int, int> > Expr::functions;
+double Expr::undefined = NAN;
+std::vector<double (*)()> Expr::func0;
+std::vector<double (*)(double)> Expr::func1;
+std::vector<double (*)(double,double)> Expr::func2;
+std::vector<Expr::Call> Expr::funcN;
+std::set<std::pair<int, int> > Expr::pureFunctions;
+
+// Copies the code followed by the end opcode using words of type C
+template<typename C>
+static void copyCode(C *c, const std::vector<int>& code, int end) {
+    std::copy(code.begin(), code.end(), c);
+    c[code.size()] = end;
+}
+
+// Narrowest code word holding all the words up to top
+static int codeWidth(unsigned top) {
+    return top < 0x100 ? 1 : top < 0x10000 ? 2 : sizeof(int);
+}
+
+// Allocates the block of a program with the given sizes; the caller
+// fills the arrays and the code
+Expr::Program *Expr::newProgram(int nwrk, int nvariables, int noutputs, int ncode, int width) {
+    size_t bytes = sizeof(Program) + nwrk*sizeof(double) + nvariables*sizeof(double *) +
+                   noutputs*sizeof(int) + (ncode + 1)*width;
+    Program *p = new (::operator new(bytes)) Program();
+    p->refs = 0;
+    p->resreg = 0;
+    p->nwrk = nwrk;
+    p->nvariables = nvariables;
+    p->noutputs = noutputs;
+    p->ncode = ncode;
+    p->rng = -1;
+    p->width = width;
+    return p;
+}
+
+Expr::Expr(const Draft& draft)
+    : native(0), mathAccuracy(EXACT), randomSeed(0), randomRow(0) {
+    int nwrk = draft.wrk.size(), nvariables = draft.variables.size();
+    int ncode = draft.code.size(), noutputs = draft.outputs.size();
+    unsigned top = FUNCN + 1;
+    for (int i=0; i<ncode; i++) top = std::max(top, unsigned(draft.code[i]));
+    int width = codeWidth(top);
+    Program *p = newProgram(nwrk, nvariables, noutputs, ncode, width);
+    p->resreg = draft.resreg;
+    p->rng = draft.rng;
+    p->names = draft.names;
+    double *w = (double *)(p + 1);
+    double **v = (double **)(w + nwrk);
+    int *o = (int *)(v + nvariables);
+    std::copy(draft.wrk.begin(), draft.wrk.end(), w);
+    std::copy(draft.variables.begin(), draft.variables.end(), v);
+    std::copy(draft.outputs.begin(), draft.outputs.end(), o);
+    switch (width) {
+    case 1: copyCode((uint8_t *)(o + noutputs), draft.code, FUNCN + 1); break;
+    case 2: copyCode((uint16_t *)(o + noutputs), draft.code, FUNCN + 1); break;
+    default: copyCode(o + noutputs, draft.code, FUNCN + 1); break;
+    }
+    attach(p);
+}
+
+Expr::Expr(Program *p) : native(0), mathAccuracy(EXACT), randomSeed(0), randomRow(0) {
+    attach(p);
+}
+
+// Constants share a single program for 0 (the default value)
+Expr::Expr(double x) : native(0), mathAccuracy(EXACT), randomSeed(0), randomRow(0) {
+    static const Expr zero = Expr(Draft(1));
+    if (x == 0 && !std::signbit(x)) {
+        attach(zero.program);
+    } else {
+        Draft draft(1);
+        draft.wrk[0] = x;
+        Expr e(draft);
+        attach(e.program);
+    }
+}
+
+void Expr::attach(Program *p) {
+    program = p;
+    p->refs++;
+}
+
+void Expr::detach(Program *p) {
+    if (--p->refs == 0) {
+        p->~Program();
+        ::operator delete(p);
+    }
+}
+
+void Expr::initRegisters(double *regs) const {
+    std::copy(wrk().begin(), wrk().end(), regs);
+    seedRegisters(regs, randomSeed, randomRow);
+}
+
+// The state of random() is the seed (low and high 32 bits) and the row
+// of the next evaluation, all stored exactly as doubles
+void Expr::seedRegisters(double *regs, uint64_t seed, uint64_t row) const {
+    if (program->rng == -1) return;
+    regs[program->rng] = double(seed & 0xffffffff);
+    regs[program->rng + 1] = double(seed >> 32);
+    regs[program->rng + 2] = double(row);
+}
+
+void Expr::setSeed(uint64_t seed, uint64_t row) {
+    randomSeed = seed;
+    randomRow = row;
+    if (!scratch.empty()) seedRegisters(&scratch[0], seed, row);
+}
+
+double *Expr::scratchRegisters() const {
+    if (scratch.empty()) {
+        scratch.resize(wrk().size());
+        initRegisters(&scratch[0]);
+    }
+    return &scratch[0];
+}
+
+// Large frames are kept after the scratch registers so that eval()
+// doesn't allocate
+double Expr::eval() const {
+    int nr = program->nwrk, nv = program->nvariables;
+    if (nv <= LOCAL_FRAME) return eval(scratchRegisters());
+    scratchRegisters();
+    scratch.resize(nr + nv);
+    double * const *v = program->variables();
+    for (int i=0; i<nv; i++) scratch[nr + i] = *v[i];
+    return evalFrame(&scratch[nr], &scratch[0]);
+}
+
+// The current values of the variables are copied in a frame (on the
+// heap only when there are more than LOCAL_FRAME variables)
+double Expr::eval(double *wp) const {
+    int nv = program->nvariables;
+    double * const *v = program->variables();
+    if (nv <= LOCAL_FRAME) {
+        double frame[LOCAL_FRAME];
+        for (int i=0; i<nv; i++) frame[i] = *v[i];
+        return evalFrame(frame, wp);
+    }
+    std::vector<double> frame(nv);
+    for (int i=0; i<nv; i++) frame[i] = *v[i];
+    return evalFrame(&frame[0], wp);
+}
+
+double Expr::evalFrame(const double *frame) const {
+    return evalFrame(frame, scratchRegisters());
+}
+
+double Expr::evalFrame(const double *frame, double *wp) const {
+    if (native) {
+        native(wp, frame);
+    } else {
+#if defined(EXPR_THREADED_DISPATCH)
+        switch (program->width) {
+        case 1: run(program->code<uint8_t>(), wp, frame); break;
+        case 2: run(program->code<uint16_t>(), wp, frame); break;
+        default: run(program->code<int>(), wp, frame); break;
+        }
+#else
+        switch (program->width) {
+        case 1: run(program->code<uint8_t>(), program->end<uint8_t>(), wp, frame); break;
+        case 2: run(program->code<uint16_t>(), program->end<uint16_t>(), wp, frame); break;
+        default: run(program->code<int>(), program->end<int>(), wp, frame); break;
+        }
+#endif
+    }
+    if (program->rng != -1) wp[program->rng + 2] += 1;
+    return wp[program->resreg];
+}
+
+// Frame i starts at frames + i*stride
+void Expr::evalFrames(int n, const double *frames, int stride, double *out) const {
+    int nv = variables().size();
+    std::vector<const double *> cols(nv);
+    std::vector<int> strides(nv, stride);
+    for (int v=0; v<nv; v++) cols[v] = frames + v;
+    eval(n, nv ? &cols[0] : 0, out, nv ? &strides[0] : 0);
+}
+
+void Expr::evalFrames(int n, const float *frames, int stride, float *out) const {
+    int nv = variables().size();
+    std::vector<const float *> cols(nv);
+    std::vector<int> strides(nv, stride);
+    for (int v=0; v<nv; v++) cols[v] = frames + v;
+    eval(n, nv ? &cols[0] : 0, out, nv ? &strides[0] : 0);
+}
+
+int Expr::length(int op) {
+    switch(op) {
+    case NEG: case NOT:
+    case FSIN: case FCOS: case FFLOOR: case FABS: case FSQRT:
+    case FTAN: case FATAN: case FLOG: case FEXP: case JMP:
+        return 2;
+    case ADD3: case SUB3: case MUL3: case DIV3:
+    case LADD: case LSUB: case LMUL: case LDIV:
+    case MADD: case MSUB: case RANDOM: case FUNC2: case FUNCN:
+        return 4;
+    default:
+        return 3;
+    }
+}
+
+#if defined(EXPR_THREADED_DISPATCH)
+// Threaded version of the evaluation loop: each implementation jumps
+// directly to the next one through the table of addresses. The code of
+// a program is followed by an END opcode, so no end pointer is needed.
+template<typename C>
+void Expr::run(const C *cp, double *wp, const double *frame) {
+    static const void * const labels[] = {
+        &&L_MOVE, &&L_LOAD,
+        &&L_NEG, &&L_NOT,
+        &&L_ADD, &&L_SUB, &&L_MUL, &&L_DIV, &&L_LT, &&L_LE, &&L_GT, &&L_GE, &&L_EQ, &&L_NE,
+        &&L_AND, &&L_OR,
+        &&L_B_SHL, &&L_B_SHR, &&L_B_AND, &&L_B_OR, &&L_B_XOR,
+        &&L_FSIN, &&L_FCOS, &&L_FFLOOR, &&L_FABS, &&L_FSQRT, &&L_FTAN, &&L_FATAN, &&L_FLOG,
+        &&L_FEXP, &&L_FATAN2, &&L_FPOW,
+        &&L_ADD_V, &&L_SUB_V, &&L_MUL_V, &&L_DIV_V, &&L_ADD3, &&L_SUB3, &&L_MUL3, &&L_DIV3,
+        &&L_LADD, &&L_LSUB, &&L_LMUL, &&L_LDIV, &&L_MADD, &&L_MSUB,
+        &&L_JMP, &&L_JZ, &&L_JAND, &&L_JOR, &&L_RANDOM,
+        &&L_FUNC0, &&L_FUNC1, &&L_FUNC2, &&L_FUNCN,
+        &&L_END };
+    static_assert(sizeof(labels)/sizeof(labels[0]) == FUNCN + 2, "Missing opcode in labels");
+#define NEXT(n) cp += n; goto *labels[cp[0]]
+    NEXT(0);
+    L_MOVE: wp[cp[1]] = wp[cp[2]]; NEXT(3);
+    L_LOAD: wp[cp[1]] = frame[cp[2]]; NEXT(3);
+    L_NEG: wp[cp[1]] = -wp[cp[1]]; NEXT(2);
+    L_NOT: wp[cp[1]] = !wp[cp[1]]; NEXT(2);
+    L_ADD: wp[cp[1]] += wp[cp[2]]; NEXT(3);
+    L_SUB: wp[cp[1]] -= wp[cp[2]]; NEXT(3);
+    L_MUL: wp[cp[1]] *= wp[cp[2]]; NEXT(3);
+    L_DIV: wp[cp[1]] /= wp[cp[2]]; NEXT(3);
+    L_LT:  wp[cp[1]] = (wp[cp[1]] <  wp[cp[2]]); NEXT(3);
+    L_LE:  wp[cp[1]] = (wp[cp[1]] <= wp[cp[2]]); NEXT(3);
+    L_GT:  wp[cp[1]] = (wp[cp[1]] >  wp[cp[2]]); NEXT(3);
+    L_GE:  wp[cp[1]] = (wp[cp[1]] >= wp[cp[2]]); NEXT(3);
+    L_EQ:  wp[cp[1]] = (wp[cp[1]] == wp[cp[2]]); NEXT(3);
+    L_NE:  wp[cp[1]] = (wp[cp[1]] != wp[cp[2]]); NEXT(3);
+    L_AND: wp[cp[1]] = (wp[cp[1]] && wp[cp[2]]); NEXT(3);
+    L_OR:  wp[cp[1]] = (wp[cp[1]] || wp[cp[2]]); NEXT(3);
+    L_B_OR: wp[cp[1]] = (int(wp[cp[1]]) | int(wp[cp[2]])); NEXT(3);
+    L_B_AND: wp[cp[1]] = (int(wp[cp[1]]) & int(wp[cp[2]])); NEXT(3);
+    L_B_XOR: wp[cp[1]] = (int(wp[cp[1]]) ^ int(wp[cp[2]])); NEXT(3);
+    L_B_SHL: wp[cp[1]] = int(unsigned(int(wp[cp[1]])) << (int(wp[cp[2]]) & 31)); NEXT(3);
+    L_B_SHR: wp[cp[1]] = (int(wp[cp[1]]) >> (int(wp[cp[2]]) & 31)); NEXT(3);
+    L_FFLOOR: wp[cp[1]] = floor(wp[cp[1]]); NEXT(2);
+    L_FABS: wp[cp[1]] = fabs(wp[cp[1]]); NEXT(2);
+    L_FSIN: wp[cp[1]] = sin(wp[cp[1]]); NEXT(2);
+    L_FCOS: wp[cp[1]] = cos(wp[cp[1]]); NEXT(2);
+    L_FSQRT: wp[cp[1]] = sqrt(wp[cp[1]]); NEXT(2);
+    L_FTAN: wp[cp[1]] = tan(wp[cp[1]]); NEXT(2);
+    L_FATAN: wp[cp[1]] = atan(wp[cp[1]]); NEXT(2);
+    L_FLOG: wp[cp[1]] = log(wp[cp[1]]); NEXT(2);
+    L_FEXP: wp[cp[1]] = exp(wp[cp[1]]); NEXT(2);
+    L_FATAN2: wp[cp[1]] = atan2(wp[cp[1]], wp[cp[2]]); NEXT(3);
+    L_FPOW: wp[cp[1]] = pow(wp[cp[1]], wp[cp[2]]); NEXT(3);
+    L_ADD_V: wp[cp[1]] += frame[cp[2]]; NEXT(3);
+    L_SUB_V: wp[cp[1]] -= frame[cp[2]]; NEXT(3);
+    L_MUL_V: wp[cp[1]] *= frame[cp[2]]; NEXT(3);
+    L_DIV_V: wp[cp[1]] /= frame[cp[2]]; NEXT(3);
+    L_ADD3: wp[cp[1]] = wp[cp[2]] + wp[cp[3]]; NEXT(4);
+    L_SUB3: wp[cp[1]] = wp[cp[2]] - wp[cp[3]]; NEXT(4);
+    L_MUL3: wp[cp[1]] = wp[cp[2]] * wp[cp[3]]; NEXT(4);
+    L_DIV3: wp[cp[1]] = wp[cp[2]] / wp[cp[3]]; NEXT(4);
+    L_LADD: wp[cp[1]] = frame[cp[2]] + wp[cp[3]]; NEXT(4);
+    L_LSUB: wp[cp[1]] = frame[cp[2]] - wp[cp[3]]; NEXT(4);
+    L_LMUL: wp[cp[1]] = frame[cp[2]] * wp[cp[3]]; NEXT(4);
+    L_LDIV: wp[cp[1]] = frame[cp[2]] / wp[cp[3]]; NEXT(4);
+    L_MADD: wp[cp[1]] += wp[cp[2]] * wp[cp[3]]; NEXT(4);
+    L_MSUB: wp[cp[1]] -= wp[cp[2]] * wp[cp[3]]; NEXT(4);
+    L_JMP: NEXT(cp[1]);
+    L_JZ: if (!wp[cp[1]]) { NEXT(cp[2]); } NEXT(3);
+    L_JAND: if (!wp[cp[1]]) { wp[cp[1]] = 0; NEXT(cp[2]); } NEXT(3);
+    L_JOR: if (wp[cp[1]]) { wp[cp[1]] = 1; NEXT(cp[2]); } NEXT(3);
+    L_RANDOM: wp[cp[1]] = random(wp + cp[2], cp[3]); NEXT(4);
+    L_FUNC0: wp[cp[2]] = func0[cp[1]](); NEXT(3);
+    L_FUNC1: wp[cp[2]] = func1[cp[1]](wp[cp[2]]); NEXT(3);
+    L_FUNC2: wp[cp[2]] = func2[cp[1]](wp[cp[2]], wp[cp[3]]); NEXT(4);
+    L_FUNCN: wp[cp[2]] = funcN[cp[1]].f(funcN[cp[1]].context, wp + cp[3]); NEXT(4);
+    L_END: return;
+#undef NEXT
+}
+#endif
+
+// Executes the instruction at cp and returns the next one
+template<typename C>
+inline const C *Expr::step(const C *cp, double *wp, const double *frame) {
+    switch(cp[0]) {
+    case MOVE: wp[cp[1]] = wp[cp[2]]; cp+=3; break;
+    case LOAD: wp[cp[1]] = frame[cp[2]]; cp+=3; break;
+    case NEG: wp[cp[1]] = -wp[cp[1]]; cp+=2; break;
+    case NOT: wp[cp[1]] = !wp[cp[1]]; cp+=2; break;
+    case ADD: wp[cp[1]] += wp[cp[2]]; cp+=3; break;
+    case SUB: wp[cp[1]] -= wp[cp[2]]; cp+=3; break;
+    case MUL: wp[cp[1]] *= wp[cp[2]]; cp+=3; break;
+    case DIV: wp[cp[1]] /= wp[cp[2]]; cp+=3; break;
+    case LT:  wp[cp[1]] = (wp[cp[1]] <  wp[cp[2]]); cp+=3; break;
+    case LE:  wp[cp[1]] = (wp[cp[1]] <= wp[cp[2]]); cp+=3; break;
+    case GT:  wp[cp[1]] = (wp[cp[1]] >  wp[cp[2]]); cp+=3; break;
+    case GE:  wp[cp[1]] = (wp[cp[1]] >= wp[cp[2]]); cp+=3; break;
+    case EQ:  wp[cp[1]] = (wp[cp[1]] == wp[cp[2]]); cp+=3; break;
+    case NE:  wp[cp[1]] = (wp[cp[1]] != wp[cp[2]]); cp+=3; break;
+    case AND: wp[cp[1]] = (wp[cp[1]] && wp[cp[2]]); cp+=3; break;
+    case OR:  wp[cp[1]] = (wp[cp[1]] || wp[cp[2]]); cp+=3; break;
+    case B_OR: wp[cp[1]] = (int(wp[cp[1]]) | int(wp[cp[2]])); cp+=3; break;
+    case B_AND: wp[cp[1]] = (int(wp[cp[1]]) & int(wp[cp[2]])); cp+=3; break;
+    case B_XOR: wp[cp[1]] = (int(wp[cp[1]]) ^ int(wp[cp[2]])); cp+=3; break;
+    case B_SHL: wp[cp[1]] = int(unsigned(int(wp[cp[1]])) << (int(wp[cp[2]]) & 31)); cp+=3; break;
+    case B_SHR: wp[cp[1]] = (int(wp[cp[1]]) >> (int(wp[cp[2]]) & 31)); cp+=3; break;
+    case FFLOOR: wp[cp[1]] = floor(wp[cp[1]]); cp+=2; break;
+    case FABS: wp[cp[1]] = fabs(wp[cp[1]]); cp+=2; break;
+    case FSIN: wp[cp[1]] = sin(wp[cp[1]]); cp+=2; break;
+    case FCOS: wp[cp[1]] = cos(wp[cp[1]]); cp+=2; break;
+    case FSQRT: wp[cp[1]] = sqrt(wp[cp[1]]); cp+=2; break;
+    case FTAN: wp[cp[1]] = tan(wp[cp[1]]); cp+=2; break;
+    case FATAN: wp[cp[1]] = atan(wp[cp[1]]); cp+=2; break;
+    case FLOG: wp[cp[1]] = log(wp[cp[1]]); cp+=2; break;
+    case FEXP: wp[cp[1]] = exp(wp[cp[1]]); cp+=2; break;
+    case FATAN2: wp[cp[1]] = atan2(wp[cp[1]], wp[cp[2]]); cp+=3; break;
+    case FPOW: wp[cp[1]] = pow(wp[cp[1]], wp[cp[2]]); cp+=3; break;
+    case ADD_V: wp[cp[1]] += frame[cp[2]]; cp+=3; break;
+    case SUB_V: wp[cp[1]] -= frame[cp[2]]; cp+=3; break;
+    case MUL_V: wp[cp[1]] *= frame[cp[2]]; cp+=3; break;
+    case DIV_V: wp[cp[1]] /= frame[cp[2]]; cp+=3; break;
+    case ADD3: wp[cp[1]] = wp[cp[2]] + wp[cp[3]]; cp+=4; break;
+    case SUB3: wp[cp[1]] = wp[cp[2]] - wp[cp[3]]; cp+=4; break;
+    case MUL3: wp[cp[1]] = wp[cp[2]] * wp[cp[3]]; cp+=4; break;
+    case DIV3: wp[cp[1]] = wp[cp[2]] / wp[cp[3]]; cp+=4; break;
+    case LADD: wp[cp[1]] = frame[cp[2]] + wp[cp[3]]; cp+=4; break;
+    case LSUB: wp[cp[1]] = frame[cp[2]] - wp[cp[3]]; cp+=4; break;
+    case LMUL: wp[cp[1]] = frame[cp[2]] * wp[cp[3]]; cp+=4; break;
+    case LDIV: wp[cp[1]] = frame[cp[2]] / wp[cp[3]]; cp+=4; break;
+    case MADD: wp[cp[1]] += wp[cp[2]] * wp[cp[3]]; cp+=4; break;
+    case MSUB: wp[cp[1]] -= wp[cp[2]] * wp[cp[3]]; cp+=4; break;
+    case JMP: cp += cp[1]; break;
+    case JZ: cp += !wp[cp[1]] ? cp[2] : 3; break;
+    case JAND: if (!wp[cp[1]]) { wp[cp[1]] = 0; cp += cp[2]; } else cp += 3; break;
+    case JOR: if (wp[cp[1]]) { wp[cp[1]] = 1; cp += cp[2]; } else cp += 3; break;
+    case RANDOM: wp[cp[1]] = random(wp + cp[2], cp[3]); cp+=4; break;
+    case FUNC0: wp[cp[2]] = func0[cp[1]](); cp+=3; break;
+    case FUNC1: wp[cp[2]] = func1[cp[1]](wp[cp[2]]); cp+=3; break;
+    case FUNC2: wp[cp[2]] = func2[cp[1]](wp[cp[2]], wp[cp[3]]); cp+=4; break;
+    case FUNCN: wp[cp[2]] = funcN[cp[1]].f(funcN[cp[1]].context, wp + cp[3]); cp+=4; break;
+    }
+    return cp;
+}
+
+template<typename C>
+void Expr::run(const C *cp, const C *ce, double *wp, const double *frame) {
+    while (cp != ce) cp = step(cp, wp, frame);
+}
+
+// Philox4x32-10 (Salmon et al., "Parallel random numbers: as easy as
+// 1, 2, 3"): the 128 bit counter is mixed with the 64 bit key by ten
+// rounds of multiplications, so any counter can be computed directly
+static inline void philox(uint32_t c[4], uint32_t k0, uint32_t k1) {
+    for (int r=0; r<10; r++) {
+        uint64_t p0 = uint64_t(0xD2511F53u)*c[0], p1 = uint64_t(0xCD9E8D57u)*c[2];
+        uint32_t x0 = uint32_t(p1 >> 32) ^ c[1] ^ k0, x2 = uint32_t(p0 >> 32) ^ c[3] ^ k1;
+        c[1] = uint32_t(p1);
+        c[3] = uint32_t(p0);
+        c[0] = x0;
+        c[2] = x2;
+        k0 += 0x9E3779B9u;
+        k1 += 0xBB67AE85u;
+    }
+}
+
+// Value in [0, 1) made of the high 52 bits of the first two words
+// generated for counter (row, site, 0) and the seed as key
+static inline double philoxUnit(uint64_t seed, uint64_t row, int site) {
+    uint32_t c[4] = { uint32_t(row), uint32_t(row >> 32), uint32_t(site), 0 };
+    philox(c, uint32_t(seed), uint32_t(seed >> 32));
+    uint64_t u = 0x3ff0000000000000ULL | (uint64_t(c[0]) << 20) | (c[1] >> 12);
+    double d;
+    memcpy(&d, &u, sizeof(d));
+    return d - 1.0;
+}
+
+double Expr::random(const double *state, int site) {
+    uint64_t seed = uint64_t(state[0]) | (uint64_t(state[1]) << 32);
+    return philoxUnit(seed, uint64_t(state[2]), site);
+}
+
+// Values of rows row, row+1 ... (the loop has no branches and can be
+// vectorized); a double close to 1 would round to 1 as float
+template<typename T>
+void Expr::random(uint64_t seed, uint64_t row, int site, int n, T *out) {
+    const T top = T(1) - std::numeric_limits<T>::epsilon()/2;
+    for (int i=0; i<n; i++) out[i] = std::min(T(philoxUnit(seed, row + i, site)), top);
+}
+
+// Returns a pointer to m contiguous values of variable v starting from
+// row i0, copying them in tmp if they are not already contiguous
+template<typename T>
+struct Expr::Columns {
+    const T * const *columns;
+    const int *strides;
+    double * const *variables;
+
+    const T *operator()(int v, int i0, int m, T *tmp) const {
+        const T *col = columns ? columns[v] : 0;
+        int stride = strides ? strides[v] : 1;
+        if (col == 0) {
+            std::fill(tmp, tmp+m, T(*variables[v]));
+            return tmp;
+        } else if (stride == 1) {
+            return col + i0;
+        }
+        col += i0*stride;
+        for (int i=0; i<m; i++) tmp[i] = col[i*stride];
+        return tmp;
+    }
+};
+
+void Expr::initBatchRegisters(double *regs) const {
+    const double *w = program->wrk();
+    for (int r=0,nr=program->nwrk; r<nr; r++) {
+        std::fill(regs + r*BATCH_SIZE, regs + (r+1)*BATCH_SIZE, w[r]);
+    }
+}
+
+void Expr::initBatchRegisters(float *regs) const {
+    const double *w = program->wrk();
+    for (int r=0,nr=program->nwrk; r<nr; r++) {
+        std::fill(regs + r*BATCH_SIZE, regs + (r+1)*BATCH_SIZE, float(w[r]));
+    }
+}
+
+void Expr::eval(int n, const double * const *columns, double *out, const int *strides) const {
+    std::vector<double> regs(wrk().size()*BATCH_SIZE);
+    initBatchRegisters(&regs[0]);
+    batch(n, columns, out, strides, &regs[0], randomRow);
+}
+
+void Expr::eval(int n, const double * const *columns, double *out, const int *strides,
+                double *regs) const {
+    batch(n, columns, out, strides, regs, randomRow);
+}
+
+void Expr::eval(int n, const float * const *columns, float *out, const int *strides) const {
+    std::vector<float> regs(wrk().size()*BATCH_SIZE);
+    initBatchRegisters(&regs[0]);
+    batch(n, columns, out, strides, &regs[0], randomRow);
+}
+
+void Expr::eval(int n, const float * const *columns, float *out, const int *strides,
+                float *regs) const {
+    batch(n, columns, out, strides, regs, randomRow);
+}
+
+// Vectorized math functions for batch evaluation with ACCURATE or FAST
+// accuracy. The kernels are branch-free versions of the fdlibm algorithms
+// (bit masks instead of conditionals, so that the compiler can vectorize
+// the loops) compiled for AVX2 and for AVX-512, the variant is picked at
+// run time. Arguments that a kernel doesn't handle (non finite, huge,
+// results that would be subnormal...) give NaN and are then computed
+// again with the C library.
+//
+// The compensated steps (hi + lo splits of the argument reduction and of
+// constants) need every operation rounded separately: the kernels turn
+// off the contraction into fused multiply-add themselves, also when the
+// rest of the file is compiled differently.
+#if defined(EXPR_SIMD) && defined(__clang__)
+#pragma clang fp contract(off)
+#elif defined(EXPR_SIMD)
+#pragma GCC push_options
+#pragma GCC optimize("fp-contract=off")
+#endif
+struct Expr::VectorMath {
+#if defined(EXPR_SIMD)
+#define EXPR_INLINE inline __attribute__((always_inline))
+    static EXPR_INLINE double fromBits(uint64_t u) { double d; memcpy(&d, &u, 8); return d; }
+    static EXPR_INLINE uint64_t toBits(double d) { uint64_t u; memcpy(&u, &d, 8); return u; }
+
+    // c ? a : b without branches
+    static EXPR_INLINE double pick(bool c, double a, double b) {
+        uint64_t m = -uint64_t(c);
+        return fromBits((toBits(a) & m) | (toBits(b) & ~m));
+    }
+
+    // x with the low 32 bits of the mantissa cleared
+    static EXPR_INLINE double high(double x) {
+        return fromBits(toBits(x) & 0xffffffff00000000ULL);
+    }
+
+    // x with the sign flipped when s is negative
+    static EXPR_INLINE double flipSign(double x, double s) {
+        return fromBits(toBits(x) ^ (toBits(s) & 0x8000000000000000ULL));
+    }
+
+    // Adding 1.5*2^52 rounds |x| < 2^51 to an integer that is then in the
+    // low bits of the result
+    static EXPR_INLINE double shifter() { return 6755399441055744.0; }
+
+    static EXPR_INLINE double toDouble(int64_t k) {
+        return fromBits(toBits(shifter()) + uint64_t(k)) - shifter();
+    }
+
+    static EXPR_INLINE double pow2(int64_t k) {
+        return fromBits(uint64_t(k + 1023) << 52);
+    }
+
+    // x = k*pi/2 + hi + lo for |x| < 2^20*pi/2, returns k in the low bits
+    // (FAST skips the last step of the reduction). fdlibm does the last
+    // step only after a cancellation, when r = u - w is exact; here it is
+    // always done, so the rounding error of r is carried into it.
+    template<bool fast>
+    static EXPR_INLINE uint64_t reduce(double x, double& hi, double& lo) {
+        double t = x*6.36619772367581382433e-01 + shifter();
+        double k = t - shifter();
+        double r = x - k*1.57079632673412561417e+00, u = r;
+        double w = k*6.07710050630396597660e-11;
+        r = u - w;
+        if (fast) {
+            w = k*2.02226624879595063154e-21 - ((u - r) - w);
+        } else {
+            w = k*2.02226624871116645580e-21 - ((u - r) - w);
+            u = r;
+            r = u - w;
+            w = k*8.47842766036889956997e-32 - ((u - r) - w);
+        }
+        hi = r - w;
+        lo = (r - hi) - w;
+        return toBits(t);
+    }
+
+    // sin and cos of hi + lo for |hi + lo| <= pi/4
+    static EXPR_INLINE double sinKernel(double x, double y) {
+        double z = x*x, w = z*z, v = z*x;
+        double r = 8.33333333332248946124e-03 + z*(-1.98412698298579493134e-04 +
+                   z*2.75573137070700676789e-06) +
+                   z*w*(-2.50507602534068634195e-08 + z*1.58969099521155010221e-10);
+        return x - ((z*(0.5*y - v*r) - y) - v*-1.66666666666666324348e-01);
+    }
+
+    static EXPR_INLINE double cosKernel(double x, double y) {
+        double z = x*x, w = z*z;
+        double r = z*(4.16666666666666019037e-02 + z*(-1.38888888888741095749e-03 +
+                   z*2.48015872894767294178e-05)) +
+                   w*w*(-2.75573143513906633035e-07 + z*(2.08757232129817482790e-09 +
+                   z*-1.13596475577881948265e-11));
+        double hz = 0.5*z, o = 1.0 - hz;
+        return o + (((1.0 - o) - hz) + (z*r - x*y));
+    }
+
+    // tan(hi + lo) or -1/tan(hi + lo) for |hi + lo| <= pi/4
+    static EXPR_INLINE double tanKernel(double x, double y, bool odd) {
+        bool big = fabs(x) >= 0.6744;
+        double bx = (7.85398163397448278999e-01 - fabs(x)) + (3.06161699786838301793e-17 - flipSign(y, x));
+        double sx = x;
+        x = pick(big, bx, x);
+        y = pick(big, 0.0, y);
+        double z = x*x, w = z*z;
+        double r = 1.33333333333201242699e-01 + w*(2.18694882948595424599e-02 +
+                   w*(3.59207910759131235356e-03 + w*(5.88041240820264096874e-04 +
+                   w*(7.81794442939557092300e-05 + w*-1.85586374855275456654e-05))));
+        double v = z*(5.39682539762260521377e-02 + w*(8.86323982359930005737e-03 +
+                   w*(1.45620945432529025516e-03 + w*(2.46463134818469906812e-04 +
+                   w*(7.14072491382608190305e-05 + w*2.59073051863633712884e-05)))));
+        double s = z*x;
+        r = y + z*(s*(r + v) + y);
+        r += 3.33333333333334091986e-01*s;
+        w = x + r;
+        double iy = pick(odd, -1.0, 1.0);
+        double rb = flipSign(iy - 2.0*(x - (w*w/(w + iy) - r)), sx);
+        // -1/w computed accurately
+        double hw = high(w), lw = r - (hw - x);
+        double a = -1.0/w, t = high(a);
+        double ro = t + a*((1.0 + t*hw) + t*lw);
+        return pick(big, rb, pick(odd, ro, w));
+    }
+
+    template<bool fast>
+    static EXPR_INLINE double sin(double x) {
+        double hi, lo;
+        uint64_t q = reduce<fast>(x, hi, lo);
+        double r = pick(q & 1, cosKernel(hi, lo), sinKernel(hi, lo));
+        r = fromBits(toBits(r) ^ ((q & 2) << 62));
+        return pick(fabs(x) < 1e6, r, NAN);
+    }
+
+    template<bool fast>
+    static EXPR_INLINE double cos(double x) {
+        double hi, lo;
+        uint64_t q = reduce<fast>(x, hi, lo);
+        double r = pick(q & 1, sinKernel(hi, lo), cosKernel(hi, lo));
+        r = fromBits(toBits(r) ^ (((q + 1) & 2) << 62));
+        return pick(fabs(x) < 1e6, r, NAN);
+    }
+
+    // FAST divides sin by cos
+    template<bool fast>
+    static EXPR_INLINE double tan(double x) {
+        double hi, lo, r;
+        uint64_t q = reduce<fast>(x, hi, lo);
+        if (fast) {
+            double s = sinKernel(hi, 0.0), c = cosKernel(hi, 0.0);
+            r = pick(q & 1, -c/s, s/c);
+        } else {
+            r = pick(x == 0, x, tanKernel(hi, lo, q & 1));
+        }
+        return pick(fabs(x) < 1e6, r, NAN);
+    }
+
+    static EXPR_INLINE double exp(double x) {
+        double t = x*1.44269504088896338700e+00 + shifter();
+        int64_t k = int64_t(toBits(t) - toBits(shifter()));
+        double dk = t - shifter();
+        double hi = x - dk*6.93147180369123816490e-01, lo = dk*1.90821492927058770002e-10;
+        double r = hi - lo, z = r*r;
+        double c = r - z*(1.66666666666666019037e-01 + z*(-2.77777777770155933842e-03 +
+                   z*(6.61375632143793436117e-05 + z*(-1.65339022054652515390e-06 +
+                   z*4.13813679705723846039e-08))));
+        double y = (1.0 - ((lo - (r*c)/(2.0 - c)) - hi))*pow2(k);
+        return pick(fabs(x) <= 708.0, y, NAN);
+    }
+
+    static EXPR_INLINE double log(double x) {
+        uint64_t bits = toBits(x);
+        int64_t hx = int64_t(bits >> 32);
+        int64_t k = (hx >> 20) - 1023;
+        hx &= 0xfffff;
+        int64_t i = (hx + 0x95f64) & 0x100000;
+        double m = fromBits((uint64_t(hx | (i ^ 0x3ff00000)) << 32) | (bits & 0xffffffffu));
+        double dk = toDouble(k + (i >> 20));
+        double f = m - 1.0;
+        double s = f/(2.0 + f), z = s*s, w = z*z;
+        double t1 = w*(3.999999999940941908e-01 + w*(2.222219843214978396e-01 +
+                    w*1.531383769920937332e-01));
+        double t2 = z*(6.666666666666735130e-01 + w*(2.857142874366239149e-01 +
+                    w*(1.818357216161805012e-01 + w*1.479819860511658591e-01)));
+        double hfsq = 0.5*f*f;
+        double r = dk*6.93147180369123816490e-01 -
+                   ((hfsq - (s*(hfsq + t2 + t1) + dk*1.90821492927058770002e-10)) - f);
+        return pick((x >= DBL_MIN) & (x <= DBL_MAX), r, NAN);
+    }
+
+    // atan of x >= 0 (FAST ignores the low parts of the constants)
+    template<bool fast>
+    static EXPR_INLINE double atanPositive(double ax) {
+        bool c0 = ax < 0.6875, c1 = ax < 1.1875, c2 = ax < 2.4375;
+        double num = pick(c0, 2.0*ax - 1.0, pick(c1, ax - 1.0, pick(c2, ax - 1.5, -1.0)));
+        double den = pick(c0, 2.0 + ax, pick(c1, ax + 1.0, pick(c2, 1.0 + 1.5*ax, ax)));
+        double hi = pick(c0, 4.63647609000806093515e-01, pick(c1, 7.85398163397448278999e-01,
+                    pick(c2, 9.82793723247329054082e-01, 1.57079632679489655800e+00)));
+        double lo = fast ? 0.0 : pick(c0, 2.26987774529616870924e-17,
+                    pick(c1, 3.06161699786838301793e-17,
+                    pick(c2, 1.39033110312309984516e-17, 6.12323399573676603587e-17)));
+        bool small = ax < 0.4375;
+        double x = pick(small, ax, num/den);
+        double z = x*x, w = z*z;
+        double s1 = z*(3.33333333333329318027e-01 + w*(1.42857142725034663711e-01 +
+                    w*(9.09088713343650656196e-02 + w*(6.66107313738753120669e-02 +
+                    w*(4.97687799461593236017e-02 + w*1.62858201153657823623e-02)))));
+        double s2 = w*(-1.99999999998764832476e-01 + w*(-1.11111104054623557880e-01 +
+                    w*(-7.69187620504482999495e-02 + w*(-5.83357013379057348645e-02 +
+                    w*-3.65315727442169155270e-02))));
+        double p = x*(s1 + s2);
+        return pick(small, x - p, hi - ((p - lo) - x));
+    }
+
+    template<bool fast>
+    static EXPR_INLINE double atan(double x) {
+        return flipSign(atanPositive<fast>(fabs(x)), x);
+    }
+
+    template<bool fast>
+    static EXPR_INLINE double atan2(double y, double x) {
+        double t = fabs(y)/fabs(x);
+        double a = atanPositive<fast>(t);
+        a = pick(x < 0, 3.1415926535897931160e+00 - (a - 1.2246467991473531772e-16), a);
+        bool ok = (t >= DBL_MIN) & (t <= DBL_MAX) & (fabs(x) <= DBL_MAX);
+        return pick(ok, flipSign(a, y), NAN);
+    }
+
+    // log2(x) in extra precision and then 2^(y*log2(x)) as in fdlibm
+    static EXPR_INLINE double pow(double x, double y) {
+        uint64_t bits = toBits(x);
+        int64_t ix = int64_t(bits >> 32);
+        int64_t n = (ix >> 20) - 0x3ff, j = ix & 0xfffff;
+        bool k = (j > 0x3988e) & (j < 0xbb67a), up = j >= 0xbb67a;
+        n += up;
+        ix = (j | 0x3ff00000) - (int64_t(up) << 20);
+        double ax = fromBits((uint64_t(ix) << 32) | (bits & 0xffffffffu));
+        double bp = pick(k, 1.5, 1.0);
+        double dp_h = pick(k, 5.84962487220764160156e-01, 0.0);
+        double dp_l = pick(k, 1.35003920212974897128e-08, 0.0);
+        double u = ax - bp, v = 1.0/(ax + bp), ss = u*v, s_h = high(ss);
+        double t_h = fromBits(uint64_t(((ix >> 1) | 0x20000000) + 0x00080000 + (int64_t(k) << 18)) << 32);
+        double t_l = ax - (t_h - bp);
+        double s_l = v*((u - s_h*t_h) - s_h*t_l);
+        double s2 = ss*ss;
+        double r = s2*s2*(5.99999999999994648725e-01 + s2*(4.28571428578550184252e-01 +
+                   s2*(3.33333329818377432918e-01 + s2*(2.72728123808534006489e-01 +
+                   s2*(2.30660745775561754067e-01 + s2*2.06975017800338417784e-01)))));
+        r += s_l*(s_h + ss);
+        s2 = s_h*s_h;
+        t_h = high(3.0 + s2 + r);
+        t_l = r - ((t_h - 3.0) - s2);
+        u = s_h*t_h;
+        v = s_l*t_h + t_l*ss;
+        double p_h = high(u + v), p_l = v - (p_h - u);
+        double z_h = 9.61796700954437255859e-01*p_h;
+        double z_l = -7.02846165095275826516e-09*p_h + p_l*9.61796693925975554329e-01 + dp_l;
+        double t = toDouble(n);
+        double t1 = high(((z_h + z_l) + dp_h) + t);
+        double t2 = z_l - (((t1 - t) - dp_h) - z_h);
+        double y1 = high(y);
+        p_l = (y - y1)*t1 + y*t2;
+        p_h = y1*t1;
+        double z = p_l + p_h;
+        double e = z + shifter();
+        int64_t m = int64_t(toBits(e) - toBits(shifter()));
+        p_h -= e - shifter();
+        t = high(p_l + p_h);
+        u = t*6.93147182464599609375e-01;
+        v = (p_l - (t - p_h))*6.93147180559945286227e-01 + t*-1.90465429995776804525e-09;
+        double w = u + v, c = v - (w - u);
+        t = w*w;
+        t1 = w - t*(1.66666666666666019037e-01 + t*(-2.77777777770155933842e-03 +
+             t*(6.61375632143793436117e-05 + t*(-1.65339022054652515390e-06 +
+             t*4.13813679705723846039e-08))));
+        r = (w*t1)/(t1 - 2.0) - (c + w*c);
+        w = (1.0 - (r - w))*pow2(m);
+        bool ok = (x >= DBL_MIN) & (x <= DBL_MAX) & (fabs(z) < 1020.0);
+        return pick(ok, w, NAN);
+    }
+
+    static EXPR_INLINE double floor(double x) {
+        double t = flipSign((fabs(x) + 4503599627370496.0) - 4503599627370496.0, x);
+        t = t - pick(t > x, 1.0, 0.0);
+        return pick(fabs(x) < 4503599627370496.0, t, x);
+    }
+
+    // Computes r[i] = op(a[i], b[i]) and returns true if some result is
+    // NaN (possibly because the argument is not handled)
+#define EXPR_KERNELS(name, isa) \
+    template<bool fast> __attribute__((target(isa))) \
+    static void name##Loops(int op, double *r, const double *a, const double *b, int n) { \
+        switch(op) { \
+        case FSIN: for (int i=0; i<n; i++) r[i] = sin<fast>(a[i]); break; \
+        case FCOS: for (int i=0; i<n; i++) r[i] = cos<fast>(a[i]); break; \
+        case FTAN: for (int i=0; i<n; i++) r[i] = tan<fast>(a[i]); break; \
+        case FATAN: for (int i=0; i<n; i++) r[i] = atan<fast>(a[i]); break; \
+        case FATAN2: for (int i=0; i<n; i++) r[i] = atan2<fast>(a[i], b[i]); break; \
+        case FEXP: for (int i=0; i<n; i++) r[i] = exp(a[i]); break; \
+        case FLOG: for (int i=0; i<n; i++) r[i] = log(a[i]); break; \
+        case FPOW: for (int i=0; i<n; i++) r[i] = pow(a[i], b[i]); break; \
+        case FFLOOR: for (int i=0; i<n; i++) r[i] = floor(a[i]); break; \
+        } \
+    } \
+    __attribute__((target(isa))) \
+    static bool name(int op, double *r, const double *a, const double *b, int n, bool fast) { \
+        if (fast) name##Loops<true>(op, r, a, b, n); else name##Loops<false>(op, r, a, b, n); \
+        bool nan = false; \
+        for (int i=0; i<n; i++) nan |= r[i] != r[i]; \
+        return nan; \
+    }
+
+    EXPR_KERNELS(avx2, "avx2,fma")
+    EXPR_KERNELS(avx512, "avx512f,avx2,fma")
+#undef EXPR_KERNELS
+#undef EXPR_INLINE
+
+    typedef bool (*Kernels)(int op, double *r, const double *a, const double *b, int n, bool fast);
+
+    static Kernels kernels() {
+        switch(level().load()) {
+        case VECTOR_AVX512: return avx512;
+        case VECTOR_AVX2: return avx2;
+        }
+        return 0;
+    }
+#endif
+
+    // Best level for this CPU
+    static VectorLevel supported() {
+#if defined(EXPR_SIMD)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f")) return VECTOR_AVX512;
+        if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) return VECTOR_AVX2;
+#endif
+        return VECTOR_NONE;
+    }
+
+    // Level in use (supported() unless lowered by setVectorLevel)
+    static std::atomic<int>& level() {
+        static std::atomic<int> current(supported());
+        return current;
+    }
+
+    // True if there is a kernel for op (and for this CPU)
+    static bool handles(int op) {
+        switch(op) {
+        case FSIN: case FCOS: case FTAN: case FATAN: case FATAN2:
+        case FEXP: case FLOG: case FPOW: case FFLOOR:
+            return level().load() != VECTOR_NONE;
+        }
+        return false;
+    }
+
+    // Computes a[i] = op(a[i], b[i]) for the n rows of a block, false if
+    // op is not handled
+    static bool eval(int op, double *a, const double *b, int n, bool fast) {
+        if (!handles(op)) return false;
+#if defined(EXPR_SIMD)
+        // The level is read once, another thread may change it
+        Kernels k = kernels();
+        if (!k) return false;
+        double r[BATCH_SIZE];
+        if (k(op, r, a, b, n, fast)) {
+            for (int i=0; i<n; i++) {
+                if (r[i] != r[i]) {
+                    double x = a[i], y = (op == FATAN2 || op == FPOW) ? b[i] : 0.0;
+                    switch(op) {
+                    case FSIN: r[i] = std::sin(x); break;
+                    case FCOS: r[i] = std::cos(x); break;
+                    case FTAN: r[i] = std::tan(x); break;
+                    case FATAN: r[i] = std::atan(x); break;
+                    case FATAN2: r[i] = std::atan2(x, y); break;
+                    case FEXP: r[i] = std::exp(x); break;
+                    case FLOG: r[i] = std::log(x); break;
+                    case FPOW: r[i] = std::pow(x, y); break;
+                    case FFLOOR: r[i] = std::floor(x); break;
+                    }
+                }
+            }
+        }
+        std::copy(r, r+n, a);
+#else
+        (void)a; (void)b; (void)n; (void)fast;
+#endif
+        return true;
+    }
+
+    // float registers are computed in double precision
+    static bool eval(int op, float *a, const float *b, int n, bool fast) {
+        if (!handles(op)) return false;
+        double x[BATCH_SIZE], y[BATCH_SIZE];
+        std::copy(a, a+n, x);
+        if (op == FATAN2 || op == FPOW) std::copy(b, b+n, y);
+        if (!eval(op, x, y, n, fast)) return false;
+        std::copy(x, x+n, a);
+        return true;
+    }
+};
+#if defined(EXPR_SIMD) && !defined(__clang__)
+#pragma GCC pop_options
+#endif
+
+Expr::VectorLevel Expr::vectorLevel() {
+    return VectorLevel(VectorMath::level().load());
+}
+
+bool Expr::setVectorLevel(VectorLevel level) {
+    if (level < VECTOR_NONE || level > VectorMath::supported()) return false;
+    VectorMath::level() = level;
+    return true;
+}
+
+// Batch evaluation with registers of type T (double or float); row is
+// the row of random() for the first value
+template<typename T>
+void Expr::batch(int n, const T * const *columns, T *out, const int *strides, T *wp,
+                 uint64_t row) const {
+    switch (program->width) {
+    case 1: batch(n, columns, out, strides, wp, row, program->code<uint8_t>()); break;
+    case 2: batch(n, columns, out, strides, wp, row, program->code<uint16_t>()); break;
+    default: batch(n, columns, out, strides, wp, row, program->code<int>()); break;
+    }
+}
+
+template<typename T, typename C>
+void Expr::batch(int n, const T * const *columns, T *out, const int *strides, T *wp,
+                 uint64_t row, const C *c0) const {
+    const int B = BATCH_SIZE;
+    T tmp[BATCH_SIZE];
+    std::vector<double> args;
+    std::vector<const double *> argp;
+    Columns<T> column = { columns, strides, program->variables() };
+    const C *ce = c0 + program->ncode;
+    for (int i0=0; i0<n; i0+=B) {
+        int m = std::min(B, n-i0);
+        for (const C *cp=c0; cp != ce; ) {
+            T *a = wp + cp[1]*B;
+            const T *b = wp + (cp+2 < ce ? cp[2]*B : 0);
+            if (mathAccuracy != EXACT && VectorMath::eval(cp[0], a, b, m, mathAccuracy == FAST)) {
+                cp += length(cp[0]);
+                continue;
+            }
+            switch(cp[0]) {
+            case MOVE: for (int i=0; i<m; i++) a[i] = b[i]; cp+=3; break;
+            case LOAD: {
+                    const T *col = column(cp[2], i0, m, tmp);
+                    for (int i=0; i<m; i++) a[i] = col[i];
+                    cp+=3; break;
+                }
+            case NEG: for (int i=0; i<m; i++) a[i] = -a[i]; cp+=2; break;
+            case NOT: for (int i=0; i<m; i++) a[i] = !a[i]; cp+=2; break;
+            case ADD: for (int i=0; i<m; i++) a[i] += b[i]; cp+=3; break;
+            case SUB: for (int i=0; i<m; i++) a[i] -= b[i]; cp+=3; break;
+            case MUL: for (int i=0; i<m; i++) a[i] *= b[i]; cp+=3; break;
+            case DIV: for (int i=0; i<m; i++) a[i] /= b[i]; cp+=3; break;
+            case LT:  for (int i=0; i<m; i++) a[i] = (a[i] <  b[i]); cp+=3; break;
+            case LE:  for (int i=0; i<m; i++) a[i] = (a[i] <= b[i]); cp+=3; break;
+            case GT:  for (int i=0; i<m; i++) a[i] = (a[i] >  b[i]); cp+=3; break;
+            case GE:  for (int i=0; i<m; i++) a[i] = (a[i] >= b[i]); cp+=3; break;
+            case EQ:  for (int i=0; i<m; i++) a[i] = (a[i] == b[i]); cp+=3; break;
+            case NE:  for (int i=0; i<m; i++) a[i] = (a[i] != b[i]); cp+=3; break;
+            case AND: for (int i=0; i<m; i++) a[i] = (a[i] && b[i]); cp+=3; break;
+            case OR:  for (int i=0; i<m; i++) a[i] = (a[i] || b[i]); cp+=3; break;
+            case B_OR: for (int i=0; i<m; i++) a[i] = (int(a[i]) | int(b[i])); cp+=3; break;
+            case B_AND: for (int i=0; i<m; i++) a[i] = (int(a[i]) & int(b[i])); cp+=3; break;
+            case B_XOR: for (int i=0; i<m; i++) a[i] = (int(a[i]) ^ int(b[i])); cp+=3; break;
+            case B_SHL: for (int i=0; i<m; i++) a[i] = int(unsigned(int(a[i])) << (int(b[i]) & 31)); cp+=3; break;
+            case B_SHR: for (int i=0; i<m; i++) a[i] = (int(a[i]) >> (int(b[i]) & 31)); cp+=3; break;
+            case FFLOOR: for (int i=0; i<m; i++) a[i] = std::floor(a[i]); cp+=2; break;
+            case FABS: for (int i=0; i<m; i++) a[i] = std::fabs(a[i]); cp+=2; break;
+            case FSIN: for (int i=0; i<m; i++) a[i] = std::sin(a[i]); cp+=2; break;
+            case FCOS: for (int i=0; i<m; i++) a[i] = std::cos(a[i]); cp+=2; break;
+            case FSQRT: for (int i=0; i<m; i++) a[i] = std::sqrt(a[i]); cp+=2; break;
+            case FTAN: for (int i=0; i<m; i++) a[i] = std::tan(a[i]); cp+=2; break;
+            case FATAN: for (int i=0; i<m; i++) a[i] = std::atan(a[i]); cp+=2; break;
+            case FLOG: for (int i=0; i<m; i++) a[i] = std::log(a[i]); cp+=2; break;
+            case FEXP: for (int i=0; i<m; i++) a[i] = std::exp(a[i]); cp+=2; break;
+            case FATAN2: for (int i=0; i<m; i++) a[i] = std::atan2(a[i], b[i]); cp+=3; break;
+            case FPOW: for (int i=0; i<m; i++) a[i] = std::pow(a[i], b[i]); cp+=3; break;
+            case ADD_V: case SUB_V: case MUL_V: case DIV_V: {
+                    const T *col = column(cp[2], i0, m, tmp);
+                    switch(cp[0]) {
+                    case ADD_V: for (int i=0; i<m; i++) a[i] += col[i]; break;
+                    case SUB_V: for (int i=0; i<m; i++) a[i] -= col[i]; break;
+                    case MUL_V: for (int i=0; i<m; i++) a[i] *= col[i]; break;
+                    case DIV_V: for (int i=0; i<m; i++) a[i] /= col[i]; break;
+                    }
+                    cp+=3; break;
+                }
+            case ADD3: case SUB3: case MUL3: case DIV3: case MADD: case MSUB: {
+                    const T *c = wp + cp[3]*B;
+                    switch(cp[0]) {
+                    case ADD3: for (int i=0; i<m; i++) a[i] = b[i] + c[i]; break;
+                    case SUB3: for (int i=0; i<m; i++) a[i] = b[i] - c[i]; break;
+                    case MUL3: for (int i=0; i<m; i++) a[i] = b[i] * c[i]; break;
+                    case DIV3: for (int i=0; i<m; i++) a[i] = b[i] / c[i]; break;
+                    case MADD: for (int i=0; i<m; i++) a[i] += b[i] * c[i]; break;
+                    case MSUB: for (int i=0; i<m; i++) a[i] -= b[i] * c[i]; break;
+                    }
+                    cp+=4; break;
+                }
+            case LADD: case LSUB: case LMUL: case LDIV: {
+                    const T *col = column(cp[2], i0, m, tmp);
+                    const T *c = wp + cp[3]*B;
+                    switch(cp[0]) {
+                    case LADD: for (int i=0; i<m; i++) a[i] = col[i] + c[i]; break;
+                    case LSUB: for (int i=0; i<m; i++) a[i] = col[i] - c[i]; break;
+                    case LMUL: for (int i=0; i<m; i++) a[i] = col[i] * c[i]; break;
+                    case LDIV: for (int i=0; i<m; i++) a[i] = col[i] / c[i]; break;
+                    }
+                    cp+=4; break;
+                }
+            case RANDOM: random(randomSeed, row + i0, cp[3], m, a); cp+=4; break;
+            case FUNC0: {
+                    double (*f)() = func0[cp[1]];
+                    a = wp + cp[2]*B;
+                    for (int i=0; i<m; i++) a[i] = T(f());
+                    cp+=3; break;
+                }
+            case FUNC1: {
+                    double (*f)(double) = func1[cp[1]];
+                    a = wp + cp[2]*B;
+                    for (int i=0; i<m; i++) a[i] = T(f(a[i]));
+                    cp+=3; break;
+                }
+            case FUNC2: {
+                    double (*f)(double, double) = func2[cp[1]];
+                    a = wp + cp[2]*B;
+                    b = wp + cp[3]*B;
+                    for (int i=0; i<m; i++) a[i] = T(f(a[i], b[i]));
+                    cp+=4; break;
+                }
+            case FUNCN:
+                call(funcN[cp[1]], m, wp + cp[3]*B, wp + cp[2]*B, args, argp);
+                cp+=4; break;
+            case JMP: cp += cp[1]; break;
+            case JZ: case JAND: case JOR: {
+                    // The jump is done only if all rows agree
+                    int taken = 0;
+                    for (int i=0; i<m; i++) taken += (cp[0] == JOR ? a[i] != 0 : !a[i]);
+                    if (taken == 0) {
+                        cp += 3;
+                    } else if (taken == m) {
+                        if (cp[0] != JZ) std::fill(a, a+m, T(cp[0] == JOR ? 1 : 0));
+                        cp += cp[2];
+                    } else {
+                        // split stores the results, nothing left to copy
+                        split(cp, i0, m, wp, column, out, row);
+                        cp = ce;
+                        m = 0;
+                    }
+                    break;
+                }
+            }
+        }
+        const T *res = wp + program->resreg*B;
+        for (int i=0; i<m; i++) out[i0+i] = res[i];
+    }
+}
+
+// Calls general function f for the m rows of a block; parameter k is
+// in the batch registers at args + k*BATCH_SIZE. The batch version
+// reads double registers in place; float registers are converted.
+template<typename T>
+void Expr::call(const Call& f, int m, const T *args, T *out, std::vector<double>& tmp,
+                std::vector<const double *>& ptrs) {
+    const int B = BATCH_SIZE;
+    if (!f.batch) {
+        tmp.resize(f.arity + 1);
+        for (int i=0; i<m; i++) {
+            for (int k=0; k<f.arity; k++) tmp[k] = args[k*B + i];
+            out[i] = T(f.f(f.context, &tmp[0]));
+        }
+        return;
+    }
+    bool direct = sizeof(T) == sizeof(double);
+    tmp.resize(direct ? 0 : (f.arity + 1)*B);
+    ptrs.resize(f.arity + 1);
+    for (int k=0; k<f.arity; k++) {
+        if (direct) {
+            ptrs[k] = (const double *)(args + k*B);
+        } else {
+            std::copy(args + k*B, args + k*B + m, tmp.begin() + k*B);
+            ptrs[k] = &tmp[k*B];
+        }
+    }
+    if (direct) {
+        f.batch(f.context, m, &ptrs[0], (double *)out);
+    } else {
+        f.batch(f.context, m, &ptrs[0], &tmp[f.arity*B]);
+        std::copy(tmp.begin() + f.arity*B, tmp.begin() + f.arity*B + m, out);
+    }
+}
+
+// Completes the evaluation of a block one row at a time starting from
+// instruction cp (used when rows take different branches); the scalar
+// evaluation is always done in double precision
+template<typename T, typename C>
+void Expr::split(const C *cp, int i0, int m, const T *wp, const Columns<T>& column,
+                 T *out, uint64_t row) const {
+    const int B = BATCH_SIZE;
+    int nr = program->nwrk, nv = program->nvariables;
+    std::vector<double> regs(nr), frame(nv);
+    std::vector<T> tmp(nv*B);
+    std::vector<const T *> cols(nv);
+    for (int v=0; v<nv; v++) cols[v] = column(v, i0, m, &tmp[v*B]);
+    const C *ce = program->code<C>() + program->ncode;
+    for (int i=0; i<m; i++) {
+        for (int r=0; r<nr; r++) regs[r] = wp[r*B + i];
+        seedRegisters(&regs[0], randomSeed, row + i0 + i);
+        for (int v=0; v<nv; v++) frame[v] = cols[v][i];
+        run(cp, ce, &regs[0], nv ? &frame[0] : 0);
+        out[i0+i] = T(regs[program->resreg]);
+    }
+}
+
+class Expr::GridJob {
+    enum { TILE_SIZE = 4096 };
+
+    struct Tile { int row0, row1, col0, col1; };
+
+    struct Queue {
+        std::mutex m;
+        std::deque<int> tiles;
+    };
+
+    const Expr& e;
+    const std::vector<Axis>& axes;
+    double *out;
+    std::vector<int> index;
+    std::vector<double> xs;
+    std::vector<Tile> tiles;
+    std::vector<Queue> queues;
+
+    bool next(int id, int& t) {
+        {
+            std::lock_guard<std::mutex> lock(queues[id].m);
+            if (!queues[id].tiles.empty()) {
+                t = queues[id].tiles.front();
+                queues[id].tiles.pop_front();
+                return true;
+            }
+        }
+        for (int i=1,n=queues.size(); i<n; i++) {
+            Queue& victim = queues[(id + i) % n];
+            std::lock_guard<std::mutex> lock(victim.m);
+            if (!victim.tiles.empty()) {
+                t = victim.tiles.back();
+                victim.tiles.pop_back();
+                return true;
+            }
+        }
+        return false;
+    }
+
+public:
+    GridJob(const Expr& e, std::map<std::string, double>& vars,
+            const std::vector<Axis>& axes, double *out)
+        : e(e), axes(axes), out(out)
+    {
+        for (int a=0,na=axes.size(); a<na; a++) {
+            std::map<std::string, double>::iterator it = vars.find(axes[a].name);
+            index.push_back(it == vars.end() ? -1 : e.variableIndex(&it->second));
+        }
+        int w = axes[0].count, rows = 1;
+        for (int a=1,na=axes.size(); a<na; a++) rows *= axes[a].count;
+        for (int i=0; i<w; i++) xs.push_back(axes[0].start + i*axes[0].step);
+        int h = std::max(1, TILE_SIZE / std::min(w, int(BATCH_SIZE)));
+        for (int r=0; r<rows; r+=h) {
+            for (int c=0; c<w; c+=BATCH_SIZE) {
+                Tile t = { r, std::min(rows, r+h), c, std::min(w, c+BATCH_SIZE) };
+                tiles.push_back(t);
+            }
+        }
+    }
+
+    int tileCount() const {
+        return tiles.size();
+    }
+
+    void distribute(int threads) {
+        queues = std::vector<Queue>(threads);
+        for (int i=0,nt=tiles.size(); i<nt; i++) {
+            queues[i * threads / nt].tiles.push_back(i);
+        }
+    }
+
+    void run(int id) {
+        int nv = e.variableCount(), na = axes.size(), w = axes[0].count;
+        std::vector<double> regs(e.registerCount()*BATCH_SIZE);
+        e.initBatchRegisters(&regs[0]);
+        std::vector<const double *> cols(nv);
+        std::vector<int> strides(nv, 1);
+        std::vector<double> values(na);
+        for (int a=1; a<na; a++) {
+            if (index[a] != -1) {
+                cols[index[a]] = &values[a];
+                strides[index[a]] = 0;
+            }
+        }
+        for (int t; next(id, t); ) {
+            const Tile& tile = tiles[t];
+            if (index[0] != -1) cols[index[0]] = &xs[tile.col0];
+            for (int r=tile.row0; r<tile.row1; r++) {
+                for (int a=1,q=r; a<na; a++) {
+                    values[a] = axes[a].start + (q % axes[a].count)*axes[a].step;
+                    q /= axes[a].count;
+                }
+                // The row of random() is the index of the point
+                int64_t i = int64_t(r)*w + tile.col0;
+                e.batch<double>(tile.col1 - tile.col0, nv ? &cols[0] : 0, out + i,
+                                nv ? &strides[0] : 0, &regs[0], e.randomRow + i);
+            }
+        }
+    }
+};
+
+void Expr::evalGrid(std::map<std::string, double>& vars, const std::vector<Axis>& axes,
+                    double *out, int threads) const {
+    if (axes.empty()) {
+        *out = eval();
+        return;
+    }
+    for (int a=0,na=axes.size(); a<na; a++) {
+        if (axes[a].count <= 0) return;
+    }
+    if (threads <= 0) threads = std::max(1, int(std::thread::hardware_concurrency()));
+    GridJob job(*this, vars, axes, out);
+    threads = std::min(threads, job.tileCount());
+    job.distribute(threads);
+    std::vector<std::thread> workers;
+    for (int i=1; i<threads; i++) {
+        workers.push_back(std::thread(&GridJob::run, &job, i));
+    }
+    job.run(0);
+    for (int i=0,n=workers.size(); i<n; i++) {
+        workers[i].join();
+    }
+}
+
+// Interval evaluation: every opcode maps ranges of its operands to a
+// range containing all the results that eval could give for values in
+// them. Arithmetic uses the endpoints (rounding to nearest is monotonic),
+// math library functions are widened by one ulp and user functions can
+// return anything.
+
+static const double INF = HUGE_VAL;
+static const double INT_LO = -2147483648.0, INT_HI = 2147483647.0;
+
+struct Expr::Ranges {
+    // Builds an interval where NaN endpoints (e.g. inf-inf) mean that the
+    // range on that side is unknown and that NaN is possible
+    static Interval range(double lo, double hi, bool nan) {
+        if (lo != lo) { lo = -INF; nan = true; }
+        if (hi != hi) { hi = INF; nan = true; }
+        return Interval(lo, hi, nan);
+    }
+
+    static Interval anything() {
+        return Interval(-INF, INF, true);
+    }
+
+    static Interval hull(const Interval& a, const Interval& b) {
+        return Interval(std::min(a.lo, b.lo), std::max(a.hi, b.hi), a.nan || b.nan);
+    }
+
+    static bool canBeTrue(const Interval& a) {
+        return a.nan || a.lo != 0 || a.hi != 0;
+    }
+
+    static bool canBeFalse(const Interval& a) {
+        return a.lo <= 0 && a.hi >= 0;
+    }
+
+    static Interval boolean(bool canTrue, bool canFalse) {
+        return Interval(canFalse ? 0 : 1, canTrue ? 1 : 0);
+    }
+
+    static Interval add(const Interval& a, const Interval& b) {
+        return range(a.lo + b.lo, a.hi + b.hi,
+                     a.nan || b.nan || (a.hi == INF && b.lo == -INF) || (a.lo == -INF && b.hi == INF));
+    }
+
+    static Interval neg(const Interval& a) {
+        return Interval(-a.hi, -a.lo, a.nan);
+    }
+
+    // Extremes of a function monotonic in each operand are in the corners;
+    // a NaN corner (0*inf, inf/inf) is a possible NaN whose neighbours are
+    // covered by the other corners and by 0
+    static Interval corners(double p0, double p1, double p2, double p3, bool nan) {
+        double p[4] = { p0, p1, p2, p3 }, lo = INF, hi = -INF;
+        for (int i=0; i<4; i++) {
+            if (p[i] != p[i]) { nan = true; p[i] = 0; }
+            lo = std::min(lo, p[i]);
+            hi = std::max(hi, p[i]);
+        }
+        return Interval(lo, hi, nan);
+    }
+
+    static Interval mul(const Interval& a, const Interval& b) {
+        // 0*inf also when 0 is inside a range and not one of the corners
+        bool nan = (canBeFalse(a) && (b.lo == -INF || b.hi == INF)) ||
+            (canBeFalse(b) && (a.lo == -INF || a.hi == INF));
+        return corners(a.lo*b.lo, a.lo*b.hi, a.hi*b.lo, a.hi*b.hi, a.nan || b.nan || nan);
+    }
+
+    static Interval div(const Interval& a, const Interval& b) {
+        if (b.lo <= 0 && b.hi >= 0) return anything();
+        return corners(a.lo/b.lo, a.lo/b.hi, a.hi/b.lo, a.hi/b.hi, a.nan || b.nan);
+    }
+
+    static Interval compare(int op, const Interval& a, const Interval& b) {
+        bool nan = a.nan || b.nan;
+        switch(op) {
+        case LT: return boolean(a.lo < b.hi, nan || a.hi >= b.lo);
+        case LE: return boolean(a.lo <= b.hi, nan || a.hi > b.lo);
+        case GT: return boolean(a.hi > b.lo, nan || a.lo <= b.hi);
+        case GE: return boolean(a.hi >= b.lo, nan || a.lo < b.hi);
+        }
+        bool overlap = a.lo <= b.hi && b.lo <= a.hi;
+        bool single = a.lo == a.hi && b.lo == b.hi && a.lo == b.lo;
+        if (op == EQ) return boolean(overlap, nan || !single);
+        return boolean(nan || !single, overlap);
+    }
+
+    // Bit operations work on int(x); ranges not fitting an int (or NaN)
+    // can give any int
+    static Interval bits(int op, const Interval& a, const Interval& b) {
+        Interval all(INT_LO, INT_HI);
+        if (a.nan || b.nan || a.lo <= INT_LO - 1 || a.hi >= INT_HI + 1 ||
+            b.lo <= INT_LO - 1 || b.hi >= INT_HI + 1) return all;
+        int alo = int(a.lo), ahi = int(a.hi), blo = int(b.lo), bhi = int(b.hi);
+        if (alo == ahi && blo == bhi) {
+            // Same int for the whole range: the result of the VM
+            double w[2] = { a.lo, b.lo };
+            int c[3] = { op, 0, 1 };
+            run(c, c+3, w, 0);
+            return Interval(w[0]);
+        }
+        // Smallest 2^k-1 not below both operands (when they are >= 0)
+        int mask = std::max(ahi, bhi), top = 0;
+        while (top < mask) top = top*2 + 1;
+        switch(op) {
+        case B_AND:
+            if (alo >= 0 && blo >= 0) return Interval(0, std::min(ahi, bhi));
+            if (alo >= 0) return Interval(0, ahi);
+            if (blo >= 0) return Interval(0, bhi);
+            return all;
+        case B_OR: case B_XOR:
+            if (alo >= 0 && blo >= 0) return Interval(op == B_OR ? std::max(alo, blo) : 0, top);
+            return all;
+        case B_SHL:
+            if (alo >= 0 && blo >= 0 && bhi <= 30 && ahi <= (0x7FFFFFFF >> bhi)) {
+                return Interval(alo << blo, ahi << bhi);
+            }
+            return all;
+        default:
+            if (blo < 0 || bhi > 31) return all;
+            if (alo >= 0) return Interval(alo >> bhi, ahi >> blo);
+            if (ahi < 0) return Interval(alo >> blo, ahi >> bhi);
+            return Interval(alo >> blo, ahi >> blo);
+        }
+    }
+
+    static double down(double x) { return nextafter(x, -INF); }
+    static double up(double x) { return nextafter(x, INF); }
+
+    // Function of the math library increasing (or decreasing) on [lo, hi];
+    // a single value gives exactly the result of eval
+    static Interval monotonic(double (*f)(double), double lo, double hi, bool nan, bool increasing) {
+        if (lo == hi) {
+            double y = f(lo);
+            return y == y ? Interval(y, y, nan) : anything();
+        }
+        double a = f(lo), b = f(hi);
+        if (!increasing) std::swap(a, b);
+        return range(down(a), up(b), nan);
+    }
+
+    // Range of sin(x + shift) where the maxima of sin are at pi/2 + 2k*pi
+    static Interval periodic(double (*f)(double), const Interval& a, double top) {
+        if (a.lo == a.hi) return monotonic(f, a.lo, a.hi, a.nan, true);
+        if (a.lo == -INF || a.hi == INF) return Interval(-1, 1, true);
+        double margin = 1e-9*(1 + std::max(fabs(a.lo), fabs(a.hi)));
+        if (a.hi - a.lo >= 2*M_PI - margin) return Interval(-1, 1, a.nan);
+        double y0 = f(a.lo), y1 = f(a.hi);
+        double lo = down(std::min(y0, y1)), hi = up(std::max(y0, y1));
+        // Extremes between the endpoints (with a margin for the rounding of pi)
+        double k = ceil((a.lo - margin - top) / (2*M_PI));
+        if (top + 2*M_PI*k <= a.hi + margin) hi = 1;
+        k = ceil((a.lo - margin - top - M_PI) / (2*M_PI));
+        if (top + M_PI + 2*M_PI*k <= a.hi + margin) lo = -1;
+        return Interval(std::max(lo, -1.0), std::min(hi, 1.0), a.nan);
+    }
+
+    static Interval unary(int op, const Interval& a) {
+        switch(op) {
+        case NEG: return neg(a);
+        case NOT: return boolean(canBeFalse(a), canBeTrue(a));
+        case FFLOOR: return Interval(floor(a.lo), floor(a.hi), a.nan);
+        case FABS:
+            if (a.lo >= 0) return a;
+            if (a.hi <= 0) return neg(a);
+            return Interval(0, std::max(-a.lo, a.hi), a.nan);
+        case FSQRT:
+            // sqrt is correctly rounded
+            if (a.hi < 0) return anything();
+            return Interval(sqrt(std::max(a.lo, 0.0)), sqrt(a.hi), a.nan || a.lo < 0);
+        case FLOG:
+            if (a.hi < 0) return anything();
+            return monotonic(::log, std::max(a.lo, 0.0), a.hi, a.nan || a.lo < 0, true);
+        case FEXP: return monotonic(::exp, a.lo, a.hi, a.nan, true);
+        case FATAN: return monotonic(::atan, a.lo, a.hi, a.nan, true);
+        case FSIN: return periodic(::sin, a, M_PI/2);
+        case FCOS: return periodic(::cos, a, 0);
+        case FTAN: {
+            if (a.lo == a.hi) return monotonic(::tan, a.lo, a.hi, a.nan, true);
+            if (a.lo == -INF || a.hi == INF) return anything();
+            // No pole (pi/2 + k*pi) between the endpoints
+            double margin = 1e-9*(1 + std::max(fabs(a.lo), fabs(a.hi)));
+            double k = ceil((a.lo - margin - M_PI/2) / M_PI);
+            if (M_PI/2 + M_PI*k <= a.hi + margin) return Interval(-INF, INF, a.nan);
+            return monotonic(::tan, a.lo, a.hi, a.nan, true);
+        }
+        }
+        return anything();
+    }
+
+    static Interval atan2(const Interval& y, const Interval& x) {
+        bool nan = x.nan || y.nan;
+        // The sign of zero is not tracked: atan2(±0, x) for x <= 0 can be
+        // any of ±0 and ±pi (left to the general case below)
+        bool zero = (y.lo == 0 && y.hi == 0) || (x.lo == 0 && x.hi == 0);
+        if (x.lo == x.hi && y.lo == y.hi && !zero) {
+            double r = ::atan2(y.lo, x.lo);
+            return Interval(r, r, nan);
+        }
+        // Monotonic in each operand when the box is in a half plane that
+        // doesn't contain the cut on the negative x axis
+        if (x.lo > 0 || y.lo > 0 || y.hi < 0) {
+            Interval r = corners(::atan2(y.lo, x.lo), ::atan2(y.lo, x.hi),
+                                       ::atan2(y.hi, x.lo), ::atan2(y.hi, x.hi), nan);
+            return Interval(down(r.lo), up(r.hi), r.nan);
+        }
+        return Interval(-up(M_PI), up(M_PI), nan);
+    }
+
+    static Interval pow(const Interval& a, const Interval& b) {
+        bool nan = a.nan || b.nan;
+        // pow(±0, negative) is inf or (odd exponents) -inf
+        if (a.lo == 0 && a.hi == 0 && b.lo < 0) return Interval(-INF, INF, nan);
+        if (a.lo == a.hi && b.lo == b.hi) {
+            double r = ::pow(a.lo, b.lo);
+            return r == r ? Interval(r, r, nan) : anything();
+        }
+        Interval r;
+        if (a.lo >= 0) {
+            r = corners(::pow(a.lo, b.lo), ::pow(a.lo, b.hi), ::pow(a.hi, b.lo), ::pow(a.hi, b.hi), nan);
+            // The sign of zero is not tracked and pow(-0, -odd) is -inf
+            if (a.lo == 0 && b.lo < 0) r.lo = -INF;
+        } else if (b.lo == b.hi && b.lo == floor(b.lo) && fabs(b.lo) < 1e15) {
+            // Integer power: monotonic on each side of 0
+            if (a.hi >= 0 && b.lo < 0) return anything();
+            double p0 = ::pow(a.lo, b.lo), p1 = ::pow(a.hi, b.lo);
+            r = corners(p0, p1, a.hi >= 0 ? 0 : p0, p1, nan);
+        } else {
+            return anything();
+        }
+        return Interval(down(r.lo), up(r.hi), r.nan);
+    }
+};
+
+// Runs the code on intervals; when a condition may be both true and
+// false both branches are run and the registers are merged
+template<typename C>
+void Expr::runInterval(const C *cp, const C *ce, Interval *wp, const Interval *frame) const {
+    int nregs = program->nwrk;
+    while (cp != ce) {
+        int op = cp[0];
+        switch(op) {
+        case MOVE: wp[cp[1]] = wp[cp[2]]; break;
+        case LOAD: wp[cp[1]] = frame[cp[2]]; break;
+        case NEG: case NOT: case FFLOOR: case FABS: case FSQRT: case FSIN: case FCOS:
+        case FTAN: case FATAN: case FLOG: case FEXP:
+            wp[cp[1]] = Ranges::unary(op, wp[cp[1]]);
+            break;
+        case ADD: wp[cp[1]] = Ranges::add(wp[cp[1]], wp[cp[2]]); break;
+        case SUB: wp[cp[1]] = Ranges::add(wp[cp[1]], Ranges::neg(wp[cp[2]])); break;
+        case MUL: wp[cp[1]] = Ranges::mul(wp[cp[1]], wp[cp[2]]); break;
+        case DIV: wp[cp[1]] = Ranges::div(wp[cp[1]], wp[cp[2]]); break;
+        case LT: case LE: case GT: case GE: case EQ: case NE:
+            wp[cp[1]] = Ranges::compare(op, wp[cp[1]], wp[cp[2]]);
+            break;
+        case AND:
+            wp[cp[1]] = Ranges::boolean(Ranges::canBeTrue(wp[cp[1]]) && Ranges::canBeTrue(wp[cp[2]]),
+                                Ranges::canBeFalse(wp[cp[1]]) || Ranges::canBeFalse(wp[cp[2]]));
+            break;
+        case OR:
+            wp[cp[1]] = Ranges::boolean(Ranges::canBeTrue(wp[cp[1]]) || Ranges::canBeTrue(wp[cp[2]]),
+                                Ranges::canBeFalse(wp[cp[1]]) && Ranges::canBeFalse(wp[cp[2]]));
+            break;
+        case B_SHL: case B_SHR: case B_AND: case B_OR: case B_XOR:
+            wp[cp[1]] = Ranges::bits(op, wp[cp[1]], wp[cp[2]]);
+            break;
+        case FATAN2: wp[cp[1]] = Ranges::atan2(wp[cp[1]], wp[cp[2]]); break;
+        case FPOW: wp[cp[1]] = Ranges::pow(wp[cp[1]], wp[cp[2]]); break;
+        case ADD_V: wp[cp[1]] = Ranges::add(wp[cp[1]], frame[cp[2]]); break;
+        case SUB_V: wp[cp[1]] = Ranges::add(wp[cp[1]], Ranges::neg(frame[cp[2]])); break;
+        case MUL_V: wp[cp[1]] = Ranges::mul(wp[cp[1]], frame[cp[2]]); break;
+        case DIV_V: wp[cp[1]] = Ranges::div(wp[cp[1]], frame[cp[2]]); break;
+        case ADD3: wp[cp[1]] = Ranges::add(wp[cp[2]], wp[cp[3]]); break;
+        case SUB3: wp[cp[1]] = Ranges::add(wp[cp[2]], Ranges::neg(wp[cp[3]])); break;
+        case MUL3: wp[cp[1]] = Ranges::mul(wp[cp[2]], wp[cp[3]]); break;
+        case DIV3: wp[cp[1]] = Ranges::div(wp[cp[2]], wp[cp[3]]); break;
+        case LADD: wp[cp[1]] = Ranges::add(frame[cp[2]], wp[cp[3]]); break;
+        case LSUB: wp[cp[1]] = Ranges::add(frame[cp[2]], Ranges::neg(wp[cp[3]])); break;
+        case LMUL: wp[cp[1]] = Ranges::mul(frame[cp[2]], wp[cp[3]]); break;
+        case LDIV: wp[cp[1]] = Ranges::div(frame[cp[2]], wp[cp[3]]); break;
+        case MADD: wp[cp[1]] = Ranges::add(wp[cp[1]], Ranges::mul(wp[cp[2]], wp[cp[3]])); break;
+        case MSUB: wp[cp[1]] = Ranges::add(wp[cp[1]], Ranges::neg(Ranges::mul(wp[cp[2]], wp[cp[3]]))); break;
+        case RANDOM: wp[cp[1]] = Interval(0, 1); break;
+        case FUNC0: case FUNC1: case FUNC2: case FUNCN: wp[cp[2]] = Ranges::anything(); break;
+        case JMP: cp += cp[1]; continue;
+        case JZ: case JAND: case JOR: {
+            const Interval& c = wp[cp[1]];
+            const C *target = cp + cp[2], *end = target;
+            bool jump = (op == JOR ? Ranges::canBeTrue(c) : Ranges::canBeFalse(c));
+            bool next = (op == JOR ? Ranges::canBeFalse(c) : Ranges::canBeTrue(c));
+            Interval result = Ranges::boolean(op == JOR, op == JAND);
+            if (op == JZ) {
+                // The then branch ends with a jump over the else branch
+                const C *last = 0;
+                for (const C *p = cp+3; p < target; p += length(*p)) last = p;
+                if (!last || *last != JMP || last + 2 != target) {
+                    for (int i=0; i<nregs; i++) wp[i] = Ranges::anything();
+                    return;
+                }
+                end = last + last[1];
+            }
+            if (!jump) { cp += 3; continue; }
+            if (!next) {
+                if (op != JZ) wp[cp[1]] = result;
+                cp = target;
+                continue;
+            }
+            std::vector<Interval> other(wp, wp + nregs);
+            if (op == JZ) {
+                runInterval(cp+3, target-2, wp, frame);
+                runInterval(target, end, &other[0], frame);
+            } else {
+                other[cp[1]] = result;
+                runInterval(cp+3, target, wp, frame);
+            }
+            for (int i=0; i<nregs; i++) wp[i] = Ranges::hull(wp[i], other[i]);
+            cp = end;
+            continue;
+        }
+        }
+        cp += length(op);
+    }
+}
+
+Expr::Interval Expr::evalInterval(const Interval *ranges) const {
+    std::vector<Interval> regs(wrk().size());
+    return evalInterval(ranges, &regs[0]);
+}
+
+Expr::Interval Expr::evalInterval(const Interval *ranges, Interval *regs) const {
+    const double *w = program->wrk();
+    for (int i=0,n=program->nwrk; i<n; i++) regs[i] = Interval(w[i]);
+    switch (program->width) {
+    case 1: runInterval(program->code<uint8_t>(), program->end<uint8_t>(), regs, ranges); break;
+    case 2: runInterval(program->code<uint16_t>(), program->end<uint16_t>(), regs, ranges); break;
+    default: runInterval(program->code<int>(), program->end<int>(), regs, ranges); break;
+    }
+    return regs[program->resreg];
+}
+
+// Grid evaluation by quadtree on the first two axes: a block where the
+// interval evaluation gives a single value is filled with it, a block
+// where the result is outside [lo, hi] is filled with NaN and the
+// others are split until they are small enough to compute every point
+class Expr::CullJob {
+    enum { BLOCK = 64, LEAF = 256 };
+
+    const Expr& e;
+    const std::vector<Axis>& axes;
+    double *out, lo, hi;
+    int w, h, planes, blocksx, blocksy;
+    std::vector<int> index;
+    std::vector<double> xs, ys;
+    std::mutex m;
+    int nextBlock, evaluated;
+
+    struct Worker {
+        std::vector<Interval> ranges, iregs;
+        std::vector<double> regs, values;
+        std::vector<const double *> cols;
+        std::vector<int> strides;
+        int plane, evaluated;
+    };
+
+    Interval span(const std::vector<double>& v, int i0, int i1) const {
+        return Interval(std::min(v[i0], v[i1-1]), std::max(v[i0], v[i1-1]));
+    }
+
+    void fill(int x0, int x1, int y0, int y1, int plane, double v) {
+        for (int y=y0; y<y1; y++) {
+            std::fill(out + (plane*h + y)*w + x0, out + (plane*h + y)*w + x1, v);
+        }
+    }
+
+    void cull(Worker& k, int x0, int x1, int y0, int y1) {
+        if (index[0] != -1) k.ranges[index[0]] = span(xs, x0, x1);
+        if (index[1] != -1) k.ranges[index[1]] = span(ys, y0, y1);
+        Interval r = e.evalInterval(k.ranges.empty() ? 0 : &k.ranges[0], &k.iregs[0]);
+        if (!r.nan && r.lo == r.hi) {
+            fill(x0, x1, y0, y1, k.plane, r.lo);
+        } else if (!r.nan && (r.hi < lo || r.lo > hi)) {
+            fill(x0, x1, y0, y1, k.plane, NAN);
+        } else if ((x1 - x0)*(y1 - y0) <= LEAF) {
+            if (index[0] != -1) k.cols[index[0]] = &xs[x0];
+            for (int y=y0; y<y1; y++) {
+                if (index[1] != -1) k.values[1] = ys[y];
+                int64_t i = (int64_t(k.plane)*h + y)*w + x0;
+                e.batch<double>(x1 - x0, k.cols.empty() ? 0 : &k.cols[0], out + i,
+                                k.strides.empty() ? 0 : &k.strides[0], &k.regs[0],
+                                e.randomRow + i);
+            }
+            k.evaluated += (x1 - x0)*(y1 - y0);
+        } else {
+            int xm = (x0 + x1 + 1)/2, ym = (y0 + y1 + 1)/2;
+            cull(k, x0, xm, y0, ym);
+            if (xm < x1) cull(k, xm, x1, y0, ym);
+            if (ym < y1) {
+                cull(k, x0, xm, ym, y1);
+                if (xm < x1) cull(k, xm, x1, ym, y1);
+            }
+        }
+    }
+
+public:
+    CullJob(const Expr& e, std::map<std::string, double>& vars,
+            const std::vector<Axis>& axes, double *out, double lo, double hi)
+        : e(e), axes(axes), out(out), lo(lo), hi(hi), nextBlock(0), evaluated(0)
+    {
+        for (int a=0,na=axes.size(); a<na; a++) {
+            std::map<std::string, double>::iterator it = vars.find(axes[a].name);
+            index.push_back(it == vars.end() ? -1 : e.variableIndex(&it->second));
+        }
+        w = axes[0].count;
+        h = axes.size() > 1 ? axes[1].count : 1;
+        if (axes.size() == 1) index.push_back(-1);
+        planes = 1;
+        for (int a=2,na=axes.size(); a<na; a++) planes *= axes[a].count;
+        for (int i=0; i<w; i++) xs.push_back(axes[0].start + i*axes[0].step);
+        for (int i=0; i<h; i++) ys.push_back(axes.size() > 1 ? axes[1].start + i*axes[1].step : 0);
+        blocksx = (w + BLOCK - 1) / BLOCK;
+        blocksy = (h + BLOCK - 1) / BLOCK;
+    }
+
+    int blockCount() const {
+        return blocksx*blocksy*planes;
+    }
+
+    void run() {
+        Worker k;
+        int nv = e.variableCount(), na = axes.size();
+        k.ranges.resize(nv);
+        for (int i=0; i<nv; i++) k.ranges[i] = Interval(*e.variables()[i]);
+        k.iregs.resize(e.registerCount());
+        k.regs.resize(e.registerCount()*BATCH_SIZE);
+        e.initBatchRegisters(&k.regs[0]);
+        k.cols.resize(nv);
+        k.strides.resize(nv + 1, 1);
+        k.values.resize(std::max(na, 2));
+        for (int a=1; a<int(index.size()); a++) {
+            if (index[a] != -1) {
+                k.cols[index[a]] = &k.values[a];
+                k.strides[index[a]] = 0;
+            }
+        }
+        k.plane = -1;
+        k.evaluated = 0;
+        for (;;) {
+            int b;
+            {
+                std::lock_guard<std::mutex> lock(m);
+                b = nextBlock++;
+            }
+            if (b >= blockCount()) break;
+            int plane = b / (blocksx*blocksy), bx = b % blocksx, by = b / blocksx % blocksy;
+            if (plane != k.plane) {
+                k.plane = plane;
+                for (int a=2,q=plane; a<na; a++) {
+                    k.values[a] = axes[a].start + (q % axes[a].count)*axes[a].step;
+                    q /= axes[a].count;
+                    if (index[a] != -1) k.ranges[index[a]] = Interval(k.values[a]);
+                }
+            }
+            cull(k, bx*BLOCK, std::min(w, (bx+1)*BLOCK), by*BLOCK, std::min(h, (by+1)*BLOCK));
+        }
+        std::lock_guard<std::mutex> lock(m);
+        evaluated += k.evaluated;
+    }
+
+    int evaluatedCount() const {
+        return evaluated;
+    }
+};
+
+// Returns the number of points actually evaluated (the others were
+// filled from the interval of their block)
+int Expr::evalGridCulled(std::map<std::string, double>& vars, const std::vector<Axis>& axes,
+                         double *out, double lo, double hi, int threads) const {
+    if (axes.empty()) {
+        *out = eval();
+        return 1;
+    }
+    for (int a=0,na=axes.size(); a<na; a++) {
+        if (axes[a].count <= 0) return 0;
+    }
+    if (threads <= 0) threads = std::max(1, int(std::thread::hardware_concurrency()));
+    CullJob job(*this, vars, axes, out, lo, hi);
+    threads = std::min(threads, job.blockCount());
+    std::vector<std::thread> workers;
+    for (int i=1; i<threads; i++) {
+        workers.push_back(std::thread(&CullJob::run, &job));
+    }
+    job.run();
+    for (int i=0,n=workers.size(); i<n; i++) {
+        workers[i].join();
+    }
+    return job.evaluatedCount();
+}
+
+struct Expr::Node {
+    int op;         // opcode, MOVE for constants and LOAD for variables
+    int a, b;       // operand nodes (-1 if not present)
+    int id;         // variable index, function id, else branch of JZ or random() call
+    double value;   // value of a constant
+    bool pure;      // false if a user function is called or there are jumps
+    bool integral;  // true if the value is always an integer (or inf/nan)
+
+    bool operator==(const Node& other) const {
+        return op == other.op && a == other.a && b == other.b && id == other.id &&
+            memcmp(&value, &other.value, sizeof(value)) == 0;
+    }
+
+    uint64_t hash() const {
+        uint64_t bits;
+        memcpy(&bits, &value, sizeof(bits));
+        uint64_t h = op;
+        h = h*1000003 ^ uint32_t(a);
+        h = h*1000003 ^ uint32_t(b);
+        h = h*1000003 ^ uint32_t(id);
+        h = h*1000003 ^ bits;
+        return h ^ (h >> 29);
+    }
+};
+
+class Expr::Compiler {
+    Draft& e;
+    std::map<std::string, double> *vars;
+    const Symbols *symbols;
+    bool optimize;
+    std::vector<Node> nodes;
+    std::vector<int> numbers;       // hash table of numbered nodes (-1 = free)
+    int numbered;
+    std::vector<int> regs, uses, where;
+    std::string name;
+    std::map<std::string, int> defs;    // names assigned in multi-output programs
+    int first;                          // nodes before first are already optimized
+    std::vector<std::pair<int, int> > passed;   // scope and result of pass for each node
+    int scope, scopes;
+    int sites;                          // random() calls parsed so far
+
+    // The parameters of a FUNCN node are a list of ARG nodes (a is the
+    // parameter and b the next ARG node or -1)
+    enum { ARG = FUNCN + 1 };
+
+    int node(int op, int a, int b = -1, int id = -1, double value = 0.0) {
+        bool pure = op < JMP || op == ARG || (op >= FUNC0 && isPure(op, id));
+        Node n = { op, a, b, id, value,
+                   pure && (a == -1 || nodes[a].pure) && (b == -1 || nodes[b].pure),
+                   false };
+        n.integral = integral(n);
+        nodes.push_back(n);
+        return nodes.size()-1;
+    }
+
+    // Same as node, but returns the existing node if an identical pure
+    // one has already been created (value numbering)
+    int number(int op, int a, int b = -1, int id = -1, double value = 0.0) {
+        int n = node(op, a, b, id, value);
+        if (!nodes[n].pure) return n;
+        if (2*(numbered + 1) > int(numbers.size())) {
+            // Grows the table keeping the load factor below 1/2
+            std::vector<int> old(std::max(64, int(numbers.size())*2), -1);
+            old.swap(numbers);
+            for (int i=0,sz=old.size(); i<sz; i++) {
+                if (old[i] != -1) numbers[slot(old[i])] = old[i];
+            }
+        }
+        int i = slot(n);
+        if (numbers[i] == -1) {
+            numbered++;
+            return numbers[i] = n;
+        }
+        nodes.pop_back();
+        return numbers[i];
+    }
+
+    // Position of node n or of an equal node in the hash table (or of
+    // the free entry where it should be added)
+    int slot(int n) const {
+        int mask = numbers.size() - 1;
+        int i = nodes[n].hash() & mask;
+        while (numbers[i] != -1 && !(nodes[numbers[i]] == nodes[n])) i = (i + 1) & mask;
+        return i;
+    }
+
+    static int arity(int op) {
+        switch(op) {
+        case MOVE: case LOAD: case RANDOM: case FUNC0: return 0;
+        case NEG: case NOT: case FUNC1:
+        case FSIN: case FCOS: case FFLOOR: case FABS: case FSQRT:
+        case FTAN: case FATAN: case FLOG: case FEXP: return 1;
+        default: return 2;
+        }
+    }
+
+    bool isConst(int n, double v) const {
+        return nodes[n].op == MOVE && nodes[n].value == v;
+    }
+
+    static bool isBoolean(int op) {
+        return op == NOT || op == AND || op == OR || op == JAND || op == JOR ||
+            (op >= LT && op <= NE);
+    }
+
+    // True if node n is always 0 or 1
+    bool boolean(int n) const {
+        return isBoolean(nodes[n].op) || isConst(n, 0) || isConst(n, 1);
+    }
+
+    // Static type inference: integer valued nodes don't need floor()
+    // and bit operations on booleans don't need int conversions
+    bool integral(const Node& x) const {
+        switch(x.op) {
+        case MOVE: return x.value == floor(x.value) || x.value != x.value;
+        case NEG: case FABS: return nodes[x.a].integral;
+        case ADD: case SUB: case MUL: return nodes[x.a].integral && nodes[x.b].integral;
+        case FFLOOR: case B_SHL: case B_SHR: case B_AND: case B_OR: case B_XOR: return true;
+        default: return isBoolean(x.op);
+        }
+    }
+
+    static int builtin(const char *s, int len, int& arity);
+
+    static bool isBranch(int op) {
+        return op == JZ || op == JAND || op == JOR;
+    }
+
+    // True if evaluating node n always is cheaper than a jump
+    bool isCheap(int n) const {
+        const Node& x = nodes[n];
+        if (x.op == MOVE || x.op == LOAD) return true;
+        return x.op < FSIN && arity(x.op) > 0 &&
+            (nodes[x.a].op == MOVE || nodes[x.a].op == LOAD) &&
+            (x.b == -1 || nodes[x.b].op == MOVE || nodes[x.b].op == LOAD);
+    }
+
+    int scoped(int n);
+    int rewrite(int n);
+    int derivative(int n, int v);
+
+    int simplify(int op, int a, int b, int id);
+    void count(int n);
+    bool unused(int n, int op) const {
+        return nodes[n].op == op && uses[n] == 1 && where[n] == -1;
+    }
+    int fused(int n);
+    int value(int n);
+    int branch(int n);
+    int call(int n);
+    int jump(int op, int r);
+    void land(int j);
+    int take(int n, bool twice);
+    void release(int n, int r);
+
+public:
+    Compiler(Draft& e, std::map<std::string, double> *vars, const Symbols *symbols, bool optimize)
+        : e(e), vars(vars), symbols(symbols), optimize(optimize), numbered(0), first(0),
+          scope(0), scopes(0), sites(0)
+    {
+        nodes.reserve(64);
+    }
+
+    enum { LEVELS = 8 };
+
+    int parse(const char *& s, int level);
+    int pass(int n);
+    int emit(int root);
+
+    // Optimized derivative of the unoptimized tree n with respect to
+    // the variable with id v
+    int differentiate(int n, int v) {
+        int d = derivative(n, v);
+        return pass(d == -1 ? node(MOVE, -1, -1, -1, 0.0) : d);
+    }
+
+    // Statements of multi-output programs are optimized one at a time
+    // and can use the values of the previous ones by name
+    void start() {
+        first = nodes.size();
+    }
+
+    bool define(const std::string& name, int n) {
+        return defs.insert(std::make_pair(name, n)).second;
+    }
+
+    std::vector<int> emit(const std::vector<int>& roots);
+};
+
+int Expr::Compiler::parse(const char *& s, int level) {
+    if (level == -1) {
+        // Conditional operator (right associative, lowest precedence)
+        int c = parse(s, LEVELS);
+        skipsp(s);
+        if (*s != '?') return c;
+        s++;
+        int a = parse(s, -1);
+        skipsp(s);
+        if (*s != ':') throw Error("':' expected");
+        s++;
+        int b = parse(s, -1);
+        return node(JZ, c, a, b);
+    }
+    if (level == 0) {
+        skipsp(s);
+        if (*s == '(') {
+            s++;
+            int res = parse(s, -1);
+            skipsp(s);
+            if (*s != ')') throw Error("')' expected");
+            s++;
+            return res;
+        } else if (isdigit((unsigned char)*s) || (*s=='-' && isdigit((unsigned char)s[1]))) {
+            char *ss = 0;
+            double v = strtod(s, &ss);
+            if (ss && ss!=s) {
+                s = (const char *)ss;
+                return node(MOVE, -1, -1, -1, v);
+            } else {
+                throw Error("Invalid number");
+            }
+        } else if (*s == '-') {
+            s++;
+            return node(NEG, parse(s, 0));
+        } else if (*s == '!') {
+            s++;
+            return node(NOT, parse(s, 0));
+        } else if (*s && (*s == '_' || isalpha((unsigned char)*s))) {
+            const char *s0 = s;
+            while (isalnum((unsigned char)*s) || *s == '_') s++;
+            int len = s - s0;
+            if (*s == '(' && len == 2 && s0[0] == 'i' && s0[1] == 'f') {
+                s++;
+                int args[3];
+                for (int a=0; a<3; a++) {
+                    args[a] = parse(s, -1);
+                    skipsp(s);
+                    if (*s != (a == 2 ? ')' : ',')) throw Error(a == 2 ? "')' expected" : "',' expected");
+                    s++;
+                }
+                return node(JZ, args[0], args[1], args[2]);
+            }
+            // The buffer is reused so that short names don't allocate
+            name.assign(s0, len);
+            if (*s == '(') {
+                int id, arity;
+                std::map<std::string, std::pair<int, int> >::iterator it = functions.find(name);
+                bool ii = (it == functions.end());
+                if (ii) {
+                    id = builtin(s0, len, arity);
+                    if (id == -1) throw Error(std::string("Unknown function '" + name + "'"));
+                } else {
+                    id = it->second.first;
+                    arity = it->second.second;
+                }
+                bool general = arity >= FUNCN - FUNC0;
+                if (general) arity -= FUNCN - FUNC0;
+                s++;
+                int args[2] = { -1, -1 };
+                std::vector<int> list;
+                for (int a=0; a<arity; a++) {
+                    int arg = parse(s, -1);
+                    if (general) {
+                        list.push_back(arg);
+                    } else {
+                        args[a] = arg;
+                    }
+                    if (a != arity-1) {
+                        skipsp(s);
+                        if (*s != ',') throw Error("',' expected");
+                        s++;
+                    }
+                }
+                skipsp(s);
+                if (*s != ')') throw Error("')' expected");
+                s++;
+                if (ii) return node(id, args[0], args[1], id == RANDOM ? sites++ : -1);
+                if (general) {
+                    int head = -1;
+                    for (int a=arity-1; a>=0; a--) head = node(ARG, list[a], head);
+                    return node(FUNCN, head, -1, id);
+                }
+                return node(FUNC0 + arity, args[0], args[1], id);
+            } else if (!defs.empty() && defs.count(name)) {
+                return defs[name];
+            } else if (symbols) {
+                // Variables are read from the frame slot
+                int slot = symbols->slot(name);
+                if (slot == -1) throw Error(std::string("Unknown variable '" + name + "'"));
+                if (int(e.variables.size()) <= slot) e.variables.resize(slot + 1, &undefined);
+                return node(LOAD, -1, -1, slot);
+            } else {
+                std::map<std::string, double>::iterator it = vars->find(name);
+                if (it != vars->end()) {
+                    int index = e.variableIndex(&it->second);
+                    if (index == -1) {
+                        e.variables.push_back(&it->second);
+                        index = e.variables.size()-1;
+                    }
+                    return node(LOAD, -1, -1, index);
+                } else {
+                    throw Error(std::string("Unknown variable '" + name + "'"));
+                }
+            }
+        } else {
+            throw Error("Syntax error");
+        }
+    }
+    // Precedence climbing: operators of this level or higher precedence
+    // are handled in the loop and the right operand takes only operators
+    // with higher precedence (left associativity)
+    int res = parse(s, 0), len, oplevel, op;
+    while (skipsp(s), (op = binop(s, len, oplevel)) != -1 && oplevel <= level) {
+        s += len;
+        res = node(op, res, parse(s, oplevel-1));
+    }
+    return res;
+}
+
+// Recognizes the binary operator at s returning its opcode (-1 if none)
+// and setting its length and precedence level (1 is the highest)
+int Expr::binop(const char *s, int& len, int& level) {
+    len = 1;
+    switch(s[0]) {
+    case '*': level = 1; return MUL;
+    case '/': level = 1; return DIV;
+    case '+': level = 2; return ADD;
+    case '-': level = 2; return SUB;
+    case '<':
+        if (s[1] == '<') { len = 2; level = 3; return B_SHL; }
+        if (s[1] == '=') { len = 2; level = 6; return LE; }
+        level = 6; return LT;
+    case '>':
+        if (s[1] == '>') { len = 2; level = 3; return B_SHR; }
+        if (s[1] == '=') { len = 2; level = 6; return GE; }
+        level = 6; return GT;
+    case '&':
+        if (s[1] == '&') { len = 2; level = 7; return JAND; }
+        level = 4; return B_AND;
+    case '|':
+        if (s[1] == '|') { len = 2; level = 8; return JOR; }
+        level = 5; return B_OR;
+    case '^': level = 5; return B_XOR;
+    case '=':
+        if (s[1] == '=') { len = 2; level = 6; return EQ; }
+        break;
+    case '!':
+        if (s[1] == '=') { len = 2; level = 6; return NE; }
+        break;
+    }
+    return -1;
+}
+
+// Opcode and number of parameters of the inlined math function with
+// the given name (-1 if there is none)
+int Expr::Compiler::builtin(const char *s, int len, int& arity) {
+    static const struct { const char *name; int op, arity; } table[] = {
+        {"floor", FFLOOR, 1}, {"abs", FABS, 1}, {"sqrt", FSQRT, 1},
+        {"sin", FSIN, 1}, {"cos", FCOS, 1}, {"tan", FTAN, 1}, {"atan", FATAN, 1},
+        {"log", FLOG, 1}, {"exp", FEXP, 1}, {"atan2", FATAN2, 2}, {"pow", FPOW, 2},
+        {"random", RANDOM, 0} };
+    for (int i=0,n=sizeof(table)/sizeof(table[0]); i<n; i++) {
+        if (strncmp(table[i].name, s, len) == 0 && table[i].name[len] == 0) {
+            arity = table[i].arity;
+            return table[i].op;
+        }
+    }
+    return -1;
+}
+
+// Optimization pass: returns a node computing the same value as node n
+// after folding constants and removing operations that are known to
+// give exactly the same result (including sign of zero and NaNs).
+// A node reached again in the same scope (derivatives share the nodes
+// of the expression) gives the same result, so it's computed once.
+int Expr::Compiler::pass(int n) {
+    if (!optimize || n < first) return n;
+    if (n < int(passed.size()) && passed[n].first == scope) return passed[n].second;
+    int res = rewrite(n);
+    if (n >= int(passed.size())) passed.resize(n + 1, std::make_pair(-1, -1));
+    passed[n] = std::make_pair(scope, res);
+    return res;
+}
+
+int Expr::Compiler::rewrite(int n) {
+    Node x = nodes[n];
+    if (x.op == MOVE || x.op == LOAD) return number(x.op, -1, -1, x.id, x.value);
+    if (isBranch(x.op)) {
+        int c = pass(x.a);
+        if (nodes[c].op == MOVE) {
+            bool t = nodes[c].value != 0;
+            if (x.op == JZ) return pass(t ? x.b : x.id);
+            if (t == (x.op == JOR)) return number(MOVE, -1, -1, -1, t);
+            return simplify(NE, pass(x.b), number(MOVE, -1, -1, -1, 0.0), -1);
+        }
+        if (x.op != JZ && isCheap(x.b)) {
+            return simplify(x.op == JAND ? AND : OR, c, pass(x.b), -1);
+        }
+        return node(x.op, c, scoped(x.b), x.op == JZ ? scoped(x.id) : -1);
+    }
+    if (x.a != -1) x.a = pass(x.a);
+    if (x.b != -1) x.b = pass(x.b);
+    return simplify(x.op, x.a, x.b, x.id);
+}
+
+// Derivative of node n with respect to variable v (the id of its LOAD)
+// built from unoptimized nodes before the pass; -1 means it's zero
+// everywhere, so that no operations on zeros are generated
+int Expr::Compiler::derivative(int n, int v) {
+    Node x = nodes[n];
+    int da = -1, db = -1;
+    switch(x.op) {
+    case LOAD:
+        return x.id == v ? node(MOVE, -1, -1, -1, 1.0) : -1;
+    case JZ:
+        da = derivative(x.b, v);
+        db = derivative(x.id, v);
+        if (da == -1 && db == -1) return -1;
+        if (da == -1) da = node(MOVE, -1, -1, -1, 0.0);
+        if (db == -1) db = node(MOVE, -1, -1, -1, 0.0);
+        return node(JZ, x.a, da, db);
+    case NEG: case ADD: case SUB: case MUL: case DIV:
+    case FSQRT: case FSIN: case FCOS: case FTAN: case FATAN:
+    case FLOG: case FEXP: case FABS: case FATAN2: case FPOW:
+    case FUNC1: case FUNC2:
+        da = derivative(x.a, v);
+        if (x.b != -1) db = derivative(x.b, v);
+        if (da == -1 && db == -1) return -1;
+        break;
+    case FUNCN: {
+        // Partial derivatives of general functions are general functions
+        // with the same parameters registered as name'1, name'2 ...
+        // (name' if there is only one parameter)
+        std::string name = functionName(x.op, x.id);
+        int arity = funcN[x.id].arity, i = 0, r = -1;
+        for (int p=x.a; p!=-1; p=nodes[p].b, i++) {
+            int d = derivative(nodes[p].a, v);
+            if (d == -1) continue;
+            std::string dname = name + "'" + (arity == 1 ? std::string() : std::to_string(i + 1));
+            int id = Expr::function(dname, FUNCN - FUNC0 + arity);
+            if (id == -1) throw Error("No derivative for function '" + name + "'");
+            int t = node(MUL, node(FUNCN, x.a, -1, id), d);
+            r = r == -1 ? t : node(ADD, r, t);
+        }
+        return r;
+    }
+    default:
+        // Constants, calls without parameters, comparisons, logical and
+        // bit operations and floor are piecewise constant
+        return -1;
+    }
+    // The result is (fa*da + fb*db) / d where fa, fb and d are -1 when
+    // they are not needed and the second term is subtracted for sub
+    int fa = -1, fb = -1, d = -1;
+    bool sub = false;
+    switch(x.op) {
+    case NEG: return node(NEG, da);
+    case SUB: sub = true; break;
+    case MUL: fa = x.b; fb = x.a; break;
+    case DIV: fb = n; d = x.b; sub = true; break;
+    case FSQRT: fa = node(DIV, node(MOVE, -1, -1, -1, 0.5), n); break;
+    case FSIN: fa = node(FCOS, x.a); break;
+    case FCOS: fa = node(NEG, node(FSIN, x.a)); break;
+    case FTAN: fa = node(ADD, node(MOVE, -1, -1, -1, 1.0), node(MUL, n, n)); break;
+    case FATAN: d = node(ADD, node(MOVE, -1, -1, -1, 1.0), node(MUL, x.a, x.a)); break;
+    case FLOG: d = x.a; break;
+    case FEXP: fa = n; break;
+    case FABS:
+        fa = node(SUB, node(GT, x.a, node(MOVE, -1, -1, -1, 0.0)),
+                  node(LT, x.a, node(MOVE, -1, -1, -1, 0.0)));
+        break;
+    case FATAN2:
+        fa = x.b; fb = x.a; sub = true;
+        d = node(ADD, node(MUL, x.a, x.a), node(MUL, x.b, x.b));
+        break;
+    case FPOW:
+        fa = node(MUL, x.b, node(FPOW, x.a, node(SUB, x.b, node(MOVE, -1, -1, -1, 1.0))));
+        fb = node(MUL, n, node(FLOG, x.a));
+        break;
+    case FUNC1: case FUNC2: {
+        // Derivatives given to addFunction are registered as name' (one
+        // parameter) or name'1 and name'2 (partial derivatives)
+        std::string name = functionName(x.op, x.id);
+        int arity = x.op - FUNC0;
+        for (int i=0; i<arity; i++) {
+            if ((i == 0 ? da : db) == -1) continue;
+            std::string dname = name + (arity == 1 ? "'" : i == 0 ? "'1" : "'2");
+            int id = Expr::function(dname, arity);
+            if (id == -1) throw Error("No derivative for function '" + name + "'");
+            (i == 0 ? fa : fb) = node(x.op, x.a, x.b, id);
+        }
+        break;
+    }
+    }
+    if (da != -1 && fa != -1) da = node(MUL, fa, da);
+    if (db != -1 && fb != -1) db = node(MUL, fb, db);
+    int r = db == -1 ? da : da == -1 ? (sub ? node(NEG, db) : db) : node(sub ? SUB : ADD, da, db);
+    return d == -1 ? r : node(DIV, r, d);
+}
+
+// Optimizes a node that is evaluated only conditionally; its nodes are
+// not merged with the others because the value may not be available
+int Expr::Compiler::scoped(int n) {
+    std::vector<int> outer;
+    int count = 0, inner = ++scopes;
+    outer.swap(numbers);
+    std::swap(count, numbered);
+    std::swap(scope, inner);
+    int res = pass(n);
+    outer.swap(numbers);
+    std::swap(count, numbered);
+    std::swap(scope, inner);
+    return res;
+}
+
+int Expr::Compiler::simplify(int op, int a, int b, int id) {
+    if (op == ARG) return number(op, a, b, id);
+    if (op >= FUNC0) {
+        // Pure functions with constant parameters are called now (FUNCN
+        // writes the result in register 0 and reads the parameters from
+        // register 1 on, the others use registers 0 and 1 in place)
+        std::vector<double> w(2, 0.0);
+        bool constant = isPure(op, id);
+        if (op == FUNCN) {
+            w.resize(1);
+            for (int p=a; p!=-1 && constant; p=nodes[p].b) {
+                constant = nodes[nodes[p].a].op == MOVE;
+                w.push_back(nodes[nodes[p].a].value);
+            }
+            w.push_back(0.0);
+        } else {
+            if (a != -1) {
+                constant = constant && nodes[a].op == MOVE;
+                w[0] = nodes[a].value;
+            }
+            if (b != -1) {
+                constant = constant && nodes[b].op == MOVE;
+                w[1] = nodes[b].value;
+            }
+        }
+        if (constant) {
+            int c[4] = { op, id, 0, 1 };
+            run(c, c+length(op), &w[0], 0);
+            return number(MOVE, -1, -1, -1, w[0]);
+        }
+        return number(op, a, b, id);
+    }
+    int na = arity(op);
+    if (op < FUNC0 && na > 0 &&
+        nodes[a].op == MOVE && (na == 1 || nodes[b].op == MOVE)) {
+        double w[2] = { nodes[a].value, na == 2 ? nodes[b].value : 0.0 };
+        int c[3] = { op, 0, 1 };
+        run(c, c+1+na, w, 0);
+        return number(MOVE, -1, -1, -1, w[0]);
+    }
+    if (na == 2 && nodes[a].op == MOVE && nodes[b].op != MOVE) {
+        // Constants can be used directly as second operand, saving a MOVE
+        switch(op) {
+        case ADD: case MUL: case EQ: case NE: case B_AND: case B_OR: case B_XOR:
+            return simplify(op, b, a, id);
+        case LT: return simplify(GT, b, a, id);
+        case GT: return simplify(LT, b, a, id);
+        case LE: return simplify(GE, b, a, id);
+        case GE: return simplify(LE, b, a, id);
+        }
+    }
+    switch(op) {
+    case MUL:
+        if (isConst(b, 1)) return a;
+        if (isConst(a, 1)) return b;
+        if (isConst(b, -1)) return simplify(NEG, a, -1, -1);
+        if (isConst(a, -1)) return simplify(NEG, b, -1, -1);
+        break;
+    case DIV:
+        if (isConst(b, 1)) return a;
+        if (nodes[b].op == MOVE) {
+            // x/2^k == x*2^-k exactly when 2^-k is a normal number
+            int k;
+            double v = nodes[b].value;
+            if (frexp(v, &k) == (v < 0 ? -0.5 : 0.5) && fabs(1/v) >= DBL_MIN && fabs(1/v) <= DBL_MAX) {
+                return number(MUL, a, number(MOVE, -1, -1, -1, 1/v));
+            }
+        }
+        break;
+    case SUB:
+        if (isConst(b, 0) && !signbit(nodes[b].value)) return a;
+        break;
+    case NEG:
+        if (nodes[a].op == NEG) return nodes[a].a;
+        break;
+    case NOT:
+        if (nodes[a].op == NOT && isBoolean(nodes[nodes[a].a].op)) return nodes[a].a;
+        break;
+    case FPOW:
+        if (isConst(b, 1)) return a;
+        if (isConst(b, 2)) return number(MUL, a, a);
+        break;
+    case FFLOOR:
+        if (nodes[a].integral) return a;
+        break;
+    case B_AND: case B_OR: case B_XOR:
+        if (boolean(a) && boolean(b)) return simplify(op == B_AND ? AND : op == B_OR ? OR : NE, a, b, id);
+        break;
+    }
+    switch(op) {
+    case ADD: case MUL: case EQ: case NE: case B_AND: case B_OR: case B_XOR:
+        // Operands of commutative operators are sorted so that a+b and
+        // b+a get the same number
+        if (a > b && nodes[a].op != MOVE && nodes[b].op != MOVE &&
+            nodes[a].pure && nodes[b].pure) std::swap(a, b);
+        break;
+    }
+    return number(op, a, b, id);
+}
+
+void Expr::Compiler::count(int n) {
+    if (uses[n]++ == 0) {
+        if (nodes[n].op == FUNCN) {
+            // ARG lists may be shared, each parameter is used by this call
+            for (int p=nodes[n].a; p!=-1; p=nodes[p].b) count(nodes[p].a);
+            return;
+        }
+        if (nodes[n].a != -1) count(nodes[n].a);
+        if (nodes[n].b != -1) count(nodes[n].b);
+        if (nodes[n].op == JZ) count(nodes[n].id);
+    }
+}
+
+// Returns the register containing the value of node n, generating the
+// code to compute it the first time it's needed
+int Expr::Compiler::value(int n) {
+    if (where[n] != -1) return where[n];
+    const Node& x = nodes[n];
+    int na = arity(x.op);
+    if (x.op == MOVE) {
+        e.wrk.push_back(x.value);
+        return where[n] = (e.wrk.size()-1) | READONLY;
+    }
+    if (isBranch(x.op)) return where[n] = branch(n);
+    if (x.op == FUNCN) return where[n] = call(n);
+    if (optimize && x.op >= ADD && x.op <= DIV) {
+        int r = fused(n);
+        if (r != -1) return where[n] = r;
+    }
+    int target = -1, other = -1;
+    if (x.op == LOAD || x.op == RANDOM || x.op == FUNC0) {
+        target = e.reg(regs);
+    } else {
+        value(x.a);
+        if (na == 2) other = value(x.b);
+        target = take(x.a, x.b == x.a);
+        if (x.b == x.a) other = where[x.a] == -1 ? target : where[x.a];
+    }
+    if (x.op >= FUNC0) {
+        e.code.push_back(x.op);
+        e.code.push_back(x.id);
+        e.code.push_back(target);
+    } else {
+        e.code.push_back(x.op);
+        e.code.push_back(target);
+        if (x.op == LOAD) e.code.push_back(x.id);
+    }
+    if (x.op == RANDOM) {
+        // Seed and row registers shared by all the calls
+        if (e.rng == -1) {
+            e.rng = e.wrk.size();
+            e.wrk.resize(e.rng + 3);
+        }
+        e.code.push_back(e.rng);
+        e.code.push_back(x.id);
+    }
+    if (na == 2) {
+        e.code.push_back(other&~READONLY);
+        if (x.b != x.a) release(x.b, other);
+    }
+    return where[n] = target;
+}
+
+// Generates code for an arithmetic operation using one of the combined
+// instructions (operand from a variable, three registers, load and
+// operation, multiply-add) if that saves instructions. Returns the
+// target register or -1 if the plain instruction is better.
+int Expr::Compiler::fused(int n) {
+    const Node& x = nodes[n];
+    int k = x.op - ADD, a = x.a, b = x.b;
+    if (x.op == ADD || x.op == SUB) {
+        int m = -1, c = a;
+        if (unused(b, MUL)) {
+            m = b;
+        } else if (x.op == ADD && unused(a, MUL) && (nodes[a].pure || nodes[b].pure)) {
+            m = a; c = b;
+        }
+        if (m != -1 && nodes[c].op != MOVE) {
+            value(c); int p = value(nodes[m].a); int q = value(nodes[m].b);
+            int target = take(c, false);
+            e.code.push_back(x.op == ADD ? MADD : MSUB);
+            e.code.push_back(target); e.code.push_back(p&~READONLY); e.code.push_back(q&~READONLY);
+            uses[m] = 0;
+            release(nodes[m].a, p);
+            release(nodes[m].b, q);
+            return target;
+        }
+    }
+    if (a != b && unused(b, LOAD)) {
+        value(a);
+        int target = take(a, false);
+        e.code.push_back(ADD_V + k); e.code.push_back(target); e.code.push_back(nodes[b].id);
+        uses[b] = 0;
+        return target;
+    }
+    if (a != b && unused(a, LOAD)) {
+        int r = value(b);
+        int target = (uses[b] == 1 && !(r & READONLY)) ? r : e.reg(regs);
+        e.code.push_back(LADD + k); e.code.push_back(target);
+        e.code.push_back(nodes[a].id); e.code.push_back(r&~READONLY);
+        uses[a] = 0;
+        if (target == r) {
+            uses[b] = 0; where[b] = -1;
+        } else {
+            release(b, r);
+        }
+        return target;
+    }
+    int ra = value(a), rb = value(b);
+    if (uses[a] > (a == b ? 2 : 1) || (ra & READONLY)) {
+        int target = (a != b && uses[b] == 1 && !(rb & READONLY)) ? rb : e.reg(regs);
+        e.code.push_back(ADD3 + k); e.code.push_back(target);
+        e.code.push_back(ra&~READONLY); e.code.push_back(rb&~READONLY);
+        if (target == rb) {
+            uses[b] = 0; where[b] = -1;
+        } else {
+            release(b, rb);
+        }
+        release(a, ra);
+        return target;
+    }
+    return -1;
+}
+
+// Generates code for && and || computing the second operand only when
+// needed and for the conditional operator computing only one branch
+int Expr::Compiler::branch(int n) {
+    const Node& x = nodes[n];
+    if (x.op == JZ) {
+        int c = value(x.a);
+        int j = jump(JZ, c&~READONLY);
+        release(x.a, c);
+        value(x.b);
+        int target = take(x.b, false);
+        int k = jump(JMP, -1);
+        land(j);
+        // target is free in the else branch and can be used to compute it
+        regs.push_back(target);
+        int r = value(x.id);
+        if (r == target) {
+            uses[x.id] = 0; where[x.id] = -1;
+        } else {
+            regs.erase(std::find(regs.begin(), regs.end(), target));
+            e.code.push_back(MOVE); e.code.push_back(target); e.code.push_back(r&~READONLY);
+            release(x.id, r);
+        }
+        land(k);
+        return target;
+    }
+    value(x.a);
+    int target = take(x.a, false);
+    int j = jump(x.op, target);
+    int r = value(x.b);
+    e.code.push_back(x.op == JAND ? AND : OR); e.code.push_back(target); e.code.push_back(r&~READONLY);
+    release(x.b, r);
+    land(j);
+    return target;
+}
+
+// Generates a call of a general function: the parameters are copied in
+// a block of registers used only by this call (constants are placed
+// there once) and passed to the function as an array
+int Expr::Compiler::call(int n) {
+    std::vector<int> args, r;
+    for (int p=nodes[n].a; p!=-1; p=nodes[p].b) args.push_back(nodes[p].a);
+    for (int i=0,na=args.size(); i<na; i++) {
+        r.push_back(nodes[args[i]].op == MOVE ? -1 : value(args[i]));
+    }
+    int base = e.wrk.size();
+    e.wrk.resize(base + args.size());
+    for (int i=0,na=args.size(); i<na; i++) {
+        if (r[i] == -1) {
+            e.wrk[base + i] = nodes[args[i]].value;
+        } else {
+            e.code.push_back(MOVE); e.code.push_back(base + i); e.code.push_back(r[i]&~READONLY);
+            release(args[i], r[i]);
+        }
+    }
+    int target = e.reg(regs);
+    e.code.push_back(FUNCN); e.code.push_back(nodes[n].id);
+    e.code.push_back(target); e.code.push_back(base);
+    return target;
+}
+
+// Emits a jump instruction (testing register r) with the destination
+// to be set later by land
+int Expr::Compiler::jump(int op, int r) {
+    int j = e.code.size();
+    e.code.push_back(op);
+    if (op != JMP) e.code.push_back(r);
+    e.code.push_back(0);
+    return j;
+}
+
+// Sets the destination of jump instruction j to the current position
+void Expr::Compiler::land(int j) {
+    e.code[j + length(e.code[j]) - 1] = e.code.size() - j;
+}
+
+// Uses the value of node n (once or twice) as the target of an
+// operation, copying it first if it's a constant or needed again later
+int Expr::Compiler::take(int n, bool twice) {
+    int r = where[n];
+    uses[n] -= twice ? 2 : 1;
+    if (uses[n] == 0 && !(r & READONLY)) {
+        where[n] = -1;
+        return r;
+    }
+    int r1 = e.reg(regs);
+    e.code.push_back(MOVE); e.code.push_back(r1); e.code.push_back(r&~READONLY);
+    return r1;
+}
+
+void Expr::Compiler::release(int n, int r) {
+    if (--uses[n] == 0 && !(r & READONLY)) {
+        where[n] = -1;
+        regs.push_back(r);
+    }
+}
+
+int Expr::Compiler::emit(int root) {
+    uses.assign(nodes.size(), 0);
+    where.assign(nodes.size(), -1);
+    count(root);
+    return value(root);
+}
+
+// The outputs are computed in order and each one has an extra use, so
+// its register is never reused
+std::vector<int> Expr::Compiler::emit(const std::vector<int>& roots) {
+    uses.assign(nodes.size(), 0);
+    where.assign(nodes.size(), -1);
+    for (int i=0,n=roots.size(); i<n; i++) {
+        count(roots[i]);
+        uses[roots[i]]++;
+    }
+    std::vector<int> res;
+    for (int i=0,n=roots.size(); i<n; i++) res.push_back(value(roots[i])&~READONLY);
+    return res;
+}
+
+Expr Expr::partialParse(const char *& s, std::map<std::string, double>& vars, bool optimize) {
+    return compile(s, &vars, 0, optimize);
+}
+
+Expr Expr::partialParse(const char *& s, const Symbols& symbols, bool optimize) {
+    return compile(s, 0, &symbols, optimize);
+}
+
+Expr Expr::compile(const char *& s, std::map<std::string, double> *vars,
+                   const Symbols *symbols, bool optimize) {
+    Draft result;
+    Compiler compiler(result, vars, symbols, optimize);
+    const char *s0 = s;
+    try {
+        int root = compiler.pass(compiler.parse(s, -1));
+        result.resreg = compiler.emit(root)&~READONLY;
+        skipsp(s);
+    } catch (const Error& re) {
+        throw Error(re.what(), s - s0);
+    }
+    return Expr(result);
+}
+
+static void splitLines(const char *s, std::vector<std::string>& lines, std::vector<int>& offsets) {
+    for (const char *s0=s; *s; ) {
+        const char *e = strchr(s, '\n');
+        if (!e) e = s + strlen(s);
+        lines.push_back(std::string(s, e));
+        offsets.push_back(s - s0);
+        s = *e ? e + 1 : e;
+    }
+}
+
+Expr Expr::parseMany(const char *s, std::map<std::string, double>& vars, bool optimize) {
+    std::vector<std::string> lines;
+    std::vector<int> offsets;
+    splitLines(s, lines, offsets);
+    return compileMany(lines, offsets, &vars, 0, optimize);
+}
+
+Expr Expr::parseMany(const char *s, const Symbols& symbols, bool optimize) {
+    std::vector<std::string> lines;
+    std::vector<int> offsets;
+    splitLines(s, lines, offsets);
+    return compileMany(lines, offsets, 0, &symbols, optimize);
+}
+
+Expr Expr::parseMany(const std::vector<std::string>& exprs, std::map<std::string, double>& vars,
+                     bool optimize) {
+    return compileMany(exprs, std::vector<int>(), &vars, 0, optimize);
+}
+
+Expr Expr::parseMany(const std::vector<std::string>& exprs, const Symbols& symbols, bool optimize) {
+    return compileMany(exprs, std::vector<int>(), 0, &symbols, optimize);
+}
+
+// Each statement is "expr" or "name = expr" and computes an output;
+// empty statements (only spaces and comments) are skipped. Error
+// positions are offsets[i] plus the position in the statement, or the
+// position in the statement and the number of the statement in the
+// message when no offsets are given.
+Expr Expr::compileMany(const std::vector<std::string>& statements, const std::vector<int>& offsets,
+                       std::map<std::string, double> *vars, const Symbols *symbols,
+                       bool optimize) {
+    Draft result;
+    Compiler compiler(result, vars, symbols, optimize);
+    std::vector<int> roots;
+    for (int i=0,n=statements.size(); i<n; i++) {
+        const char *s0 = statements[i].c_str(), *s = s0;
+        try {
+            skipsp(s);
+            if (!*s) continue;
+            std::string name;
+            const char *p = s;
+            if (isalpha((unsigned char)*p) || *p == '_') {
+                while (isalnum((unsigned char)*p) || *p == '_') p++;
+                const char *q = p;
+                skipsp(q);
+                if (q[0] == '=' && q[1] != '=') {
+                    name.assign(s, p);
+                    s = q + 1;
+                }
+            }
+            compiler.start();
+            int root = compiler.pass(compiler.parse(s, -1));
+            skipsp(s);
+            if (*s) throw Error("Unexpected extra characters");
+            if (!name.empty() && !compiler.define(name, root)) {
+                throw Error("Duplicate name '" + name + "'");
+            }
+            roots.push_back(root);
+            result.names.push_back(name);
+        } catch (const Error& re) {
+            if (offsets.empty()) {
+                char buf[30];
+                snprintf(buf, sizeof(buf), "Expression %i: ", i);
+                throw Error(buf + std::string(re.what()), s - s0);
+            }
+            throw Error(re.what(), offsets[i] + (s - s0));
+        }
+    }
+    if (roots.empty()) throw Error("No expressions", 0);
+    result.outputs = compiler.emit(roots);
+    result.resreg = result.outputs[0];
+    return Expr(result);
+}
+
+Expr Expr::gradient(const char *s, std::map<std::string, double>& vars,
+                    const std::vector<std::string>& wrt) {
+    return compileGradient(s, wrt, &vars, 0);
+}
+
+Expr Expr::gradient(const char *s, const Symbols& symbols, const std::vector<std::string>& wrt) {
+    return compileGradient(s, wrt, 0, &symbols);
+}
+
+// Output 0 is the value and output i+1 (named "d/d" + wrt[i]) is the
+// derivative with respect to wrt[i], computed symbolically and sharing
+// the subexpressions of the value
+Expr Expr::compileGradient(const char *s, const std::vector<std::string>& wrt,
+                           std::map<std::string, double> *vars, const Symbols *symbols) {
+    Draft result;
+    Compiler compiler(result, vars, symbols, true);
+    const char *s0 = s;
+    std::vector<int> roots;
+    try {
+        int tree = compiler.parse(s, -1);
+        skipsp(s);
+        if (*s) throw Error("Unexpected extra characters");
+        roots.push_back(compiler.pass(tree));
+        result.names.push_back("");
+        for (int i=0,n=wrt.size(); i<n; i++) {
+            int v = -1;
+            if (symbols) {
+                v = symbols->slot(wrt[i]);
+                if (v == -1) throw Error("Unknown variable '" + wrt[i] + "'");
+            } else {
+                std::map<std::string, double>::iterator it = vars->find(wrt[i]);
+                if (it == vars->end()) throw Error("Unknown variable '" + wrt[i] + "'");
+                v = result.variableIndex(&it->second);
+            }
+            roots.push_back(compiler.differentiate(tree, v));
+            result.names.push_back("d/d" + wrt[i]);
+        }
+    } catch (const Error& re) {
+        throw Error(re.what(), s - s0);
+    }
+    result.outputs = compiler.emit(roots);
+    result.resreg = result.outputs[0];
+    return Expr(result);
+}
+
+void Expr::store(const double *wp, double *out) const {
+    if (outputs().empty()) {
+        out[0] = wp[program->resreg];
+    } else {
+        for (int i=0,n=outputs().size(); i<n; i++) out[i] = wp[outputs()[i]];
+    }
+}
+
+void Expr::evalAll(double *out) const {
+    evalAll(out, scratchRegisters());
+}
+
+void Expr::evalAll(double *out, double *wp) const {
+    eval(wp);
+    store(wp, out);
+}
+
+void Expr::evalFrameAll(const double *frame, double *out) const {
+    evalFrameAll(frame, out, scratchRegisters());
+}
+
+void Expr::evalFrameAll(const double *frame, double *out, double *wp) const {
+    evalFrame(frame, wp);
+    store(wp, out);
+}
+
+#if defined(EXPR_JIT)
+// Native code generator for x86-64 (System V ABI). The generated code
+// is a function f(wp, frame); wp is kept in rbx, frame in r12 and
+// r13 points to a small table of 16-byte constants (1.0, sign
+// mask and absolute value mask) placed at the start of the page.
+// Registers xmm2-xmm15 are used as a write-back cache of register
+// slots; xmm0 and xmm1 are scratch and are used to pass parameters to
+// math and user functions (calls flush the cache).
+class Expr::Jit {
+    enum { RBX = 3, RAX = 0, RCX = 1, R12 = 12, R13 = 13 };
+    enum { ONE = 0, SIGN = 16, ABS = 32, CODE = 64 };
+    enum { FIRST = 2, NREGS = 16 };
+
+    std::vector<unsigned char> out;
+    std::vector<int> cached;        // xmm register caching each slot (-1 = none)
+    int slot[NREGS];                // slot cached in each xmm register (-1 = free)
+    bool dirty[NREGS];
+    int used[NREGS];
+    int tick;
+    int table;                      // position of the address of the constants
+    bool sse41;
+    std::map<int, std::vector<int> > labels;    // rel32 fields jumping to each instruction
+
+    void b(int x) { out.push_back(x); }
+
+    void d(int x) {
+        for (int i=0; i<4; i++) b((x >> (8*i)) & 255);
+    }
+
+    void q(uint64_t x) {
+        for (int i=0; i<8; i++) b((x >> (8*i)) & 255);
+    }
+
+    // prefix [REX] 0F opcode with register operands
+    void rr(int prefix, int opcode, int reg, int rm) {
+        if (prefix) b(prefix);
+        if (reg >= 8 || rm >= 8) b(0x40 | (reg >= 8 ? 4 : 0) | (rm >= 8 ? 1 : 0));
+        b(0x0f);
+        if (opcode > 255) b(opcode >> 8);
+        b(opcode & 255);
+        b(0xc0 | ((reg & 7) << 3) | (rm & 7));
+    }
+
+    // prefix [REX] 0F opcode with a [base + disp32] memory operand
+    void rm(int prefix, int opcode, int reg, int base, int disp) {
+        if (prefix) b(prefix);
+        if (reg >= 8 || base >= 8) b(0x40 | (reg >= 8 ? 4 : 0) | (base >= 8 ? 1 : 0));
+        b(0x0f);
+        b(opcode);
+        b(0x80 | ((reg & 7) << 3) | (base & 7));
+        if ((base & 7) == 4) b(0x24);               // SIB needed for rsp/r12
+        d(disp);
+    }
+
+    // Instruction with xmm register x as destination and slot s as source
+    void op(int prefix, int opcode, int x, int s) {
+        if (cached[s] != -1) {
+            used[cached[s]] = tick;
+            rr(prefix, opcode, x, cached[s]);
+        } else {
+            rm(prefix, opcode, x, RBX, s*8);
+        }
+    }
+
+    void store(int x) {
+        rm(0xf2, 0x11, x, RBX, slot[x]*8);
+        dirty[x] = false;
+    }
+
+    int alloc() {
+        int best = -1;
+        for (int x=FIRST; x<NREGS; x++) {
+            if (slot[x] == -1) return x;
+            if (used[x] != tick && (best == -1 || used[x] < used[best])) best = x;
+        }
+        if (dirty[best]) store(best);
+        cached[slot[best]] = -1;
+        slot[best] = -1;
+        return best;
+    }
+
+    // xmm register containing slot s
+    int get(int s) {
+        int x = cached[s];
+        if (x == -1) {
+            x = alloc();
+            rm(0xf2, 0x10, x, RBX, s*8);
+            slot[x] = s; cached[s] = x; dirty[x] = false;
+        }
+        used[x] = tick;
+        return x;
+    }
+
+    // xmm register that will receive a new value for slot s
+    int set(int s) {
+        int x = cached[s];
+        if (x == -1) {
+            x = alloc();
+            slot[x] = s; cached[s] = x;
+        }
+        used[x] = tick;
+        dirty[x] = true;
+        return x;
+    }
+
+    void flush() {
+        for (int x=FIRST; x<NREGS; x++) {
+            if (slot[x] != -1) {
+                if (dirty[x]) store(x);
+                cached[slot[x]] = -1;
+                slot[x] = -1;
+            }
+        }
+    }
 
-/*
-The MIT License (MIT)
+    void call(const void *f) {
+        b(0x48); b(0xb8); q(uint64_t(f));   // mov rax, imm64
+        b(0xff); b(0xd0);                   // call rax
+    }
 
-Copyright (c) 2014 Andrea Griffini
+    void call1(const void *f, int r) {
+        flush();
+        rm(0xf2, 0x10, 0, RBX, r*8);
+        call(f);
+        rm(0xf2, 0x11, 0, RBX, r*8);
+    }
 
-Permission is hereby granted, free of charge, to any person obtaining a copy
-of this software and associated documentation files (the "Software"), to deal
-in the Software without restriction, including without limitation the rights
-to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
-copies of the Software, and to permit persons to whom the Software is
-furnished to do so, subject to the following conditions:
+    void call2(const void *f, int r, int r2) {
+        flush();
+        rm(0xf2, 0x10, 0, RBX, r*8);
+        rm(0xf2, 0x10, 1, RBX, r2*8);
+        call(f);
+        rm(0xf2, 0x11, 0, RBX, r*8);
+    }
 
-The above copyright notice and this permission notice shall be included in all
-copies or substantial portions of the Software.
+    // Comparison: predicate p of cmpsd, swapped operands for > and >=
+    void compare(int r, int s, int p, bool swapped) {
+        if (swapped) {
+            int x = get(r);
+            op(0xf2, 0x10, 0, s);                   // movsd xmm0, s
+            rr(0xf2, 0xc2, 0, x); b(p);             // cmpsd xmm0, x, p
+            rm(0x66, 0x54, 0, R13, ONE);            // andpd xmm0, [one]
+            rr(0x66, 0x28, set(r), 0);              // movapd x, xmm0
+        } else {
+            int x = get(r);
+            op(0xf2, 0xc2, x, s); b(p);             // cmpsd x, s, p
+            rm(0x66, 0x54, x, R13, ONE);
+            dirty[x] = true;
+        }
+    }
 
-THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
-IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
-FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
-AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
-LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
-OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
-SOFTWARE.
-*/
+    // Logical and/or: (r != 0) op (s != 0)
+    void logical(int r, int s, int opcode) {
+        int x = get(r);
+        rr(0x66, 0x57, 0, 0);                       // xorpd xmm0, xmm0
+        op(0xf2, 0x10, 1, s);                       // movsd xmm1, s
+        rr(0xf2, 0xc2, 1, 0); b(4);                 // cmpneqsd xmm1, xmm0
+        rr(0xf2, 0xc2, x, 0); b(4);                 // cmpneqsd x, xmm0
+        rr(0x66, opcode, x, 1);                     // andpd/orpd x, xmm1
+        rm(0x66, 0x54, x, R13, ONE);
+        dirty[x] = true;
+    }
 
-std::map<std::string, std::pair<int, int> > Expr::functions;
-std::vector<double (*)()> Expr::func0;
-std::vector<double (*)(double)> Expr::func1;
-std::vector<double (*)(double,double)> Expr::func2;
+    // Integer operation on int(r) and int(s)
+    void integer(int r, int s, int opcode) {
+        int x = get(r);
+        rr(0xf2, 0x2c, RAX, x);                     // cvttsd2si eax, x
+        if (cached[s] != -1) {
+            rr(0xf2, 0x2c, RCX, cached[s]);         // cvttsd2si ecx, s
+        } else {
+            rm(0xf2, 0x2c, RCX, RBX, s*8);
+        }
+        if (opcode == 0xe0 || opcode == 0xf8) {
+            b(0xd3); b(opcode);                     // shl/sar eax, cl
+        } else {
+            b(opcode); b(0xc8);                     // and/or/xor eax, ecx
+        }
+        rr(0x66, 0x57, x, x);                       // xorpd x, x
+        rr(0xf2, 0x2a, x, RAX);                     // cvtsi2sd x, eax
+        dirty[x] = true;
+    }
 
-double Expr::eval() const {
-    double *wp = &wrk[0];
-    const int *cp = &code[0], *ce = cp+code.size();
-    while (cp != ce) {
-        switch(cp[0]) {
-        case MOVE: wp[cp[1]] = wp[cp[2]]; cp+=3; break;
-        case LOAD: wp[cp[1]] = *variables[cp[2]]; cp+=3; break;
-        case NEG: wp[cp[1]] = -wp[cp[1]]; cp+=2; break;
-        case NOT: wp[cp[1]] = !wp[cp[1]]; cp+=2; break;
-        case ADD: wp[cp[1]] += wp[cp[2]]; cp+=3; break;
-        case SUB: wp[cp[1]] -= wp[cp[2]]; cp+=3; break;
-        case MUL: wp[cp[1]] *= wp[cp[2]]; cp+=3; break;
-        case DIV: wp[cp[1]] /= wp[cp[2]]; cp+=3; break;
-        case LT:  wp[cp[1]] = (wp[cp[1]] <  wp[cp[2]]); cp+=3; break;
-        case LE:  wp[cp[1]] = (wp[cp[1]] <= wp[cp[2]]); cp+=3; break;
-        case GT:  wp[cp[1]] = (wp[cp[1]] >  wp[cp[2]]); cp+=3; break;
-        case GE:  wp[cp[1]] = (wp[cp[1]] >= wp[cp[2]]); cp+=3; break;
-        case EQ:  wp[cp[1]] = (wp[cp[1]] == wp[cp[2]]); cp+=3; break;
-        case NE:  wp[cp[1]] = (wp[cp[1]] != wp[cp[2]]); cp+=3; break;
-        case AND: wp[cp[1]] = (wp[cp[1]] && wp[cp[2]]); cp+=3; break;
-        case OR:  wp[cp[1]] = (wp[cp[1]] || wp[cp[2]]); cp+=3; break;
-        case B_OR: wp[cp[1]] = (int(wp[cp[1]]) | int(wp[cp[2]])); cp+=3; break;
-        case B_AND: wp[cp[1]] = (int(wp[cp[1]]) & int(wp[cp[2]])); cp+=3; break;
-        case B_XOR: wp[cp[1]] = (int(wp[cp[1]]) ^ int(wp[cp[2]])); cp+=3; break;
-        case B_SHL: wp[cp[1]] = (int(wp[cp[1]]) << int(wp[cp[2]])); cp+=3; break;
-        case B_SHR: wp[cp[1]] = (int(wp[cp[1]]) >> int(wp[cp[2]])); cp+=3; break;
-        case FFLOOR: wp[cp[1]] = floor(wp[cp[1]]); cp+=2; break;
-        case FABS: wp[cp[1]] = fabs(wp[cp[1]]); cp+=2; break;
-        case FSIN: wp[cp[1]] = sin(wp[cp[1]]); cp+=2; break;
-        case FCOS: wp[cp[1]] = cos(wp[cp[1]]); cp+=2; break;
-        case FSQRT: wp[cp[1]] = sqrt(wp[cp[1]]); cp+=2; break;
-        case FTAN: wp[cp[1]] = tan(wp[cp[1]]); cp+=2; break;
-        case FATAN: wp[cp[1]] = atan(wp[cp[1]]); cp+=2; break;
-        case FLOG: wp[cp[1]] = log(wp[cp[1]]); cp+=2; break;
-        case FEXP: wp[cp[1]] = exp(wp[cp[1]]); cp+=2; break;
-        case FATAN2: wp[cp[1]] = atan2(wp[cp[1]], wp[cp[2]]); cp+=3; break;
-        case FPOW: wp[cp[1]] = pow(wp[cp[1]], wp[cp[2]]); cp+=3; break;
-        case FUNC0: wp[cp[2]] = func0[cp[1]](); cp+=3; break;
-        case FUNC1: wp[cp[2]] = func1[cp[1]](wp[cp[2]]); cp+=3; break;
-        case FUNC2: wp[cp[2]] = func2[cp[1]](wp[cp[2]], wp[cp[3]]); cp+=4; break;
-        }
-    }
-    return wp[resreg];
-}
-
-Expr Expr::partialParse(const char *& s, std::map<std::string, double>& vars) {
-    Expr result;
-    std::vector<int> regs;
-    const char *s0 = s;
-    try {
-        result.resreg = result.compile(regs, s, vars, -1)&~READONLY;
-        skipsp(s);
-    } catch (const Error& re) {
-        throw Error(re.what(), s - s0);
+    // Forward jump to instruction at index i; the cache is empty at jumps
+    // and destinations so all paths agree on where values are
+    void jump(int i) {
+        labels[i].push_back(out.size() - 4);
     }
-    //printf("s0 = \"%s\":\n%s\n\n", s0, result.disassemble().c_str());
-    return result;
-}
 
-int Expr::compile(std::vector<int>& regs,
-                  const char *& s, std::map<std::string, double>& vars, int level) {
-    if (level == -1) level = max_level;
-    if (level == 0) {
-        skipsp(s);
-        if (*s == '(') {
-            s++;
-            int res = compile(regs, s, vars, -1);
-            skipsp(s);
-            if (*s != ')') throw Error("')' expected");
-            s++;
-            return res;
-        } else if (isdigit((unsigned char)*s) || (*s=='-' && isdigit((unsigned char)s[1]))) {
-            char *ss = 0;
-            double v = strtod(s, &ss);
-            if (ss && ss!=s) {
-                int x = wrk.size(); wrk.push_back(v);
-                s = (const char *)ss;
-                return x | READONLY;
-            } else {
-                throw Error("Invalid number");
-            }
-        } else if (*s == '-') {
-            s++;
-            int res = compile(regs, s, vars, 0);
-            if (res & READONLY) {
-                int r1 = reg(regs);
-                code.push_back(MOVE); code.push_back(r1); code.push_back(res&~READONLY);
-                res = r1;
-            }
-            code.push_back(NEG); code.push_back(res);
-            return res;
-        } else if (*s == '!') {
-            s++;
-            int res = compile(regs, s, vars, 0);
-            if (res & READONLY) {
-                int r1 = reg(regs);
-                code.push_back(MOVE); code.push_back(r1); code.push_back(res&~READONLY);
-                res = r1;
+    void land(int i) {
+        std::map<int, std::vector<int> >::iterator it = labels.find(i);
+        if (it == labels.end()) return;
+        flush();
+        for (int j=0,n=it->second.size(); j<n; j++) {
+            int p = it->second[j], rel = out.size() - (p + 4);
+            for (int k=0; k<4; k++) out[p + k] = (rel >> (8*k)) & 255;
+        }
+        labels.erase(it);
+    }
+
+    // Conditional jump to instruction i if slot r is zero (JZ, JAND) or
+    // not zero (JOR); JAND and JOR also set r to 0 or 1 when jumping
+    void branch(int op, int r, int i) {
+        flush();
+        rm(0xf2, 0x10, 0, RBX, r*8);                // movsd xmm0, r
+        rr(0x66, 0x57, 1, 1);                       // xorpd xmm1, xmm1
+        rr(0x66, 0x2e, 0, 1);                       // ucomisd xmm0, xmm1
+        // Zero is ZF=1 and PF=0 (NaN sets both)
+        int p = -1, skip;
+        if (op == JOR) {
+            b(0x7a); b(2);                          // jp taken
+            b(0x74); skip = out.size(); b(0);       // je skip
+            b(0x48); b(0xb8); q(0x3ff0000000000000ULL);     // mov rax, 1.0
+            b(0x48); b(0x89); b(0x83); d(r*8);      // mov r, rax
+        } else {
+            b(0x7a); p = out.size(); b(0);          // jp skip
+            b(0x75); skip = out.size(); b(0);       // jne skip
+            if (op == JAND) {
+                b(0x48); b(0xc7); b(0x83); d(r*8); d(0);    // mov qword r, 0
             }
-            code.push_back(NOT); code.push_back(res);
-            return res;
-        } else if (*s && (*s == '_' || isalpha((unsigned char)*s))) {
-            const char *s0 = s;
-            while (*s && (isalpha((unsigned char)*s) || isdigit((unsigned char)*s) || *s == '_')) s++;
-            std::string name(s0, s);
-            if (*s == '(') {
-                bool ii = false;
-                std::map<std::string, std::pair<int, int> >::iterator it = functions.find(name);
-                if (it == functions.end()) {
-                    ii = true;
-                    it = inlined.find(name);
-                    if (it == inlined.end()) throw Error(std::string("Unknown function '" + name + "'"));
+        }
+        b(0xe9); d(0); jump(i);                     // jmp i
+        if (p != -1) out[p] = out.size() - (p + 1);
+        out[skip] = out.size() - (skip + 1);
+    }
+
+public:
+    Jit(const Expr& e) : cached(e.registerCount(), -1), tick(0) {
+        for (int x=0; x<NREGS; x++) { slot[x] = -1; dirty[x] = false; used[x] = 0; }
+        sse41 = __builtin_cpu_supports("sse4.1");
+    }
+
+    // Returns false if the code contains instructions that can't be translated
+    bool compile(const Expr& e) {
+        out.assign(CODE, 0);
+        uint64_t one = 0x3ff0000000000000ULL, sign = 0x8000000000000000ULL;
+        for (int i=0; i<2; i++) {
+            memcpy(&out[ONE + 8*i], &one, 8);
+            memcpy(&out[SIGN + 8*i], &sign, 8);
+            uint64_t abs = ~sign;
+            memcpy(&out[ABS + 8*i], &abs, 8);
+        }
+        b(0x53); b(0x41); b(0x54); b(0x41); b(0x55);        // push rbx, r12, r13
+        b(0x48); b(0x89); b(0xfb);                          // mov rbx, rdi
+        b(0x49); b(0x89); b(0xf4);                          // mov r12, rsi
+        b(0x49); b(0xbd); q(0);                             // mov r13, imm64
+        table = out.size() - 8;
+        std::vector<int> code = e.code().words();
+        const int *cp = code.empty() ? 0 : &code[0], *ce = cp + code.size();
+        for (const int *c0 = cp; cp != ce; cp += length(cp[0])) {
+            land(cp - c0);
+            tick++;
+            int r = cp[1], s = length(cp[0]) > 2 ? cp[2] : 0;
+            switch(cp[0]) {
+            case MOVE: op(0xf2, 0x10, 0, s); rr(0x66, 0x28, set(r), 0); break;
+            case LOAD: rm(0xf2, 0x10, set(r), R12, s*8); break;
+            case NEG: rm(0x66, 0x57, get(r), R13, SIGN); dirty[cached[r]] = true; break;
+            case NOT: {
+                    int x = get(r);
+                    rr(0x66, 0x57, 0, 0);
+                    rr(0xf2, 0xc2, x, 0); b(0);     // cmpeqsd x, xmm0
+                    rm(0x66, 0x54, x, R13, ONE);
+                    dirty[x] = true;
+                    break;
                 }
-                s++;
-                std::vector<int> args;
-                int id = it->second.first;
-                int arity = it->second.second;
-                for (int a=0; a<arity; a++) {
-                    args.push_back(compile(regs, s, vars, -1));
-                    if (a != arity-1) {
-                        skipsp(s);
-                        if (*s != ',') throw Error("',' expected");
-                        s++;
-                    }
+            case ADD: { int x = get(r); op(0xf2, 0x58, x, s); dirty[x] = true; break; }
+            case SUB: { int x = get(r); op(0xf2, 0x5c, x, s); dirty[x] = true; break; }
+            case MUL: { int x = get(r); op(0xf2, 0x59, x, s); dirty[x] = true; break; }
+            case DIV: { int x = get(r); op(0xf2, 0x5e, x, s); dirty[x] = true; break; }
+            case LT: compare(r, s, 1, false); break;
+            case LE: compare(r, s, 2, false); break;
+            case GT: compare(r, s, 1, true); break;
+            case GE: compare(r, s, 2, true); break;
+            case EQ: compare(r, s, 0, false); break;
+            case NE: compare(r, s, 4, false); break;
+            case AND: logical(r, s, 0x54); break;
+            case OR: logical(r, s, 0x56); break;
+            case B_SHL: integer(r, s, 0xe0); break;
+            case B_SHR: integer(r, s, 0xf8); break;
+            case B_AND: integer(r, s, 0x21); break;
+            case B_OR: integer(r, s, 0x09); break;
+            case B_XOR: integer(r, s, 0x31); break;
+            case FFLOOR:
+                if (sse41) {
+                    int x = get(r);
+                    rr(0x66, 0x3a0b, x, x); b(9);   // roundsd x, x, floor
+                    dirty[x] = true;
+                } else {
+                    call1((const void *)(double (*)(double))floor, r);
                 }
-                skipsp(s);
-                if (*s != ')') throw Error("')' expected");
-                s++;
-                int target = (arity == 0) ? reg(regs) : args[0];
-                if (target & READONLY) {
-                    int r1 = reg(regs);
-                    code.push_back(MOVE); code.push_back(r1); code.push_back(target&~READONLY);
-                    target = r1;
+                break;
+            case FABS: rm(0x66, 0x54, get(r), R13, ABS); dirty[cached[r]] = true; break;
+            case FSQRT: { int x = get(r); rr(0xf2, 0x51, x, x); dirty[x] = true; break; }
+            case FSIN: call1((const void *)(double (*)(double))sin, r); break;
+            case FCOS: call1((const void *)(double (*)(double))cos, r); break;
+            case FTAN: call1((const void *)(double (*)(double))tan, r); break;
+            case FATAN: call1((const void *)(double (*)(double))atan, r); break;
+            case FLOG: call1((const void *)(double (*)(double))log, r); break;
+            case FEXP: call1((const void *)(double (*)(double))exp, r); break;
+            case FATAN2: call2((const void *)(double (*)(double, double))atan2, r, s); break;
+            case FPOW: call2((const void *)(double (*)(double, double))pow, r, s); break;
+            case ADD_V: case SUB_V: case MUL_V: case DIV_V: {
+                    static const int opcodes[] = { 0x58, 0x5c, 0x59, 0x5e };
+                    int x = get(r);
+                    rm(0xf2, opcodes[cp[0]-ADD_V], x, R12, s*8);
+                    dirty[x] = true;
+                    break;
                 }
-                if (ii) {
-                    code.push_back(id);
-                } else {
-                    code.push_back(FUNC0 + arity);
-                    code.push_back(id);
+            case ADD3: case SUB3: case MUL3: case DIV3: {
+                    static const int opcodes[] = { 0x58, 0x5c, 0x59, 0x5e };
+                    op(0xf2, 0x10, 0, s);
+                    op(0xf2, opcodes[cp[0]-ADD3], 0, cp[3]);
+                    rr(0x66, 0x28, set(r), 0);
+                    break;
                 }
-                code.push_back(target);
-                for (int i=1; i<arity; i++) {
-                    code.push_back(args[i]&~READONLY);
-                    if (!(args[i] & READONLY)) {
-                        regs.push_back(args[i]);
-                    }
+            case LADD: case LSUB: case LMUL: case LDIV: {
+                    static const int opcodes[] = { 0x58, 0x5c, 0x59, 0x5e };
+                    rm(0xf2, 0x10, 0, R12, s*8);
+                    op(0xf2, opcodes[cp[0]-LADD], 0, cp[3]);
+                    rr(0x66, 0x28, set(r), 0);
+                    break;
                 }
-                return target;
-            } else {
-                std::map<std::string, double>::iterator it = vars.find(name);
-                if (it != vars.end()) {
-                    int target = reg(regs);
-                    variables.push_back(&it->second);
-                    code.push_back(LOAD);
-                    code.push_back(target);
-                    code.push_back(variables.size()-1);
-                    return target;
-                } else {
-                    throw Error(std::string("Unknown variable '" + name + "'"));
+            case MADD: case MSUB: {
+                    op(0xf2, 0x10, 0, s);
+                    op(0xf2, 0x59, 0, cp[3]);
+                    int x = get(r);
+                    rr(0xf2, cp[0] == MADD ? 0x58 : 0x5c, x, 0);
+                    dirty[x] = true;
+                    break;
                 }
+            case RANDOM:
+                flush();
+                b(0x48); b(0x8d); b(0xbb); d(s*8);                  // lea rdi, [rbx + state]
+                b(0xbe); d(cp[3]);                                  // mov esi, site
+                call((const void *)(double (*)(const double *, int))random);
+                rm(0xf2, 0x11, 0, RBX, r*8);
+                break;
+            case FUNC0:
+                flush();
+                call((const void *)func0[cp[1]]);
+                rm(0xf2, 0x11, 0, RBX, cp[2]*8);
+                break;
+            case FUNC1: call1((const void *)func1[cp[1]], cp[2]); break;
+            case FUNC2: call2((const void *)func2[cp[1]], cp[2], cp[3]); break;
+            case FUNCN:
+                flush();
+                b(0x48); b(0xbf); q(uint64_t(funcN[cp[1]].context));  // mov rdi, imm64
+                b(0x48); b(0x8d); b(0xb3); d(cp[3]*8);              // lea rsi, [rbx + base]
+                call((const void *)funcN[cp[1]].f);
+                rm(0xf2, 0x11, 0, RBX, cp[2]*8);
+                break;
+            case JMP: flush(); b(0xe9); d(0); jump(cp - c0 + cp[1]); break;
+            case JZ: case JAND: case JOR: branch(cp[0], r, cp - c0 + s); break;
+            default:
+                return false;
             }
-        } else {
-            throw Error("Syntax error");
         }
+        land(code.size());
+        flush();
+        b(0x41); b(0x5d); b(0x41); b(0x5c); b(0x5b);        // pop r13, r12, rbx
+        b(0xc3);                                            // ret
+        return true;
     }
-    int res = compile(regs, s, vars, level-1);
-    while (skipsp(s), *s) {
-        std::map<std::string, Operator>::iterator it = operators.find(std::string(s, s+2));
-        if (it == operators.end()) it = operators.find(std::string(s, s+1));
-        if (it == operators.end() || it->second.level != level) break;
-        s += it->first.size();
-        int x = compile(regs, s, vars, level-1);
-        if (res & READONLY) {
-            int r1 = reg(regs);
-            code.push_back(MOVE); code.push_back(r1); code.push_back(res&~READONLY);
-            res = r1;
+
+    // Copies the code in executable memory
+    Native install(std::shared_ptr<void>& holder) {
+        size_t size = out.size();
+        void *p = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED) return 0;
+        for (int i=0; i<8; i++) out[table + i] = (uint64_t(p) >> (8*i)) & 255;
+        memcpy(p, &out[0], size);
+        if (mprotect(p, size, PROT_READ | PROT_EXEC) != 0) {
+            munmap(p, size);
+            return 0;
         }
-        code.push_back(it->second.opcode);
-        code.push_back(res);
-        code.push_back(x&~READONLY);
-        if (!(x&READONLY)) {
-            regs.push_back(x);
+        holder = std::shared_ptr<void>(p, Unmap(size));
+        return Native((unsigned char *)p + CODE);
+    }
+
+    struct Unmap {
+        size_t size;
+        Unmap(size_t size) : size(size) {}
+        void operator()(void *p) const { munmap(p, size); }
+    };
+};
+#endif
+
+bool Expr::jit() {
+#if defined(EXPR_JIT)
+    Jit jit(*this);
+    if (jit.compile(*this)) {
+        native = jit.install(nativeCode);
+    }
+    return native != 0;
+#else
+    return false;
+#endif
+}
+
+const char *Expr::opname(int op) {
+    static const char *opnames[] = { "MOVE", "LOAD",
+                                     "NEG", "NOT",
+                                     "ADD", "SUB", "MUL", "DIV", "LT", "LE", "GT", "GE", "EQ", "NE", "AND", "OR",
+                                     "B_SHL", "B_SHR", "B_AND", "B_OR", "B_XOR",
+                                     "FSIN", "FCOS", "FFLOOR", "FABS", "FSQRT", "FTAN", "FATAN", "FLOG", "FEXP",
+                                     "FATAN2", "FPOW",
+                                     "ADD_V", "SUB_V", "MUL_V", "DIV_V", "ADD3", "SUB3", "MUL3", "DIV3",
+                                     "LADD", "LSUB", "LMUL", "LDIV", "MADD", "MSUB",
+                                     "JMP", "JZ", "JAND", "JOR", "RANDOM",
+                                     "FUNC0", "FUNC1", "FUNC2", "FUNCN" };
+    return opnames[op];
+}
+
+// Name of the function called by FUNC0/FUNC1/FUNC2/FUNCN with the given index
+const char *Expr::functionName(int op, int index) {
+    for (std::map<std::string, std::pair<int, int> >::iterator it=functions.begin();
+         it!=functions.end(); ++it) {
+        int kind = std::min(it->second.second, int(FUNCN - FUNC0));
+        if (kind == op-FUNC0 && it->second.first == index) {
+            return it->first.c_str();
         }
     }
-    return res;
+    return "?";
 }
 
 std::string Expr::disassemble() const {
-    const char *opnames[] = { "MOVE", "LOAD",
-                              "NEG",
-                              "ADD", "SUB", "MUL", "DIV", "LT", "LE", "GT", "GE", "EQ", "NE", "AND", "OR",
-                              "B_SHL", "B_SHR", "B_AND", "B_OR", "B_XOR",
-                              "FSIN", "FCOS", "FFLOOR", "FABS", "FSQRT", "FTAN", "FATAN", "FLOG", "FEXP",
-                              "FATAN2", "FPOW",
-                              "FUNC0", "FUNC1", "FUNC2" };
     std::string result;
-    char buf[30];
+    char buf[200];
     const char *fn = "?";
+    const Code code = this->code();
+    const Span<double *> variables = this->variables();
+    const Span<double> wrk = this->wrk();
     for (int i=0,n=code.size(); i<n; i++) {
-        sprintf(buf, "%i: ", i);
+        snprintf(buf, sizeof(buf), "%i: ", i);
         result += buf;
-        result += opnames[code[i]];
+        result += opname(code[i]);
+        // Variables are shown by address, or by slot if read from frames
+        char var[40] = "";
+        if (code[i] == LOAD || (code[i] >= ADD_V && code[i] <= DIV_V) ||
+            (code[i] >= LADD && code[i] <= LDIV)) {
+            const double *p = variables[code[i+2]];
+            if (p == &undefined) {
+                snprintf(var, sizeof(var), "[%i]", code[i+2]);
+            } else {
+                snprintf(var, sizeof(var), "%p", (const void *)p);
+            }
+        }
         switch(code[i]) {
         case MOVE:
-            sprintf(buf, "(%i = %i) v=%0.3f\n", code[i+1], code[i+2], wrk[code[i+2]]);
+            snprintf(buf, sizeof(buf), "(%i = %i) v=%0.3f\n", code[i+1], code[i+2], wrk[code[i+2]]);
             i += 2;
             break;
         case LOAD:
-            sprintf(buf, "(%i = %p)\n", code[i+1], variables[code[i+2]]);
+            snprintf(buf, sizeof(buf), "(%i = %s)\n", code[i+1], var);
             i += 2;
             break;
         case NEG:
+        case NOT:
         case FSIN:
         case FCOS:
         case FFLOOR:
@@ -252,38 +3254,72 @@ std::string Expr::disassemble() const {
         case FATAN:
         case FLOG:
         case FEXP:
-            sprintf(buf, "(%i)\n", code[i+1]);
+            snprintf(buf, sizeof(buf), "(%i)\n", code[i+1]);
+            i += 1;
+            break;
+        case ADD_V:
+        case SUB_V:
+        case MUL_V:
+        case DIV_V:
+            snprintf(buf, sizeof(buf), "(%i, %s) -> %i\n", code[i+1], var, code[i+1]);
+            i += 2;
+            break;
+        case ADD3:
+        case SUB3:
+        case MUL3:
+        case DIV3:
+            snprintf(buf, sizeof(buf), "(%i, %i) -> %i\n", code[i+2], code[i+3], code[i+1]);
+            i += 3;
+            break;
+        case LADD:
+        case LSUB:
+        case LMUL:
+        case LDIV:
+            snprintf(buf, sizeof(buf), "(%s, %i) -> %i\n", var, code[i+3], code[i+1]);
+            i += 3;
+            break;
+        case MADD:
+        case MSUB:
+            snprintf(buf, sizeof(buf), "(%i, %i*%i) -> %i\n", code[i+1], code[i+2], code[i+3], code[i+1]);
+            i += 3;
+            break;
+        case JMP:
+            snprintf(buf, sizeof(buf), " %i\n", i + code[i+1]);
             i += 1;
             break;
-        case FATAN2:
-        case FPOW:
-            sprintf(buf, "(%i, %i) -> %i\n", code[i+1], code[i+2], code[i+1]);
+        case JZ:
+        case JAND:
+        case JOR:
+            snprintf(buf, sizeof(buf), "(%i) %i\n", code[i+1], i + code[i+2]);
             i += 2;
             break;
+        case RANDOM:
+            snprintf(buf, sizeof(buf), "(%i..%i) #%i -> %i\n", code[i+2], code[i+2] + 2, code[i+3], code[i+1]);
+            i += 3;
+            break;
         case FUNC0:
         case FUNC1:
         case FUNC2:
-            fn = "?";
-            for (std::map<std::string, std::pair<int, int> >::iterator it=functions.begin();
-                 it!=functions.end(); ++it) {
-                if (it->second.second == code[i]-FUNC0 && it->second.first == code[i+1]) {
-                    fn=it->first.c_str();
-                }
-            }
+        case FUNCN:
+            fn = functionName(code[i], code[i+1]);
             switch(code[i]) {
-            case FUNC0: sprintf(buf, " %p=%s() -> %i\n",
-                                func0[code[i+1]], fn, code[i+2]);
+            case FUNC0: snprintf(buf, sizeof(buf), " %p=%s() -> %i\n",
+                                 func0[code[i+1]], fn, code[i+2]);
                 i+=2; break;
-            case FUNC1: sprintf(buf, " %p=%s(%i) -> %i\n",
-                                func1[code[i+1]], fn, code[i+2], code[i+2]);
+            case FUNC1: snprintf(buf, sizeof(buf), " %p=%s(%i) -> %i\n",
+                                 func1[code[i+1]], fn, code[i+2], code[i+2]);
                 i+=2; break;
-            case FUNC2: sprintf(buf, " %p=%s(%i, %i) -> %i\n",
-                                func2[code[i+1]], fn, code[i+2], code[i+3], code[i+2]);
+            case FUNC2: snprintf(buf, sizeof(buf), " %p=%s(%i, %i) -> %i\n",
+                                 func2[code[i+1]], fn, code[i+2], code[i+3], code[i+2]);
+                i+=3; break;
+            case FUNCN: snprintf(buf, sizeof(buf), " %p=%s(%i..%i) -> %i\n",
+                                 funcN[code[i+1]].f, fn, code[i+3],
+                                 code[i+3] + funcN[code[i+1]].arity - 1, code[i+2]);
                 i+=3; break;
             }
             break;
         default:
-            sprintf(buf, "(%i, %i) -> %i\n", code[i+1], code[i+2], code[i+1]);
+            snprintf(buf, sizeof(buf), "(%i, %i) -> %i\n", code[i+1], code[i+2], code[i+1]);
             i += 2;
             break;
         }
@@ -292,49 +3328,664 @@ std::string Expr::disassemble() const {
     return result;
 }
 
-std::map<std::string, std::pair<int, int> > Expr::inlined;
+// Time stamp used by the profiler
+static uint64_t ticks() {
+#if defined(EXPR_RDTSC)
+    return __rdtsc();
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+// Ticks measured for an empty interval, subtracted from each sample
+static uint64_t tickOverhead() {
+    uint64_t best = UINT64_MAX;
+    for (int i=0; i<1000; i++) {
+        uint64_t t0 = ticks();
+        best = std::min(best, ticks() - t0);
+    }
+    return best;
+}
+
+double Expr::profile(Profile& profile) const {
+    std::vector<double> frame(variables().size());
+    for (int i=0,n=variables().size(); i<n; i++) frame[i] = *variables()[i];
+    return profileFrame(frame.empty() ? 0 : &frame[0], profile);
+}
+
+// The code is interpreted one instruction at a time (also when native
+// code is available) counting and timing each instruction; the normal
+// evaluation paths are not affected
+template<typename C>
+void Expr::profileRun(const C *cp, const C *ce, double *wp, const double *frame,
+                      Profile& profile) {
+    static const uint64_t overhead = tickOverhead();
+    for (const C *c0 = cp; cp != ce; ) {
+        Profile::Counter& c = profile.instructions[cp - c0];
+        if (c.count++ % profile.period == 0) {
+            uint64_t t0 = ticks();
+            cp = step(cp, wp, frame);
+            uint64_t t = ticks() - t0;
+            c.ticks += (t > overhead ? t - overhead : 0) * profile.period;
+        } else {
+            cp = step(cp, wp, frame);
+        }
+    }
+}
 
-int Expr::max_level;
-std::map<std::string, Expr::Operator> Expr::operators;
+double Expr::profileFrame(const double *frame, Profile& profile) const {
+    double *wp = scratchRegisters();
+    int n = program->ncode;
+    if (int(profile.instructions.size()) < n) profile.instructions.resize(n);
+    switch (program->width) {
+    case 1: profileRun(program->code<uint8_t>(), program->end<uint8_t>(), wp, frame, profile); break;
+    case 2: profileRun(program->code<uint16_t>(), program->end<uint16_t>(), wp, frame, profile); break;
+    default: profileRun(program->code<int>(), program->end<int>(), wp, frame, profile); break;
+    }
+    if (program->rng != -1) wp[program->rng + 2] += 1;
+    profile.evaluations++;
+    return wp[program->resreg];
+}
 
-class Expr::Init {
-    static double random() {
-        return double(rand()) / RAND_MAX;
+// Totals are computed only when asked, profiled evaluations just update
+// the counters of the instructions
+std::map<std::string, Expr::Profile::Counter> Expr::Profile::opcodes(const Expr& e) const {
+    std::map<std::string, Counter> totals;
+    const Code code = e.code();
+    for (size_t i=0,n=std::min(code.size(), instructions.size()); i<n; i+=length(code[i])) {
+        const Counter& c = instructions[i];
+        if (c.count == 0) continue;
+        std::string name = opname(code[i]);
+        if (code[i] >= FUNC0) name = name + " " + functionName(code[i], code[i+1]);
+        Counter& total = totals[name];
+        total.count += c.count;
+        total.ticks += c.ticks;
     }
+    return totals;
+}
 
-public:
-    Init() {
-        const Expr::Operator ops[] =
-            {{"*", 1, MUL}, {"/", 1, DIV},
-             {"+", 2, ADD}, {"-", 2, SUB},
+// Each line of the disassembly is prefixed by the number of executions,
+// the ticks and the percentage of the total ticks of the instruction
+std::string Expr::disassemble(const Profile& profile) const {
+    uint64_t total = 0;
+    for (int i=0,n=profile.instructions.size(); i<n; i++) total += profile.instructions[i].ticks;
+    std::string text = disassemble(), result;
+    char buf[100];
+    for (size_t i=0; i<text.size(); ) {
+        size_t e = text.find('\n', i) + 1;
+        size_t pos = atoi(text.c_str() + i);
+        Profile::Counter c = pos < profile.instructions.size() ? profile.instructions[pos] : Profile::Counter();
+        snprintf(buf, sizeof(buf), "%10llu %12llu %5.1f%%  ", (unsigned long long)c.count,
+                 (unsigned long long)c.ticks, total ? 100.0 * c.ticks / total : 0.0);
+        result += buf + text.substr(i, e - i);
+        i = e;
+    }
+    return result;
+}
+
+// Binary form of a compiled expression (native byte order):
+//
+//     "EXPB" version size resreg ncode nwrk nnames nfuncs noutputs  (int32)
+//     wrk[nwrk]                                                     (double)
+//     code[ncode] outputs[noutputs]                                 (int32)
+//     nnames variable names, nfuncs arity+function names and
+//     noutputs output names                                (NUL terminated)
+//
+// Variable names are given for each frame position (empty if unused)
+// and function operands of FUNC0/FUNC1/FUNC2 are indexes in the list
+// of function names of the program.
+void Expr::save(std::string& out, const std::vector<std::string>& frameNames) const {
+    std::vector<int> c = code().words();
+    const Span<double> wrk = this->wrk();
+    const Span<int> outputs = this->outputs();
+    const Span<std::string> names = this->names();
+    std::vector<std::pair<int, int> > used;
+    std::string strings;
+    for (int i=0,n=frameNames.size(); i<n; i++) strings += frameNames[i] + '\0';
+    for (int i=0,n=c.size(); i<n; i+=length(c[i])) {
+        if (c[i] < FUNC0) continue;
+        std::pair<int, int> f(c[i], c[i+1]);
+        int j = std::find(used.begin(), used.end(), f) - used.begin();
+        if (j == int(used.size())) {
+            const char *fn = functionName(c[i], c[i+1]);
+            if (strcmp(fn, "?") == 0) throw Error("Function without a name");
+            used.push_back(f);
+            int kind = c[i] - FUNC0 + (c[i] == FUNCN ? funcN[c[i+1]].arity : 0);
+            if (kind > 127) throw Error("Too many parameters");
+            strings += char(kind);
+            strings += std::string(fn) + '\0';
+        }
+        c[i+1] = j;
+    }
+    for (int i=0,n=outputs.size(); i<n; i++) {
+        c.push_back(outputs[i]);
+        strings += names[i] + '\0';
+    }
+    int32_t header[9] = { 0, BINARY_VERSION, 0, program->resreg, int32_t(program->ncode), int32_t(wrk.size()),
+                          int32_t(frameNames.size()), int32_t(used.size()), int32_t(outputs.size()) };
+    memcpy(header, "EXPB", 4);
+    header[2] = sizeof(header) + wrk.size()*sizeof(double) + c.size()*sizeof(int32_t) + strings.size();
+    size_t start = out.size();
+    out.resize(start + header[2]);
+    char *p = &out[start];
+    memcpy(p, header, sizeof(header));
+    p += sizeof(header);
+    if (!wrk.empty()) memcpy(p, &wrk[0], wrk.size()*sizeof(double));
+    p += wrk.size()*sizeof(double);
+    for (int i=0,n=c.size(); i<n; i++,p+=sizeof(int32_t)) {
+        int32_t x = c[i];
+        memcpy(p, &x, sizeof(x));
+    }
+    if (!strings.empty()) memcpy(p, strings.data(), strings.size());
+}
+
+void Expr::save(std::string& out, const std::map<std::string, double>& vars) const {
+    std::vector<std::string> names(variableCount());
+    for (std::map<std::string, double>::const_iterator it=vars.begin(); it!=vars.end(); ++it) {
+        int i = variableIndex(&it->second);
+        if (i != -1) names[i] = it->first;
+    }
+    for (int i=0,n=variableCount(); i<n; i++) {
+        if (names[i].empty() && variables()[i] != &undefined) throw Error("Variable not in map");
+    }
+    save(out, names);
+}
+
+void Expr::save(std::string& out, const Symbols& symbols) const {
+    std::vector<std::string> names(variableCount());
+    for (int i=0,n=variableCount(); i<n; i++) names[i] = symbols.name(i);
+    save(out, names);
+}
+
+Expr Expr::load(const char *& data, size_t size, std::map<std::string, double>& vars) {
+    return load(data, size, &vars, 0);
+}
+
+Expr Expr::load(const char *& data, size_t size, const Symbols& symbols) {
+    return load(data, size, 0, &symbols);
+}
+
+int Expr::operandKind(int op, int k) {
+    if (op == JMP || (k == 2 && op >= JZ && op <= JOR)) return OP_JUMP;
+    if (k == 1 && op >= FUNC0) return OP_FUNCTION;
+    if (k == 3 && op == FUNCN) return OP_PARAMETERS;
+    if (k == 2 && op == RANDOM) return OP_STATE;
+    if (k == 3 && op == RANDOM) return OP_INDEX;
+    if (k == 2 && (op == LOAD || (op >= ADD_V && op <= DIV_V) || (op >= LADD && op <= LDIV))) {
+        return OP_FRAME;
+    }
+    return OP_REGISTER;
+}
+
+// i-th int32 of the binary form (that may be unaligned)
+static int word(const char *p, int i) {
+    int32_t x;
+    memcpy(&x, p + i*sizeof(x), sizeof(x));
+    return x;
+}
+
+// Stores the i-th word of a code of the given width
+static void put(char *code, int width, int i, int x) {
+    switch (width) {
+    case 1: ((uint8_t *)code)[i] = x; break;
+    case 2: ((uint16_t *)code)[i] = x; break;
+    default: ((int *)code)[i] = x; break;
+    }
+}
+
+// The code is checked before being used, so a damaged file gives an
+// error and never an out of bounds access. The program block is then
+// filled in a single pass directly from the data (relinking variables
+// and functions), without building an intermediate Draft.
+Expr Expr::load(const char *& data, size_t size, std::map<std::string, double> *vars,
+                const Symbols *symbols) {
+    int32_t header[9];
+    if (size < sizeof(header)) throw Error("Truncated binary expression");
+    memcpy(header, data, sizeof(header));
+    if (memcmp(header, "EXPB", 4) != 0) throw Error("Not a binary expression");
+    if (header[1] != BINARY_VERSION) throw Error("Unsupported binary expression version");
+    int resreg = header[3], ncode = header[4], nwrk = header[5], nnames = header[6], nfuncs = header[7];
+    int noutputs = header[8];
+    if (header[2] < int(sizeof(header)) || size_t(header[2]) > size || ncode < 0 || nwrk < 1 ||
+        nnames < 0 || nfuncs < 0 || noutputs < 0 || resreg < 0 || resreg >= nwrk ||
+        size_t(nnames) + size_t(nfuncs) + size_t(noutputs) > size_t(header[2]) ||
+        (header[2] - sizeof(header)) / sizeof(double) < size_t(nwrk) ||
+        (header[2] - sizeof(header) - nwrk*sizeof(double)) / sizeof(int32_t) <
+        size_t(ncode) + size_t(noutputs)) {
+        throw Error("Invalid binary expression");
+    }
+    const char *wrk = data + sizeof(header), *end = data + header[2];
+    const char *code = wrk + nwrk*sizeof(double), *outputs = code + ncode*sizeof(int32_t);
+    const char *p = outputs + noutputs*sizeof(int32_t);
+    for (int i=0; i<noutputs; i++) {
+        if (word(outputs, i) < 0 || word(outputs, i) >= nwrk) throw Error("Invalid binary expression");
+    }
+    // Frame positions (remapped to the slots of the symbol table) and functions
+    std::vector<int> frame(nnames, -1), func(nfuncs), arities(nfuncs);
+    std::vector<double *> addresses(symbols ? 0 : nnames, &undefined);
+    int nvariables = symbols ? 0 : nnames;
+    std::string name;
+    for (int i=0; i<nnames+nfuncs; i++) {
+        int arity = 0;
+        if (i >= nnames) {
+            if (p == end) throw Error("Invalid binary expression");
+            arity = *p++;
+        }
+        const char *e = (const char *)memchr(p, 0, end - p);
+        if (!e) throw Error("Invalid binary expression");
+        name.assign(p, e);
+        p = e + 1;
+        if (i >= nnames) {
+            std::map<std::string, std::pair<int, int> >::iterator it = functions.find(name);
+            if (it == functions.end() || it->second.second != arity) {
+                throw Error("Unknown function '" + name + "'");
+            }
+            func[i - nnames] = it->second.first;
+            arities[i - nnames] = arity;
+        } else if (name.empty()) {
+            continue;
+        } else if (symbols) {
+            frame[i] = symbols->slot(name);
+            if (frame[i] == -1) throw Error("Unknown variable '" + name + "'");
+            nvariables = std::max(nvariables, frame[i] + 1);
+        } else {
+            std::map<std::string, double>::iterator it = vars->find(name);
+            if (it == vars->end()) throw Error("Unknown variable '" + name + "'");
+            frame[i] = i;
+            addresses[i] = &it->second;
+        }
+    }
+    const char *names = p;
+    for (int i=0; i<noutputs; i++) {
+        const char *e = (const char *)memchr(p, 0, end - p);
+        if (!e) throw Error("Invalid binary expression");
+        p = e + 1;
+    }
+    // Checks the operands and finds the width of the relinked code
+    unsigned top = FUNCN + 1;
+    int rng = -1;
+    std::vector<int> jumps;
+    for (int i=0; i<ncode; ) {
+        int op = word(code, i), len;
+        if (op < MOVE || op > FUNCN || i + (len = length(op)) > ncode) {
+            throw Error("Invalid binary expression");
+        }
+        bool ok = true;
+        for (int k=1; ok && k<len; k++) {
+            int x = word(code, i+k);
+            switch (operandKind(op, k)) {
+            case OP_JUMP:
+                // Only forward jumps, so evaluation always terminates
+                ok = x > 0 && x <= ncode - i;
+                if (ok) jumps.push_back(i + x);
+                break;
+            case OP_FUNCTION:
+                ok = x >= 0 && x < nfuncs && std::min(arities[x], int(FUNCN - FUNC0)) == op - FUNC0;
+                if (ok) x = func[x];
+                break;
+            case OP_PARAMETERS:
+                // Block of the parameters
+                ok = x >= 0 && x + funcN[func[word(code, i+1)]].arity <= nwrk;
+                break;
+            case OP_STATE:
+                // State of the generator (the same for all the calls)
+                ok = x >= 0 && x + 3 <= nwrk && (rng == -1 || rng == x);
+                if (ok) rng = x;
+                break;
+            case OP_INDEX:
+                ok = x >= 0;
+                break;
+            case OP_FRAME:
+                ok = x >= 0 && x < nnames && frame[x] != -1;
+                if (ok) x = frame[x];
+                break;
+            default:
+                ok = x >= 0 && x < nwrk;
+            }
+            if (ok) top = std::max(top, unsigned(x));
+        }
+        if (!ok) throw Error("Invalid binary expression");
+        i += len;
+    }
+    // Jump targets must be instructions (or the end of the code)
+    std::sort(jumps.begin(), jumps.end());
+    for (int i=0,j=0,n=jumps.size(); j<n; ) {
+        if (jumps[j] < i) throw Error("Invalid binary expression");
+        if (jumps[j] == i) j++; else i += length(word(code, i));
+    }
+    int width = codeWidth(top);
+    Program *pr = newProgram(nwrk, nvariables, noutputs, ncode, width);
+    Expr result(pr);
+    pr->resreg = resreg;
+    pr->rng = rng;
+    double *w = (double *)(pr + 1);
+    double **v = (double **)(w + nwrk);
+    int *o = (int *)(v + nvariables);
+    char *c = (char *)(o + noutputs);
+    memcpy(w, wrk, nwrk*sizeof(double));
+    for (int i=0; i<nvariables; i++) v[i] = symbols ? &undefined : addresses[i];
+    for (int i=0; i<noutputs; i++) o[i] = word(outputs, i);
+    for (int i=0; i<noutputs; i++) {
+        pr->names.push_back(names);
+        names += pr->names.back().size() + 1;
+    }
+    for (int i=0; i<ncode; ) {
+        int op = word(code, i), len = length(op);
+        put(c, width, i, op);
+        for (int k=1; k<len; k++) {
+            int x = word(code, i+k), kind = operandKind(op, k);
+            put(c, width, i+k, kind == OP_FUNCTION ? func[x] : kind == OP_FRAME ? frame[x] : x);
+        }
+        i += len;
+    }
+    put(c, width, ncode, FUNCN + 1);
+    data = end;
+    return result;
+}
+
+// Library file: "EXPL" version count, offsets of the programs (int64)
+// and then the programs in binary form
+Expr::Library::Library(const char *filename) : data(0), length(0), count(0), mapped(false) {
+#if defined(EXPR_MMAP)
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1) throw Error(std::string("Cannot open ") + filename);
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        length = st.st_size;
+        void *p = mmap(0, length, PROT_READ, MAP_SHARED, fd, 0);
+        if (p != MAP_FAILED) {
+            data = (const char *)p;
+            mapped = true;
+        }
+    }
+    close(fd);
+#endif
+    if (!mapped) {
+        FILE *f = fopen(filename, "rb");
+        if (!f) throw Error(std::string("Cannot open ") + filename);
+        std::string buf;
+        char chunk[65536];
+        for (size_t n; (n = fread(chunk, 1, sizeof(chunk), f)) > 0; ) buf.append(chunk, n);
+        fclose(f);
+        length = buf.size();
+        char *p = new char[length + 1];
+        memcpy(p, buf.data(), length);
+        data = p;
+    }
+    int32_t header[3];
+    if (length < sizeof(header) || memcmp(data, "EXPL", 4) != 0 ||
+        (memcpy(header, data, sizeof(header)), header[1] != BINARY_VERSION) ||
+        header[2] < 0 || (length - sizeof(header)) / sizeof(int64_t) < size_t(header[2])) {
+        unmap();
+        throw Error(std::string("Invalid library file ") + filename);
+    }
+    count = header[2];
+}
+
+Expr::Library::~Library() {
+    unmap();
+}
+
+void Expr::Library::unmap() {
+#if defined(EXPR_MMAP)
+    if (mapped) munmap((void *)data, length);
+#endif
+    if (!mapped) delete[] data;
+    data = 0;
+}
+
+void Expr::Library::program(int i, const char *& p, size_t& size) const {
+    if (i < 0 || i >= count) throw Error("Program index out of range");
+    int64_t offset;
+    memcpy(&offset, data + 3*sizeof(int32_t) + i*sizeof(int64_t), sizeof(offset));
+    if (offset < 0 || uint64_t(offset) > length) throw Error("Invalid library file");
+    p = data + offset;
+    size = length - offset;
+}
+
+Expr Expr::Library::load(int i, std::map<std::string, double>& vars) const {
+    const char *p;
+    size_t size;
+    program(i, p, size);
+    return Expr::load(p, size, vars);
+}
+
+Expr Expr::Library::load(int i, const Symbols& symbols) const {
+    const char *p;
+    size_t size;
+    program(i, p, size);
+    return Expr::load(p, size, symbols);
+}
+
+void Expr::Library::write(const char *filename, const std::vector<std::string>& programs) {
+    int32_t header[3] = { 0, BINARY_VERSION, int32_t(programs.size()) };
+    memcpy(header, "EXPL", 4);
+    std::string out((const char *)header, sizeof(header));
+    int64_t offset = sizeof(header) + programs.size()*sizeof(int64_t);
+    for (int i=0,n=programs.size(); i<n; i++) {
+        out.append((const char *)&offset, sizeof(offset));
+        offset += programs[i].size();
+    }
+    for (int i=0,n=programs.size(); i<n; i++) out += programs[i];
+    FILE *f = fopen(filename, "wb");
+    if (!f) throw Error(std::string("Cannot create ") + filename);
+    bool ok = fwrite(out.data(), 1, out.size(), f) == out.size();
+    if (fclose(f) != 0 || !ok) throw Error(std::string("Error writing ") + filename);
+}
+
+int Expr::Graph::add(const std::string& name, const char *s, bool optimize) {
+    bool existing = vars.count(name) > 0;
+    double *out = &vars[name];
+    try {
+        if (writers.count(out)) throw Error("Duplicate formula '" + name + "'");
+        Formula f = { Expr::parse(s, vars, optimize), out, 0, false };
+        if (reaches(out, f.expr)) throw Error("Circular reference in '" + name + "'");
+        int i = formulas.size();
+        formulas.push_back(f);
+        writers[out] = i;
+        const Span<double *> v = f.expr.variables();
+        for (int j=0,nv=v.size(); j<nv; j++) readers[v[j]].push_back(i);
+        dirty.push_back(i);
+        sorted = false;
+        return i;
+    } catch (...) {
+        if (!existing) vars.erase(name);
+        throw;
+    }
+}
+
+// True if the value at address from is used (directly or through other
+// formulas) by e
+bool Expr::Graph::reaches(const double *from, const Expr& e) const {
+    std::vector<const double *> stack(1, from);
+    std::vector<bool> seen(formulas.size());
+    while (!stack.empty()) {
+        const double *p = stack.back();
+        stack.pop_back();
+        if (e.variableIndex(p) != -1) return true;
+        std::map<const double *, std::vector<int> >::const_iterator it = readers.find(p);
+        if (it == readers.end()) continue;
+        for (int i=0,n=it->second.size(); i<n; i++) {
+            int f = it->second[i];
+            if (!seen[f]) {
+                seen[f] = true;
+                stack.push_back(formulas[f].out);
+            }
+        }
+    }
+    return false;
+}
+
+void Expr::Graph::set(const std::string& name, double x) {
+    std::map<std::string, double>::iterator it = vars.find(name);
+    if (it == vars.end()) throw Error("Unknown variable '" + name + "'");
+    if (memcmp(&x, &it->second, sizeof(x)) != 0) {
+        it->second = x;
+        changes.push_back(&it->second);
+    }
+}
+
+void Expr::Graph::changed(const std::string& name) {
+    std::map<std::string, double>::iterator it = vars.find(name);
+    if (it == vars.end()) throw Error("Unknown variable '" + name + "'");
+    changes.push_back(&it->second);
+}
+
+void Expr::Graph::changed(const double *addr) {
+    changes.push_back(addr);
+}
 
-             {"<<", 3, B_SHL}, {">>", 3, B_SHR},
-             {"&", 4, B_AND},
-             {"|", 5, B_OR}, {"^", 5, B_XOR},
+// Ranks the formulas in dependency order (Kahn's algorithm)
+void Expr::Graph::sort() {
+    int n = formulas.size();
+    std::vector<int> pending(n), order;
+    for (int i=0; i<n; i++) {
+        const Span<double *> v = formulas[i].expr.variables();
+        for (int j=0,nv=v.size(); j<nv; j++) pending[i] += writers.count(v[j]);
+        if (pending[i] == 0) order.push_back(i);
+    }
+    for (int k=0; k<int(order.size()); k++) {
+        Formula& f = formulas[order[k]];
+        f.rank = k;
+        std::map<const double *, std::vector<int> >::iterator it = readers.find(f.out);
+        if (it == readers.end()) continue;
+        for (int i=0,nr=it->second.size(); i<nr; i++) {
+            if (--pending[it->second[i]] == 0) order.push_back(it->second[i]);
+        }
+    }
+    sorted = true;
+}
+
+// Queues formula f (the heap returns the lowest rank first)
+void Expr::Graph::push(int f) {
+    if (formulas[f].queued) return;
+    formulas[f].queued = true;
+    heap.push_back(f);
+    std::push_heap(heap.begin(), heap.end(), Later(formulas));
+}
+
+// A formula is evaluated after all the formulas it depends on and its
+// readers are queued only if its value changes, so the work done is
+// proportional to the part of the graph affected by the changes
+int Expr::Graph::update() {
+    if (!sorted) sort();
+    for (int i=0,n=dirty.size(); i<n; i++) push(dirty[i]);
+    dirty.clear();
+    for (int i=0,n=changes.size(); i<n; i++) {
+        std::map<const double *, std::vector<int> >::iterator it = readers.find(changes[i]);
+        if (it == readers.end()) continue;
+        for (int j=0,nr=it->second.size(); j<nr; j++) push(it->second[j]);
+    }
+    changes.clear();
+    int count = 0;
+    while (!heap.empty()) {
+        std::pop_heap(heap.begin(), heap.end(), Later(formulas));
+        Formula& f = formulas[heap.back()];
+        heap.pop_back();
+        f.queued = false;
+        double x = f.expr.eval();
+        count++;
+        if (memcmp(&x, f.out, sizeof(x)) != 0) {
+            *f.out = x;
+            std::map<const double *, std::vector<int> >::iterator it = readers.find(f.out);
+            if (it == readers.end()) continue;
+            for (int j=0,nr=it->second.size(); j<nr; j++) push(it->second[j]);
+        }
+    }
+    return count;
+}
+
+static bool isword(char c) {
+    return isalnum((unsigned char)c) || c == '_' || c == '.';
+}
 
-             {"<", 6, LT}, {">", 6, GT}, {"<=", 6, LE}, {">=", 6, GE}, {"==", 6, EQ}, {"!=", 6, NE},
+// Decimal and hexadecimal exponent letters
+static bool isexp(char c) {
+    return c == 'e' || c == 'E' || c == 'p' || c == 'P';
+}
 
-             {"&&", 7, AND},
+// Expression text without comments and keeping a single space only
+// where removing it would change the meaning, i.e. when it separates
+// two tokens that would otherwise join ("x 1", "< =", "1e -5", "0x1p -3")
+// or a name from a parenthesis ("sin (x)" is not a function call)
+std::string Expr::Cache::normalize(const char *s) {
+    std::string res;
+    for (;;) {
+        const char *s0 = s;
+        skipsp(s);
+        if (!*s) break;
+        if (s != s0 && !res.empty()) {
+            char p = res[res.size()-1], pp = res.size() > 1 ? res[res.size()-2] : 0, c = *s;
+            char two[] = { p, c, 0 };
+            int len, level;
+            if ((isword(p) && (isword(c) || c == '(')) ||
+                (binop(two, len, level) != -1 && len == 2) ||
+                (isexp(p) && (c == '+' || c == '-')) ||
+                (isexp(pp) && (p == '+' || p == '-') && isword(c))) {
+                res += ' ';
+            }
+        }
+        res += *s++;
+    }
+    return res;
+}
 
-             {"||", 8, OR}};
-        int n = sizeof(ops) / sizeof(ops[0]);
-        for (int i=0; i<n; i++) {
-            Expr::operators[ops[i].name] = ops[i];
+Expr Expr::Cache::get(const char *s, std::map<std::string, double>& vars, bool optimize) {
+    Key key = { &vars, optimize, normalize(s) };
+    {
+        std::lock_guard<std::mutex> lock(m);
+        std::map<Key, Entries::iterator>::iterator it = index.find(key);
+        if (it != index.end()) {
+            counters.hits++;
+            entries.splice(entries.begin(), entries, it->second);
+            return it->second->second;
         }
-        Expr::max_level = ops[n-1].level;
+        counters.misses++;
+    }
+    // Compilation is done without holding the lock; errors are not cached
+    Expr e = parse(s, vars, optimize);
+    std::lock_guard<std::mutex> lock(m);
+    std::map<Key, Entries::iterator>::iterator it = index.find(key);
+    if (it != index.end()) {
+        // Another thread compiled the same expression in the meantime
+        entries.splice(entries.begin(), entries, it->second);
+        return it->second->second;
+    }
+    entries.push_front(std::make_pair(key, e));
+    index[key] = entries.begin();
+    while (entries.size() > capacity) {
+        index.erase(entries.back().first);
+        entries.pop_back();
+        counters.evictions++;
+    }
+    return e;
+}
 
-        Expr::addFunction("random", random);
+Expr::Cache::Stats Expr::Cache::stats() const {
+    std::lock_guard<std::mutex> lock(m);
+    Stats res = counters;
+    res.size = entries.size();
+    return res;
+}
+
+void Expr::Cache::clear() {
+    std::lock_guard<std::mutex> lock(m);
+    entries.clear();
+    index.clear();
+}
 
-        Expr::inlined["floor"] = std::make_pair(Expr::FFLOOR, 1);
-        Expr::inlined["abs"] = std::make_pair(Expr::FABS, 1);
-        Expr::inlined["sqrt"] = std::make_pair(Expr::FSQRT, 1);
-        Expr::inlined["sin"] = std::make_pair(Expr::FSIN, 1);
-        Expr::inlined["cos"] = std::make_pair(Expr::FCOS, 1);
-        Expr::inlined["tan"] = std::make_pair(Expr::FTAN, 1);
-        Expr::inlined["atan"] = std::make_pair(Expr::FATAN, 1);
-        Expr::inlined["log"] = std::make_pair(Expr::FLOG, 1);
-        Expr::inlined["exp"] = std::make_pair(Expr::FEXP, 1);
-        Expr::inlined["atan2"] = std::make_pair(Expr::FATAN2, 2);
-        Expr::inlined["pow"] = std::make_pair(Expr::FPOW, 2);
+// Drops the entries using a variable map (must be called before
+// destroying a map used with the cache)
+void Expr::Cache::forget(const std::map<std::string, double>& vars) {
+    std::lock_guard<std::mutex> lock(m);
+    for (Entries::iterator it=entries.begin(); it!=entries.end(); ) {
+        if (it->first.vars == &vars) {
+            index.erase(it->first);
+            it = entries.erase(it);
+        } else {
+            ++it;
+        }
     }
-} init_instance;
+}
+
@@ -30,8 +30,21 @@ SOFTWARE.
 #include <map>
 #include <stdexcept>
 #include <algorithm>
+#include <memory>
+#include <list>
+#include <set>
+#include <mutex>
+#include <atomic>
+#include <limits>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+
+// With GCC and clang the evaluation loop uses direct threading (labels
+// as values) unless EXPR_SWITCH_DISPATCH is defined
+#if !defined(EXPR_SWITCH_DISPATCH) && defined(__GNUC__)
+#define EXPR_THREADED_DISPATCH
+#endif
 
 class Expr {
 
@@ -43,7 +56,75 @@ public:
         {}
     };
 
+    enum { BATCH_SIZE = 256 };
+
+    class Symbols;
+
     double eval() const;
+    double eval(double *regs) const;
+    double evalFrame(const double *frame) const;
+    double evalFrame(const double *frame, double *regs) const;
+    void evalFrames(int n, const double *frames, int stride, double *out) const;
+    void evalFrames(int n, const float *frames, int stride, float *out) const;
+    void eval(int n, const double * const *columns, double *out, const int *strides = 0) const;
+    void eval(int n, const double * const *columns, double *out, const int *strides,
+              double *regs) const;
+    void eval(int n, const float * const *columns, float *out, const int *strides = 0) const;
+    void eval(int n, const float * const *columns, float *out, const int *strides,
+              float *regs) const;
+
+    struct Axis {
+        std::string name;
+        double start, step;
+        int count;
+        Axis(const std::string& name, double start, double step, int count)
+            : name(name), start(start), step(step), count(count)
+        {}
+    };
+
+    void evalGrid(std::map<std::string, double>& vars, const std::vector<Axis>& axes,
+                  double *out, int threads = 0) const;
+
+    // A range of values [lo, hi] (infinities included) that may also
+    // contain NaN
+    struct Interval {
+        double lo, hi;
+        bool nan;
+
+        Interval() : lo(0), hi(0), nan(false) {}
+        Interval(double x) : lo(x), hi(x), nan(x != x) {
+            if (nan) { lo = -std::numeric_limits<double>::infinity(); hi = -lo; }
+        }
+        Interval(double lo, double hi, bool nan = false) : lo(lo), hi(hi), nan(nan) {}
+    };
+
+    Interval evalInterval(const Interval *ranges) const;
+    Interval evalInterval(const Interval *ranges, Interval *regs) const;
+
+    int evalGridCulled(std::map<std::string, double>& vars, const std::vector<Axis>& axes,
+                       double *out, double lo = -std::numeric_limits<double>::infinity(),
+                       double hi = std::numeric_limits<double>::infinity(),
+                       int threads = 0) const;
+
+    int registerCount() const {
+        return program->nwrk;
+    }
+
+    void initRegisters(double *regs) const;
+
+    void initBatchRegisters(double *regs) const;
+    void initBatchRegisters(float *regs) const;
+
+    int variableCount() const {
+        return program->nvariables;
+    }
+
+    int variableIndex(const double *addr) const {
+        for (int i=0,n=program->nvariables; i<n; i++) {
+            if (program->variables()[i] == addr) return i;
+        }
+        return -1;
+    }
 
     static void skipsp(const char *& s) {
         for(;;) {
@@ -54,99 +135,663 @@ public:
         }
     }
 
-    static Expr partialParse(const char *& s, std::map<std::string, double>& vars);
+    static Expr partialParse(const char *& s, std::map<std::string, double>& vars,
+                             bool optimize = true);
 
-    static Expr parse(const char *s, std::map<std::string, double>& vars) {
+    static Expr parse(const char *s, std::map<std::string, double>& vars,
+                      bool optimize = true) {
         const char *s0 = s;
-        Expr expr = partialParse(s, vars);
+        Expr expr = partialParse(s, vars, optimize);
         if (*s) throw Error("Unexpected extra characters\n", s - s0);
         return expr;
     }
 
-    Expr(double x = 0.0) {
-        resreg = 0;
-        wrk.push_back(x);
+    static Expr partialParse(const char *& s, const Symbols& symbols, bool optimize = true);
+
+    static Expr parse(const char *s, const Symbols& symbols, bool optimize = true) {
+        const char *s0 = s;
+        Expr expr = partialParse(s, symbols, optimize);
+        if (*s) throw Error("Unexpected extra characters\n", s - s0);
+        return expr;
     }
 
-    void swap(Expr& other) {
-        std::swap(resreg, other.resreg);
-        code.swap(other.code);
-        wrk.swap(other.wrk);
-        variables.swap(other.variables);
+    // Programs computing many outputs (one for each line of the text or
+    // each expression of the list) sharing loads and subexpressions
+    static Expr parseMany(const char *s, std::map<std::string, double>& vars,
+                          bool optimize = true);
+    static Expr parseMany(const char *s, const Symbols& symbols, bool optimize = true);
+    static Expr parseMany(const std::vector<std::string>& exprs,
+                          std::map<std::string, double>& vars, bool optimize = true);
+    static Expr parseMany(const std::vector<std::string>& exprs, const Symbols& symbols,
+                          bool optimize = true);
+
+    // Programs computing the value (output 0) and the derivatives with
+    // respect to the listed variables (outputs 1, 2 ...)
+    static Expr gradient(const char *s, std::map<std::string, double>& vars,
+                         const std::vector<std::string>& wrt);
+    static Expr gradient(const char *s, const Symbols& symbols,
+                         const std::vector<std::string>& wrt);
+
+    int outputCount() const {
+        return program->noutputs ? program->noutputs : 1;
+    }
+
+    std::string outputName(int i) const {
+        return program->names.empty() ? std::string() : program->names[i];
+    }
+
+    int outputIndex(const std::string& name) const {
+        for (int i=0,n=program->names.size(); i<n; i++) {
+            if (program->names[i] == name) return i;
+        }
+        return -1;
+    }
+
+    void evalAll(double *out) const;
+    void evalAll(double *out, double *regs) const;
+    void evalFrameAll(const double *frame, double *out) const;
+    void evalFrameAll(const double *frame, double *out, double *regs) const;
+
+    Expr(double x = 0.0);
+
+    // Copies share the compiled program (only the evaluation scratch
+    // registers are per copy)
+    Expr(const Expr& other)
+        : native(other.native), nativeCode(other.nativeCode), mathAccuracy(other.mathAccuracy),
+          randomSeed(other.randomSeed), randomRow(other.randomRow) {
+        attach(other.program);
     }
 
-    Expr(const char *s, std::map<std::string, double>& m) {
-        Expr e = parse(s, m);
+    Expr& operator=(const Expr& other) {
+        Expr e(other);
         swap(e);
+        return *this;
+    }
+
+    ~Expr() {
+        detach(program);
+    }
+
+    void swap(Expr& other) {
+        std::swap(program, other.program);
+        scratch.swap(other.scratch);
+        std::swap(native, other.native);
+        nativeCode.swap(other.nativeCode);
+        std::swap(mathAccuracy, other.mathAccuracy);
+        std::swap(randomSeed, other.randomSeed);
+        std::swap(randomRow, other.randomRow);
+    }
+
+    Expr(const char *s, std::map<std::string, double>& m, bool optimize = true)
+        : native(0), mathAccuracy(EXACT), randomSeed(0), randomRow(0) {
+        attach(parse(s, m, optimize).program);
     }
 
     operator double() const {
         return eval();
     }
 
-    static void addFunction(const char *name, double (*f)()) {
+    // Pure functions (the result depends only on the parameters and
+    // there are no side effects) are called at compile time when the
+    // parameters are constant and only once for repeated calls
+    static void addFunction(const char *name, double (*f)(), bool pure = false) {
         func0.push_back(f);
         functions[name] = std::make_pair(func0.size()-1, 0);
+        setPure(FUNC0, func0.size()-1, pure);
     }
 
-    static void addFunction(const char *name, double (*f)(double)) {
+    static void addFunction(const char *name, double (*f)(double), bool pure = false) {
         func1.push_back(f);
         functions[name] = std::make_pair(func1.size()-1, 1);
+        functions.erase(std::string(name) + "'");
+        setPure(FUNC1, func1.size()-1, pure);
     }
 
-    static void addFunction(const char *name, double (*f)(double, double)) {
+    static void addFunction(const char *name, double (*f)(double, double), bool pure = false) {
         func2.push_back(f);
         functions[name] = std::make_pair(func2.size()-1, 2);
+        functions.erase(std::string(name) + "'1");
+        functions.erase(std::string(name) + "'2");
+        setPure(FUNC2, func2.size()-1, pure);
+    }
+
+    // General functions of any number of parameters: f receives the
+    // context pointer given here and the array of the parameters. The
+    // optional batch version computes n results at once (args[i] points
+    // to the n values of parameter i) and is used by batch evaluation.
+    typedef double (*Function)(void *context, const double *args);
+    typedef void (*BatchFunction)(void *context, size_t n, const double * const *args,
+                                  double *out);
+
+    static void addFunction(const char *name, int arity, Function f, void *context = 0,
+                            BatchFunction batch = 0, bool pure = false) {
+        if (arity < 0) throw Error("Invalid number of parameters");
+        Call call = { f, batch, context, arity };
+        funcN.push_back(call);
+        functions[name] = std::make_pair(funcN.size()-1, FUNCN - FUNC0 + arity);
+        functions.erase(std::string(name) + "'");
+        for (int i=1; i<=arity; i++) functions.erase(std::string(name) + "'" + std::to_string(i));
+        setPure(FUNCN, funcN.size()-1, pure);
+    }
+
+    // Functions with derivatives (used by gradient)
+    static void addFunction(const char *name, double (*f)(double), double (*df)(double)) {
+        addFunction(name, f);
+        addFunction((std::string(name) + "'").c_str(), df);
+    }
+
+    static void addFunction(const char *name, double (*f)(double, double),
+                            double (*dfa)(double, double), double (*dfb)(double, double)) {
+        addFunction(name, f);
+        addFunction((std::string(name) + "'1").c_str(), dfa);
+        addFunction((std::string(name) + "'2").c_str(), dfb);
+    }
+
+    // Looks up a function added with addFunction by name and number of
+    // parameters (false if there is none); general functions are not
+    // returned
+    static bool findFunction(const std::string& name, double (*&f)()) {
+        int i = function(name, 0);
+        if (i != -1) f = func0[i];
+        return i != -1;
+    }
+
+    static bool findFunction(const std::string& name, double (*&f)(double)) {
+        int i = function(name, 1);
+        if (i != -1) f = func1[i];
+        return i != -1;
+    }
+
+    static bool findFunction(const std::string& name, double (*&f)(double, double)) {
+        int i = function(name, 2);
+        if (i != -1) f = func2[i];
+        return i != -1;
     }
 
     std::string disassemble() const;
 
+    class Profile;
+    double profile(Profile& profile) const;
+    double profileFrame(const double *frame, Profile& profile) const;
+    std::string disassemble(const Profile& profile) const;
+
+    bool jit();
+
+    // Accuracy of sin, cos, tan, atan, atan2, exp, log, pow and floor in
+    // batch evaluation: EXACT calls the C library, ACCURATE and FAST use
+    // vectorized kernels when the CPU has AVX2 (errors of at most 1 and
+    // 3 ulp). Scalar evaluation always calls the C library.
+    enum Accuracy { EXACT, ACCURATE, FAST };
+
+    void setAccuracy(Accuracy a) {
+        mathAccuracy = a;
+    }
+
+    Accuracy accuracy() const {
+        return mathAccuracy;
+    }
+
+    // Instruction set used by the ACCURATE and FAST kernels, the best one
+    // the CPU supports unless changed by setVectorLevel (for all threads;
+    // VECTOR_NONE calls the C library). Returns false (and changes
+    // nothing) if the CPU doesn't support the level.
+    enum VectorLevel { VECTOR_NONE, VECTOR_AVX2, VECTOR_AVX512 };
+    static VectorLevel vectorLevel();
+    static bool setVectorLevel(VectorLevel level);
+
+    // random() is a counter based generator (Philox4x32-10): the value
+    // depends only on the seed, on the row and on which call it is in
+    // the text, so results are reproducible whatever the number of
+    // threads. Scalar evaluation moves to the next row at each
+    // evaluation, batch and grid evaluation use row + index of the
+    // point. Registers given to the scalar functions can be seeded
+    // independently with seedRegisters.
+    void setSeed(uint64_t seed, uint64_t row = 0);
+
+    uint64_t seed() const {
+        return randomSeed;
+    }
+
+    void seedRegisters(double *regs, uint64_t seed, uint64_t row = 0) const;
+
+    // Binary form of the compiled code (variables and functions are
+    // saved by name and linked again when loading)
+    void save(std::string& out, const std::map<std::string, double>& vars) const;
+    void save(std::string& out, const Symbols& symbols) const;
+    static Expr load(const char *& data, size_t size, std::map<std::string, double>& vars);
+    static Expr load(const char *& data, size_t size, const Symbols& symbols);
+
+    class Cache;
+    class Library;
+    class Graph;
+
 private:
     enum { MOVE, LOAD,
            NEG, NOT,
            ADD, SUB, MUL, DIV, LT, LE, GT, GE, EQ, NE, AND, OR,
            B_SHL, B_SHR, B_AND, B_OR, B_XOR,
            FSIN, FCOS, FFLOOR, FABS, FSQRT, FTAN, FATAN, FLOG, FEXP, FATAN2, FPOW,
-           FUNC0, FUNC1, FUNC2 };
+           ADD_V, SUB_V, MUL_V, DIV_V, ADD3, SUB3, MUL3, DIV3, LADD, LSUB, LMUL, LDIV,
+           MADD, MSUB, JMP, JZ, JAND, JOR, RANDOM,
+           FUNC0, FUNC1, FUNC2, FUNCN };
+
+    // Read-only view of one of the arrays of a program
+    template<typename T>
+    class Span {
+    public:
+        Span() : p(0), n(0) {}
+        Span(const T *p, size_t n) : p(p), n(n) {}
+        size_t size() const { return n; }
+        bool empty() const { return n == 0; }
+        const T& operator[](size_t i) const { return p[i]; }
+        const T *begin() const { return p; }
+        const T *end() const { return p + n; }
+    private:
+        const T *p;
+        size_t n;
+    };
 
-    int resreg;
-    std::vector<int> code;
-    mutable std::vector<double> wrk;
-    std::vector<double *> variables;
+    // Program being built by the compiler or the loader
+    struct Draft {
+        int resreg;
+        std::vector<int> code;
+        std::vector<double> wrk;
+        std::vector<double *> variables;
+        std::vector<int> outputs;
+        std::vector<std::string> names;
+        int rng;                        // random() state registers (-1 if none)
 
-    struct Operator {
-        const char *name;
-        int level;
-        int opcode;
+        Draft(size_t nwrk = 0) : resreg(0), wrk(nwrk), rng(-1) {}
+
+        int reg(std::vector<int>& regs) {
+            if (regs.size() == 0) {
+                wrk.resize(1 + wrk.size());
+                regs.push_back(wrk.size()-1);
+            }
+            int r = regs.back();
+            regs.pop_back();
+            return r;
+        }
+
+        int variableIndex(const double *addr) const {
+            for (int i=0,n=variables.size(); i<n; i++) {
+                if (variables[i] == addr) return i;
+            }
+            return -1;
+        }
+    };
+
+    // The finished program is a single reference counted block that
+    // is never modified and is shared by all the copies of an Expr: this
+    // header is followed by the initial registers, the variable addresses,
+    // the output registers and the code (terminated by an extra FUNCN + 1
+    // opcode for the threaded loop). Each opcode and operand of the code
+    // takes width bytes: 1 when all of them are below 256, 2 when they
+    // are below 65536 and 4 otherwise.
+    struct Program {
+        std::atomic<int> refs;
+        int resreg, nwrk, nvariables, noutputs, ncode, width, rng;
+        std::vector<std::string> names;
+
+        const double *wrk() const { return (const double *)(this + 1); }
+        double * const *variables() const { return (double * const *)(wrk() + nwrk); }
+        const int *outputs() const { return (const int *)(variables() + nvariables); }
+        template<typename C> const C *code() const { return (const C *)(outputs() + noutputs); }
+        template<typename C> const C *end() const { return code<C>() + ncode; }
     };
 
-    static std::map<std::string, Operator> operators;
-    static int max_level;
-    static std::map<std::string, std::pair<int, int> > inlined;
+    // Read-only view of the code of a program in any width
+    class Code {
+    public:
+        explicit Code(const Program *p) : p(p) {}
+        size_t size() const { return p->ncode; }
+        bool empty() const { return p->ncode == 0; }
+        int operator[](size_t i) const {
+            switch (p->width) {
+            case 1: return p->code<uint8_t>()[i];
+            case 2: return p->code<uint16_t>()[i];
+            default: return p->code<int>()[i];
+            }
+        }
+        std::vector<int> words() const {
+            std::vector<int> w(size());
+            for (size_t i=0; i<w.size(); i++) w[i] = (*this)[i];
+            return w;
+        }
+    private:
+        const Program *p;
+    };
+
+    Program *program;
+    enum { LOCAL_FRAME = 32 };
+    mutable std::vector<double> scratch;    // eval() registers, then its frame if large
+    double *scratchRegisters() const;
+
+    Span<double> wrk() const { return Span<double>(program->wrk(), program->nwrk); }
+    Span<double *> variables() const {
+        return Span<double *>(program->variables(), program->nvariables);
+    }
+    // Result registers and names ("" if unnamed) of multi-output programs
+    Span<int> outputs() const { return Span<int>(program->outputs(), program->noutputs); }
+    Span<std::string> names() const {
+        const std::vector<std::string>& n = program->names;
+        return Span<std::string>(n.empty() ? 0 : &n[0], n.size());
+    }
+    Code code() const { return Code(program); }
+
+    explicit Expr(const Draft& draft);
+    explicit Expr(Program *p);
+    static Program *newProgram(int nwrk, int nvariables, int noutputs, int ncode, int width);
+    void attach(Program *p);
+    static void detach(Program *p);
+
+    typedef void (*Native)(double *wp, const double *frame);
+    Native native;
+    std::shared_ptr<void> nativeCode;
+    Accuracy mathAccuracy;
+    uint64_t randomSeed, randomRow;
 
     static std::map<std::string, std::pair<int, int> > functions;
     static std::vector<double (*)()> func0;
     static std::vector<double (*)(double)> func1;
     static std::vector<double (*)(double,double)> func2;
+    struct Call {
+        Function f;
+        BatchFunction batch;
+        void *context;
+        int arity;
+    };
+    static std::vector<Call> funcN;
+    static std::set<std::pair<int, int> > pureFunctions;    // opcode and index
+
+    static void setPure(int op, int index, bool pure) {
+        if (pure) pureFunctions.insert(std::make_pair(op, index));
+    }
+
+    static bool isPure(int op, int index) {
+        return pureFunctions.count(std::make_pair(op, index)) != 0;
+    }
+
+    // Index of a function given the number of parameters (FUNCN - FUNC0
+    // plus the number of parameters for general functions)
+    static int function(const std::string& name, int arity) {
+        std::map<std::string, std::pair<int, int> >::iterator it = functions.find(name);
+        return it != functions.end() && it->second.second == arity ? it->second.first : -1;
+    }
 
-    class Init;
-    friend class Init;
+    class GridJob;
+    friend class GridJob;
+    class CullJob;
+    friend class CullJob;
+
+    class Jit;
+    friend class Jit;
 
     enum { READONLY = 0x4000000 };
 
-    int reg(std::vector<int>& regs) {
-        if (regs.size() == 0) {
-            wrk.resize(1 + wrk.size());
-            regs.push_back(wrk.size()-1);
+    static int binop(const char *s, int& len, int& level);
+    static const char *opname(int op);
+    static const char *functionName(int op, int index);
+    static double undefined;
+
+    static Expr compile(const char *& s, std::map<std::string, double> *vars,
+                        const Symbols *symbols, bool optimize);
+
+    static Expr compileMany(const std::vector<std::string>& statements,
+                            const std::vector<int>& offsets,
+                            std::map<std::string, double> *vars, const Symbols *symbols,
+                            bool optimize);
+    static Expr compileGradient(const char *s, const std::vector<std::string>& wrt,
+                                std::map<std::string, double> *vars, const Symbols *symbols);
+    void store(const double *wp, double *out) const;
+
+    enum { BINARY_VERSION = 3 };
+    void save(std::string& out, const std::vector<std::string>& frameNames) const;
+    static Expr load(const char *& data, size_t size, std::map<std::string, double> *vars,
+                     const Symbols *symbols);
+    // Kind of the k-th word of an instruction (checked and relinked by load)
+    enum { OP_REGISTER, OP_JUMP, OP_FUNCTION, OP_PARAMETERS, OP_STATE, OP_INDEX, OP_FRAME };
+    static int operandKind(int op, int k);
+
+    static int length(int op);
+    template<typename C> static const C *step(const C *cp, double *wp, const double *frame);
+    template<typename C> static void run(const C *cp, const C *ce, double *wp, const double *frame);
+    template<typename C>
+    void runInterval(const C *cp, const C *ce, Interval *wp, const Interval *frame) const;
+    struct Ranges;
+    template<typename C> static void run(const C *cp, double *wp, const double *frame);
+    template<typename C>
+    static void profileRun(const C *cp, const C *ce, double *wp, const double *frame,
+                           Profile& profile);
+
+    template<typename T> struct Columns;
+    template<typename T>
+    void batch(int n, const T * const *columns, T *out, const int *strides, T *wp,
+               uint64_t row) const;
+    template<typename T, typename C>
+    void batch(int n, const T * const *columns, T *out, const int *strides, T *wp,
+               uint64_t row, const C *c0) const;
+    template<typename T, typename C>
+    void split(const C *cp, int i0, int m, const T *wp, const Columns<T>& column,
+               T *out, uint64_t row) const;
+    static double random(const double *state, int site);
+    template<typename T>
+    static void random(uint64_t seed, uint64_t row, int site, int n, T *out);
+    struct VectorMath;
+    template<typename T>
+    static void call(const Call& f, int m, const T *args, T *out, std::vector<double>& tmp,
+                     std::vector<const double *>& ptrs);
+
+    struct Node;
+    class Compiler;
+    friend class Compiler;
+
+};
+
+// Thread-safe cache of compiled expressions keyed by the text (ignoring
+// comments and spacing that doesn't change the meaning), the variable
+// map and the optimize flag. The least recently used entry is dropped
+// when the capacity is exceeded. get returns a copy sharing the compiled
+// program, so each caller has its own scratch registers for eval().
+class Expr::Cache {
+public:
+    struct Stats {
+        uint64_t hits, misses, evictions;
+        size_t size;
+    };
+
+    Cache(size_t capacity = 256) : capacity(capacity) {
+        counters.hits = counters.misses = counters.evictions = counters.size = 0;
+    }
+
+    Expr get(const char *s, std::map<std::string, double>& vars, bool optimize = true);
+
+    Stats stats() const;
+    void clear();
+    void forget(const std::map<std::string, double>& vars);
+
+    static std::string normalize(const char *s);
+
+private:
+    struct Key {
+        const void *vars;
+        bool optimize;
+        std::string text;
+
+        bool operator<(const Key& other) const {
+            if (vars != other.vars) return vars < other.vars;
+            if (optimize != other.optimize) return optimize < other.optimize;
+            return text < other.text;
+        }
+    };
+
+    typedef std::list<std::pair<Key, Expr> > Entries;
+
+    size_t capacity;
+    mutable std::mutex m;
+    Entries entries;                // most recently used first
+    std::map<Key, Entries::iterator> index;
+    Stats counters;
+
+    Cache(const Cache&);
+    Cache& operator=(const Cache&);
+};
+
+// Names of the variables of an evaluation frame (an array of doubles or
+// a struct containing only doubles) and their positions (slots) in it
+class Expr::Symbols {
+public:
+    Symbols() : count(0) {}
+
+    // Adds a variable in the next free slot (returns the current slot
+    // if the variable is already present)
+    int add(const std::string& name) {
+        std::map<std::string, int>::iterator it = slots.find(name);
+        if (it != slots.end()) return it->second;
+        return add(name, count);
+    }
+
+    int add(const std::string& name, int slot) {
+        slots[name] = slot;
+        count = std::max(count, slot + 1);
+        return slot;
+    }
+
+    int slot(const std::string& name) const {
+        std::map<std::string, int>::const_iterator it = slots.find(name);
+        return it == slots.end() ? -1 : it->second;
+    }
+
+    // Name of the variable in a slot (empty if none)
+    std::string name(int slot) const {
+        for (std::map<std::string, int>::const_iterator it=slots.begin(); it!=slots.end(); ++it) {
+            if (it->second == slot) return it->first;
         }
-        int r = regs.back();
-        regs.pop_back();
-        return r;
+        return std::string();
     }
 
-    int compile(std::vector<int>& regs,
-                const char *& s, std::map<std::string, double>& vars, int level);
+    int size() const {
+        return count;
+    }
+
+private:
+    std::map<std::string, int> slots;
+    int count;
+};
+
+// Execution counts and times of the instructions of an expression
+// collected by Expr::profile. Times are in ticks: processor time stamp
+// counter cycles on x86, nanoseconds on other architectures.
+class Expr::Profile {
+public:
+    struct Counter {
+        uint64_t count, ticks;
+        Counter() : count(0), ticks(0) {}
+    };
+
+    // Only one execution every `period` of each instruction is timed
+    // (and its time is counted `period` times) to reduce the overhead
+    Profile(int period = 1) : period(std::max(1, period)), evaluations(0) {}
 
+    int period;
+    uint64_t evaluations;
+    std::vector<Counter> instructions;          // by code position (see disassemble)
+
+    // Totals by opcode (user functions by name) of the instructions of e
+    std::map<std::string, Counter> opcodes(const Expr& e) const;
+
+    void clear() {
+        evaluations = 0;
+        instructions.clear();
+    }
 };
 
+// A file containing many compiled expressions, mapped read-only in
+// memory (where supported) so that the expressions can be loaded when
+// needed without reading or parsing the whole file
+class Expr::Library {
+public:
+    Library(const char *filename);
+    ~Library();
+
+    int size() const {
+        return count;
+    }
+
+    Expr load(int i, std::map<std::string, double>& vars) const;
+    Expr load(int i, const Symbols& symbols) const;
+
+    // Writes a library file with the given expressions (see Expr::save)
+    static void write(const char *filename, const std::vector<std::string>& programs);
+
+private:
+    const char *data;
+    size_t length;
+    int count;
+    bool mapped;
+
+    void program(int i, const char *& p, size_t& size) const;
+    void unmap();
+
+    Library(const Library&);
+    Library& operator=(const Library&);
+};
+
+// Formulas whose results are stored in variables (and can be used by
+// other formulas) re-evaluated only when the values they depend on
+// change
+class Expr::Graph {
+public:
+    Graph(std::map<std::string, double>& vars) : vars(vars), sorted(true) {}
+
+    // Adds a formula computing vars[name] (created if needed); it will
+    // be evaluated by the next update
+    int add(const std::string& name, const char *s, bool optimize = true);
+
+    // Notifications of changed variables (dirty set)
+    void set(const std::string& name, double x);
+    void changed(const std::string& name);
+    void changed(const double *addr);
+
+    // Evaluates the formulas affected by the changes in dependency order
+    // and returns how many were evaluated
+    int update();
+
+    int size() const {
+        return formulas.size();
+    }
+
+private:
+    struct Formula {
+        Expr expr;
+        double *out;
+        int rank;
+        bool queued;
+    };
+
+    struct Later {
+        const std::vector<Formula>& formulas;
+        Later(const std::vector<Formula>& formulas) : formulas(formulas) {}
+        bool operator()(int a, int b) const {
+            return formulas[a].rank > formulas[b].rank;
+        }
+    };
+
+    std::map<std::string, double>& vars;
+    std::vector<Formula> formulas;
+    std::map<const double *, std::vector<int> > readers;
+    std::map<const double *, int> writers;
+    std::vector<const double *> changes;
+    std::vector<int> dirty, heap;
+    bool sorted;
+
+    void sort();
+    void push(int f);
+    bool reaches(const double *from, const Expr& e) const;
+
+    Graph(const Graph&);
+    Graph& operator=(const Graph&);
+};
+
+
 #endif
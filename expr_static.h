@@ -0,0 +1,452 @@
+#if !defined(EXPR_STATIC_H_INCLUDED)
+#define EXPR_STATIC_H_INCLUDED
+
+/*
+The MIT License (MIT)
+
+Copyright (c) 2014 Andrea Griffini
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+// Expressions known at compile time: the text is parsed by a constexpr
+// parser with the same grammar as Expr::parse and the tree is turned
+// into inlined C++ code by templates. Needs C++17 (if constexpr).
+//
+//     double r = EXPR_STATIC("sqrt(x*x + y*y) < 1 ? 1 : 0", x, y);
+//     auto f = EXPR_FUNCTION("x*x + y", x, y);    // f(3, 4) == 13
+
+#include "expr.h"
+#include <cmath>
+
+#if __cplusplus >= 201703L
+
+namespace ExprStatic {
+
+enum { CONST, NUMBER, VAR, NEG, NOT,
+       ADD, SUB, MUL, DIV, LT, LE, GT, GE, EQ, NE, B_SHL, B_SHR, B_AND, B_OR, B_XOR,
+       AND, OR, IF, FLOOR, ABS, SQRT, SIN, COS, TAN, ATAN, LOG, EXP, ATAN2, POW,
+       FUNC0, FUNC1, FUNC2 };
+
+struct Node {
+    int op = CONST;
+    int a = -1, b = -1, c = -1;     // operands (c is the else branch of IF)
+    int id = -1;                    // variable index
+    double value = 0.0;             // value of CONST
+    int pos = 0, len = 0;           // text of NUMBER and of user function names
+};
+
+// A node uses at least one character, so N = length + 1 is always enough
+template<int N>
+struct Tree {
+    Node nodes[N];
+    int size = 0, root = -1, vars = 0;
+};
+
+constexpr int length(const char *s) {
+    int n = 0;
+    while (s[n]) n++;
+    return n;
+}
+
+constexpr bool isDigit(char c) { return c >= '0' && c <= '9'; }
+constexpr bool isAlpha(char c) { return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z'); }
+constexpr bool isSpace(char c) { return c == ' ' || (c >= '\t' && c <= '\r'); }
+
+constexpr bool isHex(char c) {
+    return isDigit(c) || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F');
+}
+
+template<int N>
+struct Parser {
+    enum { LEVELS = 8 };
+
+    const char *text, *names, *s;
+    Tree<N> tree;
+
+    constexpr Parser(const char *text, const char *names)
+        : text(text), names(names), s(text), tree()
+    {
+        // Variables are the comma separated names passed to the macro
+        for (const char *p = names; *p; p++) {
+            if (*p == ',' || tree.vars == 0) tree.vars++;
+        }
+    }
+
+    constexpr int node(int op, int a = -1, int b = -1, int c = -1) {
+        Node& n = tree.nodes[tree.size];
+        n.op = op; n.a = a; n.b = b; n.c = c;
+        return tree.size++;
+    }
+
+    constexpr void skipsp() {
+        for(;;) {
+            while (*s && isSpace(*s)) s++;
+            if (*s == ';') {
+                while (*s && *s != '\n') s++;
+            } else break;
+        }
+    }
+
+    constexpr bool word(const char *s0, int len, const char *w) const {
+        for (int i=0; i<len; i++) {
+            if (s0[i] != w[i]) return false;
+        }
+        return w[len] == 0;
+    }
+
+    // Index of the variable among the names (-1 if not present)
+    constexpr int variable(const char *s0, int len) const {
+        const char *p = names;
+        for (int i=0; i<tree.vars; i++) {
+            while (isSpace(*p)) p++;
+            const char *p0 = p;
+            while (*p && *p != ',' && !isSpace(*p)) p++;
+            bool same = (p - p0 == len);
+            for (int j=0; same && j<len; j++) same = (p0[j] == s0[j]);
+            if (same) return i;
+            while (*p && *p != ',') p++;
+            if (*p) p++;
+        }
+        return -1;
+    }
+
+    // Same extent as strtod (decimal or hexadecimal); the value is
+    // computed here only when it's exact (mantissa below 2^53 and a
+    // power of ten up to 1e22), otherwise strtod is called at runtime
+    constexpr int number() {
+        const char *s0 = s;
+        bool neg = (*s == '-');
+        if (neg) s++;
+        bool exact = true;
+        double m = 0;
+        int e = 0;
+        if (s[0] == '0' && (s[1] == 'x' || s[1] == 'X') &&
+            (isHex(s[2]) || (s[2] == '.' && isHex(s[3])))) {
+            s += 2;
+            while (isHex(*s) || *s == '.') s++;
+            if ((*s == 'p' || *s == 'P') &&
+                (isDigit(s[1]) || ((s[1] == '+' || s[1] == '-') && isDigit(s[2])))) {
+                s += 2;
+                while (isDigit(*s)) s++;
+            }
+            exact = false;
+        } else {
+            bool point = false;
+            for (; isDigit(*s) || (*s == '.' && !point); s++) {
+                if (*s == '.') {
+                    point = true;
+                } else {
+                    m = m*10 + (*s - '0');
+                    if (point) e--;
+                    if (m >= 9007199254740992.0) exact = false;
+                }
+            }
+            if ((*s == 'e' || *s == 'E') &&
+                (isDigit(s[1]) || ((s[1] == '+' || s[1] == '-') && isDigit(s[2])))) {
+                s++;
+                bool eneg = (*s == '-');
+                if (*s == '+' || *s == '-') s++;
+                int x = 0;
+                for (; isDigit(*s); s++) if (x < 10000) x = x*10 + (*s - '0');
+                e += eneg ? -x : x;
+            }
+            if (m != 0 && (e < -22 || e > 22)) exact = false;
+        }
+        int n = node(exact ? CONST : NUMBER);
+        if (exact) {
+            double p = 1;
+            for (int i=0; i<(e < 0 ? -e : e); i++) p *= 10;
+            m = e < 0 ? m / p : m * p;
+            tree.nodes[n].value = neg ? -m : m;
+        }
+        tree.nodes[n].pos = s0 - text;
+        tree.nodes[n].len = s - s0;
+        return n;
+    }
+
+    // Must match Expr::binop
+    constexpr int binop(int& len, int& level) const {
+        len = 1;
+        switch(s[0]) {
+        case '*': level = 1; return MUL;
+        case '/': level = 1; return DIV;
+        case '+': level = 2; return ADD;
+        case '-': level = 2; return SUB;
+        case '<':
+            if (s[1] == '<') { len = 2; level = 3; return B_SHL; }
+            if (s[1] == '=') { len = 2; level = 6; return LE; }
+            level = 6; return LT;
+        case '>':
+            if (s[1] == '>') { len = 2; level = 3; return B_SHR; }
+            if (s[1] == '=') { len = 2; level = 6; return GE; }
+            level = 6; return GT;
+        case '&':
+            if (s[1] == '&') { len = 2; level = 7; return AND; }
+            level = 4; return B_AND;
+        case '|':
+            if (s[1] == '|') { len = 2; level = 8; return OR; }
+            level = 5; return B_OR;
+        case '^': level = 5; return B_XOR;
+        case '=':
+            if (s[1] == '=') { len = 2; level = 6; return EQ; }
+            break;
+        case '!':
+            if (s[1] == '=') { len = 2; level = 6; return NE; }
+            break;
+        }
+        return -1;
+    }
+
+    constexpr void expect(char c) {
+        skipsp();
+        if (*s != c) {
+            if (c == ')') throw Expr::Error("')' expected");
+            if (c == ',') throw Expr::Error("',' expected");
+            throw Expr::Error("':' expected");
+        }
+        s++;
+    }
+
+    constexpr int call(const char *s0, int len) {
+        const struct { const char *name; int op, arity; } table[] = {
+            {"floor", FLOOR, 1}, {"abs", ABS, 1}, {"sqrt", SQRT, 1},
+            {"sin", SIN, 1}, {"cos", COS, 1}, {"tan", TAN, 1}, {"atan", ATAN, 1},
+            {"log", LOG, 1}, {"exp", EXP, 1}, {"atan2", ATAN2, 2}, {"pow", POW, 2},
+            {"if", IF, 3} };
+        int args[3] = { -1, -1, -1 };
+        s++;
+        for (const auto& f : table) {
+            if (word(s0, len, f.name)) {
+                for (int a=0; a<f.arity; a++) {
+                    args[a] = parse(-1);
+                    expect(a == f.arity-1 ? ')' : ',');
+                }
+                return node(f.op, args[0], args[1], args[2]);
+            }
+        }
+        // random() needs a seed and a row (see Expr::setSeed), there are
+        // none here: compilation error instead of a missing function
+        if (word(s0, len, "random")) throw Expr::Error("random() is not available");
+        // Functions added with Expr::addFunction are looked up at runtime
+        // by name and number of arguments
+        int arity = 0;
+        skipsp();
+        if (*s != ')') {
+            for (;;) {
+                if (arity == 2) throw Expr::Error("')' expected");
+                args[arity++] = parse(-1);
+                skipsp();
+                if (*s != ',') break;
+                s++;
+            }
+        }
+        expect(')');
+        int n = node(FUNC0 + arity, args[0], args[1]);
+        tree.nodes[n].pos = s0 - text;
+        tree.nodes[n].len = len;
+        return n;
+    }
+
+    constexpr int parse(int level) {
+        if (level == -1) {
+            int c = parse(LEVELS);
+            skipsp();
+            if (*s != '?') return c;
+            s++;
+            int a = parse(-1);
+            expect(':');
+            int b = parse(-1);
+            return node(IF, c, a, b);
+        }
+        if (level == 0) {
+            skipsp();
+            if (*s == '(') {
+                s++;
+                int res = parse(-1);
+                expect(')');
+                return res;
+            } else if (isDigit(*s) || (*s == '-' && isDigit(s[1]))) {
+                return number();
+            } else if (*s == '-') {
+                s++;
+                return node(NEG, parse(0));
+            } else if (*s == '!') {
+                s++;
+                return node(NOT, parse(0));
+            } else if (*s == '_' || isAlpha(*s)) {
+                const char *s0 = s;
+                while (isAlpha(*s) || isDigit(*s) || *s == '_') s++;
+                int len = s - s0;
+                if (*s == '(') return call(s0, len);
+                int id = variable(s0, len);
+                if (id == -1) throw Expr::Error("Unknown variable");
+                int n = node(VAR);
+                tree.nodes[n].id = id;
+                return n;
+            } else {
+                throw Expr::Error("Syntax error");
+            }
+        }
+        int res = parse(0), len = 0, oplevel = 0, op = 0;
+        while (skipsp(), (op = binop(len, oplevel)) != -1 && oplevel <= level) {
+            s += len;
+            res = node(op, res, parse(oplevel-1));
+        }
+        return res;
+    }
+};
+
+template<int N>
+constexpr Tree<N> compile(const char *text, const char *names) {
+    Parser<N> p(text, names);
+    p.tree.root = p.parse(-1);
+    p.skipsp();
+    if (*p.s) throw Expr::Error("Unexpected extra characters");
+    return p.tree;
+}
+
+// The parsed tree of the expression given by Source::text()
+template<class Source>
+struct Compiled {
+    static constexpr const char *text = Source::text();
+    static constexpr Tree<length(Source::text()) + 1> tree =
+        compile<length(Source::text()) + 1>(Source::text(), Source::names());
+};
+
+template<typename F>
+F function(const char *name, int len) {
+    F f = 0;
+    if (!Expr::findFunction(std::string(name, len), f)) {
+        throw Expr::Error("Unknown function '" + std::string(name, len) + "'");
+    }
+    return f;
+}
+
+template<int op>
+inline double unary(double a) {
+    if constexpr (op == NEG) return -a;
+    else if constexpr (op == NOT) return !a;
+    else if constexpr (op == FLOOR) return floor(a);
+    else if constexpr (op == ABS) return fabs(a);
+    else if constexpr (op == SQRT) return sqrt(a);
+    else if constexpr (op == SIN) return sin(a);
+    else if constexpr (op == COS) return cos(a);
+    else if constexpr (op == TAN) return tan(a);
+    else if constexpr (op == ATAN) return atan(a);
+    else if constexpr (op == LOG) return log(a);
+    else return exp(a);
+}
+
+template<int op>
+inline double binary(double a, double b) {
+    if constexpr (op == ADD) return a + b;
+    else if constexpr (op == SUB) return a - b;
+    else if constexpr (op == MUL) return a * b;
+    else if constexpr (op == DIV) return a / b;
+    else if constexpr (op == LT) return a < b;
+    else if constexpr (op == LE) return a <= b;
+    else if constexpr (op == GT) return a > b;
+    else if constexpr (op == GE) return a >= b;
+    else if constexpr (op == EQ) return a == b;
+    else if constexpr (op == NE) return a != b;
+    else if constexpr (op == B_SHL) return int(unsigned(int(a)) << (int(b) & 31));
+    else if constexpr (op == B_SHR) return int(a) >> (int(b) & 31);
+    else if constexpr (op == B_AND) return int(a) & int(b);
+    else if constexpr (op == B_OR) return int(a) | int(b);
+    else if constexpr (op == B_XOR) return int(a) ^ int(b);
+    else if constexpr (op == ATAN2) return atan2(a, b);
+    else return pow(a, b);
+}
+
+// Value of node N; operands are computed left to right like the VM
+template<class C, int N>
+inline double value(const double *v) {
+    constexpr Node x = C::tree.nodes[N];
+    if constexpr (x.op == CONST) {
+        return x.value;
+    } else if constexpr (x.op == NUMBER) {
+        static const double number = strtod(C::text + x.pos, 0);
+        return number;
+    } else if constexpr (x.op == VAR) {
+        return v[x.id];
+    } else if constexpr (x.op == AND) {
+        return value<C, x.a>(v) != 0 && value<C, x.b>(v) != 0;
+    } else if constexpr (x.op == OR) {
+        return value<C, x.a>(v) != 0 || value<C, x.b>(v) != 0;
+    } else if constexpr (x.op == IF) {
+        return value<C, x.a>(v) != 0 ? value<C, x.b>(v) : value<C, x.c>(v);
+    } else if constexpr (x.op == FUNC0) {
+        static double (* const f)() = function<double (*)()>(C::text + x.pos, x.len);
+        return f();
+    } else if constexpr (x.op == FUNC1) {
+        static double (* const f)(double) = function<double (*)(double)>(C::text + x.pos, x.len);
+        return f(value<C, x.a>(v));
+    } else if constexpr (x.op == FUNC2) {
+        static double (* const f)(double, double) =
+            function<double (*)(double, double)>(C::text + x.pos, x.len);
+        double a = value<C, x.a>(v);
+        double b = value<C, x.b>(v);
+        return f(a, b);
+    } else if constexpr (x.op == NEG || x.op == NOT || (x.op >= FLOOR && x.op <= EXP)) {
+        return unary<x.op>(value<C, x.a>(v));
+    } else {
+        double a = value<C, x.a>(v);
+        double b = value<C, x.b>(v);
+        return binary<x.op>(a, b);
+    }
+}
+
+template<class Source, typename... Args>
+inline double eval(const Args&... args) {
+    typedef Compiled<Source> C;
+    static_assert(sizeof...(Args) == C::tree.vars, "Wrong number of variables");
+    const double v[sizeof...(Args) + 1] = { double(args)... };
+    return value<C, C::tree.root>(v);
+}
+
+}
+
+// Evaluates the expression text (a string literal) using the current
+// values of the C++ variables listed after it
+#define EXPR_STATIC(expr_text, ...)                                         \
+    ([&]() -> double {                                                      \
+        struct Source {                                                     \
+            static constexpr const char *text() { return expr_text; }       \
+            static constexpr const char *names() { return #__VA_ARGS__; }   \
+        };                                                                  \
+        return ExprStatic::eval<Source>(__VA_ARGS__);                       \
+    }())
+
+// A function object computing the expression text (a string literal)
+// with the listed variables as parameters
+#define EXPR_FUNCTION(expr_text, ...)                                       \
+    ([]() {                                                                 \
+        struct Source {                                                     \
+            static constexpr const char *text() { return expr_text; }       \
+            static constexpr const char *names() { return #__VA_ARGS__; }   \
+        };                                                                  \
+        return [](auto... args) -> double {                                 \
+            return ExprStatic::eval<Source>(args...);                       \
+        };                                                                  \
+    }())
+
+#endif
+
+#endif
@@ -1,7 +1,11 @@
 #include <stdio.h>
 #include <time.h>
 #include <math.h>
+#include <stddef.h>
+#include <chrono>
+#include <thread>
 #include "expr.h"
+#include "expr_static.h"
 
 double myrandom() {
     return double(rand()) / RAND_MAX;
@@ -15,9 +19,95 @@ double len2(double a, double b) {
     return sqrt(a*a + b*b);
 }
 
+double cube(double x) {
+    return x*x*x;
+}
+
+double dcube(double x) {
+    return 3*x*x;
+}
+
+int calls = 0;
+
+double counted(double x) {
+    calls++;
+    return x;
+}
+
+// Random expression of x and y (the same for the same seed) using the
+// operations that interval evaluation handles specially
+std::string fuzzExpr(unsigned& seed, int depth) {
+    static const char *leaves[] = { "x", "y", "-3", "0.5", "7", "-0.25", "0" };
+    static const char *unary[] = { "tan", "floor", "sin", "sqrt", "-", "!" };
+    static const char *binops[] = { "+", "-", "*", "/", "<", "<=", ">", ">=", "==", "!=",
+                                    "&", "|", "^", "<<", ">>", "&&", "||" };
+    static const char *calls[] = { "pow", "atan2" };
+    seed = seed*1103515245 + 12345;
+    unsigned r = seed >> 8;
+    switch (depth > 0 ? r % 10 : 0) {
+    case 0: return leaves[(r >> 4) % 7];
+    case 1: case 2: return std::string(unary[(r >> 4) % 6]) + "(" + fuzzExpr(seed, depth-1) + ")";
+    case 3:
+        return std::string(calls[(r >> 4) % 2]) + "(" + fuzzExpr(seed, depth-1) + ", " +
+            fuzzExpr(seed, depth-1) + ")";
+    case 4: {
+        std::string c = fuzzExpr(seed, depth-1), a = fuzzExpr(seed, depth-1);
+        return "(" + c + " ? " + a + " : " + fuzzExpr(seed, depth-1) + ")";
+    }
+    default: {
+        std::string a = fuzzExpr(seed, depth-1);
+        return "(" + a + " " + binops[(r >> 4) % 17] + " " + fuzzExpr(seed, depth-1) + ")";
+    }
+    }
+}
+
+// General functions: weighted sum with the weights in the context (the
+// batch version counts its calls), a constant read from the context and
+// a pure one counting its calls
+struct Weights { double w[3]; int batches; };
+
+double dot3(void *context, const double *args) {
+    const Weights& k = *(const Weights *)context;
+    return k.w[0]*args[0] + k.w[1]*args[1] + k.w[2]*args[2];
+}
+
+void dot3Batch(void *context, size_t n, const double * const *args, double *out) {
+    Weights& k = *(Weights *)context;
+    k.batches++;
+    for (size_t i=0; i<n; i++) out[i] = k.w[0]*args[0][i] + k.w[1]*args[1][i] + k.w[2]*args[2][i];
+}
+
+double constant(void *context, const double *) {
+    return *(const double *)context;
+}
+
+double mix3(void *, const double *args) {
+    calls++;
+    return args[0] + (args[1] - args[0])*args[2];
+}
+
+#if __cplusplus >= 201703L
+// Whether the constexpr parser accepts the text (errors are not constant
+// expressions, so the first overload is then discarded)
+template<const char *text, int = ExprStatic::compile<ExprStatic::length(text) + 1>(text, "x").root>
+constexpr bool staticParses(int) { return true; }
+template<const char *text>
+constexpr bool staticParses(long) { return false; }
+
+constexpr char staticRandom[] = "x + random()", staticPlain[] = "x + myrandom()";
+#endif
+
+// Distance of r from e in units in the last place of e (NaN matches NaN)
+double ulps(double r, double e) {
+    if (r == e || (r != r && e != e)) return 0;
+    if (r != r || e != e) return INFINITY;
+    return fabs(r - e)/(nextafter(fabs(e), INFINITY) - fabs(e));
+}
+
 int main() {
     Expr::addFunction("sqr", sqr);
     Expr::addFunction("len2", len2);
+    Expr::addFunction("counted", counted);
 
     struct Test { const char *expr; int err; double result; } tests[] = {
         {"1", -1, 1.0},
@@ -70,12 +160,35 @@ int main() {
         {"abs(log(exp(13)) - 13) < 1E-6", -1, 1.0},
         {"abs(len2(3,4) - 5) < 1E-6", -1, 1.0},
         {"sqr(3) == 9", -1, 1.0},
+        {"2*3+x1", -1, 106.0},
+        {"pow(x1, 2) - x1*x1", -1, 0.0},
+        {"-(-x1) * 1 / 1 - 0", -1, 100.0},
+        {"x1/4 + x1/-0.5", -1, -175.0},
+        {"cos(0) * x1 * -1", -1, -100.0},
+        {"!!(x1 < y1) + !!x1", -1, 2.0},
+        {"1/(0*-1)", -1, -HUGE_VAL},
+        {"(x1-3)*(x1-3) + sqrt(x1*y1) - sqrt(y1*x1)", -1, 9409.0},
+        {"(x1+1)*(y1+1) - (x1+1) - (1+x1)*y1", -1, 0.0},
+        {"x1*y1 + y1/x1 - (3 - x1) + x1*x1", -1, 30099.0},
+        {"(zero/zero < 1) + (zero/zero != zero/zero)*2 + (zero/zero >= 0)*4 + !(zero/zero)*8 +"
+         " (zero/zero && 1)*16 + (zero || zero/zero)*32 + (x1 > y1)*64 + (y1 >= x1)*128", -1, 178.0},
+        {"(x1 << 2) + (-x1 >> 3) + (x1 & 7) + (x1 | 3) + (x1 ^ 7) - abs(-y1) + floor(-x0) + sqrt(x1)",
+         -1, 400 - 13 + 4 + 103 + 99 - 200 - 4 + 10},
+        {"(x1 + 1)*(x1 + 1) - x1*y1 - y1*2 - (x1*2 - y1/x1)", -1, -10397.0},
+        {"1 ? 2 : 3", -1, 2.0},
+        {"x1 > y1 ? x1 : y1", -1, 200.0},
+        {"if(x1 < y1, x1, y1) + if(zero, 1, 2)", -1, 102.0},
+        {"zero ? 1 : zero/zero ? x1 < 0 ? 2 : 3 : 4", -1, 3.0},
+        {"(x1 < y1 && sqrt(x1) == 10) + (x1 > y1 || sqrt(x1) == 10)*2 + (-zero || x1 > y1)*4 +"
+         " (zero/zero || x1 > y1)*8 + (zero && sqrt(x1))*16 + (x1 && sqrt(x1)/10)*32", -1, 43.0},
 
         {"1+z2*4", 4, -1},
         {"1+2*", 4, -1},
         {"1+(2*3", 6, -1},
         {"1+2()", 3, -1},
         {"+1", 0, -1},
+        {"1 ? 2", 5, -1},
+        {"if(1, 2)", 7, -1},
     };
 
     std::map<std::string, double> vars;
@@ -83,6 +196,7 @@ int main() {
     vars["y0"] = 2.718;
     vars["x1"] = 100;
     vars["y1"] = 200;
+    vars["zero"] = 0;
 
     int errors = 0;
     int ntests = sizeof(tests)/sizeof(tests[0]);
@@ -93,6 +207,12 @@ int main() {
             if (tests[i].err != -1) throw Expr::Error("Parsing should have failed");
             res = expr.eval();
             if (tests[i].result != res) throw Expr::Error("Unexpected result");
+            if (Expr::parse(tests[i].expr, vars, false).eval() != res) {
+                throw Expr::Error("Unexpected result without optimizations");
+            }
+            if (expr.jit() && expr.eval() != res) {
+                throw Expr::Error("Unexpected result from native code");
+            }
         } catch (Expr::Error& err) {
             if (tests[i].err == err.position) {
                 // Ok; parsing error position is correct
@@ -104,8 +224,876 @@ int main() {
             }
         }
     }
+
+    {
+        // Batch evaluation must give the same results as row-by-row eval
+        Expr e = Expr::parse("x0*x1 - sqrt(abs(y0)) + (floor(x0/3) & 7) - (x1 < y0)", vars);
+        int n = 1000;
+        std::vector<double> xs(n), ys(2*n), out(n);
+        for (int i=0; i<n; i++) { xs[i] = i*0.37 - 50; ys[2*i] = i*i*0.01 - 300; }
+        std::vector<const double *> cols(e.variableCount());
+        std::vector<int> strides(e.variableCount(), 1);
+        cols[e.variableIndex(&vars["x0"])] = &xs[0];
+        cols[e.variableIndex(&vars["y0"])] = &ys[0];
+        strides[e.variableIndex(&vars["y0"])] = 2;
+        e.eval(n, &cols[0], &out[0], &strides[0]);
+        double x0 = vars["x0"], y0 = vars["y0"];
+        for (int i=0; i<n; i++) {
+            vars["x0"] = xs[i]; vars["y0"] = ys[2*i];
+            if (out[i] != e.eval()) {
+                errors++;
+                printf("TEST FAILED: batch evaluation mismatch at row %i\n", i);
+                break;
+            }
+        }
+        vars["x0"] = x0; vars["y0"] = y0;
+    }
+
+    {
+        // Operands of && and || and branches of ?: not needed are not
+        // evaluated, also in batch mode when rows take different paths
+        Expr e = Expr::parse("x0 > 0 && counted(x0) > 1 ? counted(1) : -counted(x0)", vars);
+        calls = 0;
+        double x0 = vars["x0"];
+        vars["x0"] = -1;
+        e.eval();
+        int negative = calls;
+        vars["x0"] = 3;
+        e.eval();
+        int positive = calls - negative;
+        vars["x0"] = x0;
+        int n = 600;
+        std::vector<double> xs(n), out(n);
+        for (int i=0; i<n; i++) xs[i] = i < 300 ? i%7 - 3 : 1;
+        std::vector<const double *> cols(e.variableCount());
+        cols[e.variableIndex(&vars["x0"])] = &xs[0];
+        calls = 0;
+        e.eval(n, &cols[0], &out[0]);
+        int expected = 0;
+        for (int i=0; i<n; i++) expected += xs[i] > 0 ? 2 : 1;
+        bool ok = (negative == 1 && positive == 2 && calls == expected);
+        for (int i=0; ok && i<n; i++) {
+            ok = (out[i] == (xs[i] > 1 ? 1 : -xs[i]));
+        }
+        if (!ok) {
+            errors++;
+            printf("TEST FAILED: short-circuit evaluation\n");
+        }
+    }
+
+    {
+        // The cache returns the same compiled program for equivalent texts
+        Expr::Cache cache(2);
+        Expr a = cache.get("x1 + y1*2", vars);
+        Expr b = cache.get("  x1+y1 *2 ; comment", vars);
+        Expr c = cache.get("x1 + y1*2", vars, false);
+        bool ok = (cache.stats().hits == 1 && a.eval() == 500 && b.eval() == 500 &&
+                   c.eval() == 500 && a.disassemble() != c.disassemble());
+        try {
+            cache.get("x 1", vars);
+            ok = false;
+        } catch (Expr::Error&) {
+        }
+        ok = ok && Expr::Cache::normalize(" sin (x) < = ( 1 ,2 ) ;x\n") == "sin (x)< =(1,2)";
+        cache.get("x0", vars);
+        cache.get("x1+y1*2", vars);
+        Expr::Cache::Stats st = cache.stats();
+        ok = ok && st.hits == 1 && st.misses == 5 && st.evictions == 2 && st.size == 2;
+        ok = (ok && Expr::Cache::normalize("0x1p -3") == "0x1p -3" &&
+              cache.get("0x1p-3", vars).eval() == 0.125);
+        try {
+            cache.get("0x1p -3", vars);
+            ok = false;
+        } catch (Expr::Error&) {
+        }
+        cache.forget(vars);
+        ok = ok && cache.stats().size == 0;
+
+        std::vector<std::thread> threads;
+        std::vector<int> results(4);
+        for (int t=0; t<4; t++) {
+            threads.push_back(std::thread([&cache, &vars, &results, t]() {
+                for (int i=0; i<200; i++) {
+                    Expr e = cache.get(i%3 ? "x1*2" : "x1*3", vars);
+                    std::vector<double> regs(e.registerCount());
+                    e.initRegisters(&regs[0]);
+                    results[t] += (e.eval(&regs[0]) == (i%3 ? 200 : 300));
+                }
+            }));
+        }
+        for (int t=0; t<4; t++) threads[t].join();
+        st = cache.stats();
+        for (int t=0; t<4; t++) ok = ok && results[t] == 200;
+        ok = ok && st.hits + st.misses == 8 + 800 && st.size == 2;
+
+        // Plain eval() of the same cached expression from two threads
+        // (each copy has its own scratch registers)
+        std::map<std::string, double> tv;
+        tv["t"] = 0;
+        int mismatches[2] = { 0, 0 };
+        std::vector<std::thread> pair;
+        for (int t=0; t<2; t++) {
+            pair.push_back(std::thread([&cache, &tv, &mismatches, t]() {
+                for (int i=0; i<2000; i++) {
+                    Expr e = cache.get("(t+1)*(t+2) + sqrt(t+4)*(t+3)", tv);
+                    mismatches[t] += (e.eval() != 8);
+                }
+            }));
+        }
+        for (int t=0; t<2; t++) pair[t].join();
+        ok = ok && mismatches[0] == 0 && mismatches[1] == 0;
+        cache.forget(tv);
+        if (!ok) {
+            errors++;
+            printf("TEST FAILED: compiled expression cache\n");
+        }
+    }
+
+    {
+        // Expressions compiled with a symbol table read variables from
+        // frames (here an array of structs) and can be used with many
+        struct Point { double x, y, w; };
+        Expr::Symbols symbols;
+        symbols.add("w", offsetof(Point, w)/sizeof(double));
+        symbols.add("x", offsetof(Point, x)/sizeof(double));
+        symbols.add("y", offsetof(Point, y)/sizeof(double));
+        Expr e = Expr::parse("x*w + y > 3 ? sqrt(x*x + y*y) : -w", symbols);
+        Expr j = e;
+        j.jit();
+        int n = 300;
+        std::vector<Point> pts(n);
+        for (int i=0; i<n; i++) { pts[i].x = i%7 - 2; pts[i].y = i*0.1; pts[i].w = i%3; }
+        std::vector<double> out(n);
+        e.evalFrames(n, &pts[0].x, sizeof(Point)/sizeof(double), &out[0]);
+        bool ok = (symbols.size() == 3 && e.variableCount() == 3);
+        for (int i=0; ok && i<n; i++) {
+            const Point& p = pts[i];
+            double expected = p.x*p.w + p.y > 3 ? sqrt(p.x*p.x + p.y*p.y) : -p.w;
+            ok = (out[i] == expected && e.evalFrame(&p.x) == expected &&
+                  j.evalFrame(&p.x) == expected);
+        }
+        try {
+            Expr::parse("x + z", symbols);
+            ok = false;
+        } catch (Expr::Error& err) {
+            ok = ok && err.position == 5;
+        }
+        if (!ok) {
+            errors++;
+            printf("TEST FAILED: evaluation on frames\n");
+        }
+    }
+
+    {
+        // More variables than fit in the frame on the stack
+        std::map<std::string, double> v;
+        std::string text = "0";
+        for (int i=0; i<40; i++) {
+            text += " + v" + std::to_string(i) + "*" + std::to_string(i + 1);
+            v["v" + std::to_string(i)] = 1;
+        }
+        Expr e(text.c_str(), v);
+        std::vector<double> regs(e.registerCount());
+        e.initRegisters(&regs[0]);
+        bool ok = e.variableCount() == 40 && e.eval() == 820 && e.eval(&regs[0]) == 820;
+        v["v39"] = 2;
+        ok = ok && e.eval() == 860 && e.eval(&regs[0]) == 860;
+        if (!ok) {
+            errors++;
+            printf("TEST FAILED: evaluation with many variables\n");
+        }
+    }
+
+    {
+        // Evaluation with caller supplied registers doesn't touch the Expr
+        const Expr e = Expr::parse("(x1 - 3) * (y1 + 0.5) - x1/y1", vars);
+        std::vector<double> r1(e.registerCount()), r2(e.registerCount());
+        e.initRegisters(&r1[0]);
+        e.initRegisters(&r2[0]);
+        double expected = e.eval();
+        if (e.eval(&r1[0]) != expected || e.eval(&r2[0]) != expected ||
+            e.eval(&r1[0]) != expected) {
+            errors++;
+            printf("TEST FAILED: evaluation with external registers\n");
+        }
+    }
+
+    {
+        // Grid evaluation must match a serial loop on the axis variables
+        Expr e = Expr::parse("sin(x0*0.1)*y0 - (x1 & 3) + x0/(y0+1000)", vars);
+        std::vector<Expr::Axis> axes;
+        axes.push_back(Expr::Axis("x0", -3.5, 0.25, 700));
+        axes.push_back(Expr::Axis("y0", 10, -0.5, 37));
+        axes.push_back(Expr::Axis("x1", 0, 1, 5));
+        std::vector<double> out(700*37*5);
+        e.evalGrid(vars, axes, &out[0], 4);
+        double x0 = vars["x0"], y0 = vars["y0"], x1 = vars["x1"];
+        for (int i=0,k=0; k<5; k++) {
+            vars["x1"] = k;
+            for (int j=0; j<37; j++) {
+                vars["y0"] = 10 - 0.5*j;
+                for (int c=0; c<700; c++,i++) {
+                    vars["x0"] = -3.5 + 0.25*c;
+                    if (out[i] != e.eval()) {
+                        errors++;
+                        printf("TEST FAILED: grid evaluation mismatch at %i\n", i);
+                        k = 5; j = 37; break;
+                    }
+                }
+            }
+        }
+        vars["x0"] = x0; vars["y0"] = y0; vars["x1"] = x1;
+    }
+
+    {
+        // Interval evaluation bounds every point of the box, and the culled
+        // grid skips constant blocks giving the same values as evalGrid
+        Expr e = Expr::parse("(x0-40)*(x0-40) + (y0-30)*(y0-30) < 400 ? 255 : "
+                             "(x0 > 70 ? sin(x0*0.1)*x1 : floor(y0/8) & 3)", vars);
+        std::vector<Expr::Interval> ranges(e.variableCount());
+        int ix = e.variableIndex(&vars["x0"]), iy = e.variableIndex(&vars["y0"]);
+        ranges[e.variableIndex(&vars["x1"])] = Expr::Interval(vars["x1"]);
+        ranges[ix] = Expr::Interval(35, 45);
+        ranges[iy] = Expr::Interval(25, 35);
+        Expr::Interval inside = e.evalInterval(&ranges[0]);
+        ranges[ix] = Expr::Interval(65, 90);
+        ranges[iy] = Expr::Interval(-10, 10);
+        Expr::Interval r = e.evalInterval(&ranges[0]);
+        bool ok = inside.lo == 255 && inside.hi == 255 && !inside.nan;
+        double x0 = vars["x0"], y0 = vars["y0"];
+        for (int i=0; ok && i<=25; i++) {
+            vars["x0"] = 65 + i;
+            vars["y0"] = -10 + 0.8*i;
+            ok = e.eval() >= r.lo && e.eval() <= r.hi;
+        }
+        vars["x0"] = x0; vars["y0"] = y0;
+        std::vector<Expr::Axis> axes;
+        axes.push_back(Expr::Axis("x0", 0, 0.5, 200));
+        axes.push_back(Expr::Axis("y0", 0, 0.5, 150));
+        std::vector<double> grid(200*150), culled(200*150);
+        e.evalGrid(vars, axes, &grid[0]);
+        int evaluated = e.evalGridCulled(vars, axes, &culled[0]);
+        ok = ok && evaluated < 200*150*3/4 && grid == culled;
+        if (!ok) {
+            errors++;
+            printf("TEST FAILED: interval evaluation\n");
+        }
+    }
+
+    {
+        // Culled grids of random expressions agree with evalGrid (where
+        // the result is inside the limits), with negative ranges; zeros
+        // of either sign where the interval is a single point first
+        const char *zeros[] = { "atan2(0, (x < -100)*y)", "atan2((x < -100)*y, -1)",
+                                "pow((x < -100)*y, -1)" };
+        const int nzeros = sizeof(zeros)/sizeof(zeros[0]);
+        std::map<std::string, double> v;
+        v["x"] = v["y"] = 0;
+        std::vector<Expr::Axis> axes;
+        axes.push_back(Expr::Axis("x", -9, 0.125, 150));
+        axes.push_back(Expr::Axis("y", -6.5, 0.25, 50));
+        std::vector<double> grid(150*50), culled(150*50);
+        unsigned seed = 1;
+        bool ok = true;
+        for (int k=0; ok && k<nzeros+300; k++) {
+            std::string text = k < nzeros ? zeros[k] : fuzzExpr(seed, 2 + k%4);
+            Expr e = Expr::parse(text.c_str(), v);
+            double lo = k%3 ? -INFINITY : -2, hi = k%3 ? INFINITY : 3;
+            e.evalGrid(v, axes, &grid[0]);
+            e.evalGridCulled(v, axes, &culled[0], lo, hi);
+            for (int i=0; ok && i<150*50; i++) {
+                double g = grid[i], c = culled[i];
+                ok = g == c || (g != g && c != c) || (!(g >= lo && g <= hi) && c != c);
+            }
+            if (!ok) printf("TEST FAILED: culled grid of %s\n", text.c_str());
+        }
+        if (!ok) errors++;
+    }
+
+    {
+        // Single precision batches agree with double evaluation up to
+        // float rounding, and bit operations on booleans become logical ops
+        Expr::Symbols symbols;
+        symbols.add("x", 0);
+        symbols.add("y", 1);
+        Expr e = Expr::parse("(x < y) & (y > 0) ? sqrt(x*x + y*y) : exp(x/4) - floor(y)", symbols);
+        int n = 1000;
+        std::vector<float> xs(n), ys(n), out(n), fout(n);
+        std::vector<double> frames(2*n), dout(n);
+        for (int i=0; i<n; i++) {
+            xs[i] = frames[2*i] = float(i%37 - 18) / 8;
+            ys[i] = frames[2*i+1] = float(i%23 - 7) / 4;
+        }
+        const float *columns[] = { &xs[0], &ys[0] };
+        e.eval(n, columns, &out[0]);
+        e.evalFrames(n, &frames[0], 2, &dout[0]);
+        std::vector<float> fframes(frames.begin(), frames.end());
+        e.evalFrames(n, &fframes[0], 2, &fout[0]);
+        bool ok = e.disassemble().find("B_AND") == std::string::npos;
+        for (int i=0; ok && i<n; i++) {
+            ok = fabs(out[i] - dout[i]) <= 1e-6*(1 + fabs(dout[i])) && fout[i] == out[i];
+        }
+        if (!ok) {
+            errors++;
+            printf("TEST FAILED: single precision batch evaluation\n");
+        }
+    }
+
+#if __cplusplus >= 201703L
+    {
+        // Expressions parsed at compile time give the same results as
+        // the runtime parser (including user functions and comments)
+        #define STATIC_TEST(text) { text, EXPR_FUNCTION(text, x, y) }
+        struct { const char *text; double (*f)(double, double); } tests[] = {
+            STATIC_TEST("x*x + y*y < 4 ? sqrt(x*x + y*y) : -1"),
+            STATIC_TEST("-x^2 + (1 << 3) - 7 & 5 | y"),
+            STATIC_TEST("x > 0 && y < 1 || !(x == y) ; comment"),
+            STATIC_TEST("if(x, floor(y*0.1e1) / 3, atan2(y, -x)) + pow(abs(x), 1.5)"),
+            STATIC_TEST("len2(x, y) - sqr(counted(x)) + 1e-300*0x10 - 123456789012345678901.5"),
+            STATIC_TEST("log(exp(x)) + sin(y)*cos(y) / tan(0.5) - atan(x)"),
+        };
+        #undef STATIC_TEST
+        std::map<std::string, double> vars;
+        vars["x"] = vars["y"] = 0;
+        bool ok = EXPR_STATIC("2 * 3 + 1") == 7;
+        // random() has no seed and row, it's rejected at compile time
+        static_assert(!staticParses<staticRandom>(0) && staticParses<staticPlain>(0), "random()");
+        for (const auto& t : tests) {
+            Expr e(t.text, vars);
+            for (int i=0; ok && i<50; i++) {
+                double x = vars["x"] = (i%11 - 5) * 0.7, y = vars["y"] = (i%7 - 3) * 1.3;
+                double v = e.eval(), w = t.f(x, y);
+                ok = (v == w || (v != v && w != w)) && EXPR_STATIC("x*y - y", x, y) == x*y - y;
+            }
+            if (!ok) printf("TEST FAILED: compile time expression \"%s\"\n", t.text);
+        }
+        if (!ok) errors++;
+    }
+#endif
+
+    {
+        // Gradients are computed together with the value, also through
+        // branches and user functions with a derivative
+        Expr::addFunction("cube", cube, dcube);
+        std::map<std::string, double> v;
+        double& x = v["x"] = 0.7, & y = v["y"] = -1.3, & z = v["z"] = 2;
+        std::vector<std::string> wrt;
+        wrt.push_back("x"); wrt.push_back("y"); wrt.push_back("z");
+        Expr g = Expr::gradient("x > 0 ? cube(x)*sin(y) + pow(z, x) : atan2(y, x)", v, wrt);
+        Expr j = g;
+        j.jit();
+        double out[4], jout[4];
+        double expected[4] = { x*x*x*sin(y) + pow(z, x), 3*x*x*sin(y) + pow(z, x)*log(z),
+                               x*x*x*cos(y), x*pow(z, x-1) };
+        g.evalAll(out);
+        j.evalAll(jout);
+        bool ok = g.outputCount() == 4 && g.outputName(2) == "d/dy";
+        for (int i=0; i<4; i++) {
+            ok = ok && fabs(out[i] - expected[i]) < 1e-12 && out[i] == jout[i];
+        }
+        x = -0.5;
+        g.evalAll(out);
+        ok = ok && out[0] == atan2(y, x) && fabs(out[1] - -y/(x*x + y*y)) < 1e-12 && out[3] == 0;
+        try {
+            Expr::gradient("counted(x)", v, wrt);
+            ok = false;
+        } catch (Expr::Error&) {
+        }
+        if (!ok) {
+            errors++;
+            printf("TEST FAILED: gradient\n");
+        }
+    }
+
+    {
+        // Copies share the compiled program but not the registers
+        std::map<std::string, double> v;
+        double& x = v["x"] = 2;
+        std::vector<Expr> copies(50, Expr::parseMany("a = x*x + 1\nb = a*x", v));
+        Expr c(-0.0), d, e(3.5);
+        d = copies[7];
+        copies.erase(copies.begin(), copies.begin() + 40);
+        bool ok = 1/double(c) < 0 && double(Expr()) == 0 && double(e) == 3.5;
+        for (int k=0; k<2; k++, x=3) {
+            double out[2];
+            for (int i=0,n=copies.size(); i<n; i++) {
+                copies[i].evalAll(out);
+                ok = ok && out[0] == x*x + 1 && out[1] == (x*x + 1)*x;
+            }
+            d.evalAll(out);
+            ok = ok && d.outputName(1) == "b" && out[1] == (x*x + 1)*x;
+        }
+        e = d;
+        e.swap(c);
+        ok = ok && double(e) == 0 && c.outputIndex("b") == 1;
+        if (!ok) {
+            errors++;
+            printf("TEST FAILED: shared programs\n");
+        }
+    }
+
+    {
+        // The code is stored in bytes, 16 bit or 32 bit words depending
+        // on the largest operand: long sums with many constants and a
+        // jump over them need each width (terms are grouped in sums of
+        // 256 to limit the depth of the tree)
+        std::map<std::string, double> v;
+        double& x = v["x"] = 0;
+        int sizes[] = { 2, 300, 70000 };
+        bool ok = true;
+        for (int s=0; s<3; s++) {
+            int terms = sizes[s];
+            std::string text = "x < 2 ? 0";
+            for (int i=1; i<=terms; i++) {
+                char term[40];
+                snprintf(term, sizeof(term), "%sx*%i.5%s", i%256 == 1 ? " + (" : " + ", i,
+                         i%256 == 0 || i == terms ? ")" : "");
+                text += term;
+            }
+            text += " : -1";
+            Expr e(text.c_str(), v);
+            double xs[] = { 0.75, -3, 2, 5 }, out[4];
+            const double *cols[] = { xs };
+            e.eval(4, cols, out);
+            ok = ok && e.registerCount() > terms;
+            for (int i=0; i<4; i++) {
+                x = xs[i];
+                double sum = 0;
+                for (int k=1; k<=terms; k++) sum += x*(k + 0.5);
+                double expected = x < 2 ? sum : -1;
+                Expr::Interval range(x), r = e.evalInterval(&range);
+                double y = e.eval();
+                ok = ok && fabs(y - expected) <= 1e-12*terms*terms && out[i] == y &&
+                     r.lo <= y && y <= r.hi;
+            }
+        }
+        if (!ok) {
+            errors++;
+            printf("TEST FAILED: code widths\n");
+        }
+    }
+
+    {
+        // General functions: any number of parameters, context pointer,
+        // batch version and pure functions folded and computed once
+        Weights k = { { 2, -3, 0.5 }, 0 };
+        double answer = 42;
+        Expr::addFunction("dot3", 3, dot3, &k, dot3Batch);
+        for (int i=0; i<3; i++) {
+            Expr::addFunction(("dot3'" + std::to_string(i + 1)).c_str(), 3, constant, &k.w[i]);
+        }
+        Expr::addFunction("answer", 0, constant, &answer);
+        Expr::addFunction("mix3", 3, mix3, 0, 0, true);
+        std::map<std::string, double> v;
+        double& x = v["x"] = 0.5, & y = v["y"] = 4;
+        calls = 0;
+        Expr e = Expr::parse("dot3(x, y*y, 1) + mix3(x, y, 0.25)*mix3(x, y, 0.25) - "
+                             "mix3(1, 3, 0.5) + answer()", v);
+        double m = x + (y - x)*0.25, expected = 2*x - 3*y*y + 0.5 + m*m - 2 + 42;
+        bool ok = calls == 1 && e.eval() == expected && calls == 2;
+        Expr j = e;
+        j.jit();
+        std::string bin;
+        e.save(bin, v);
+        const char *p = bin.data();
+        ok = ok && j.eval() == expected && Expr::load(p, bin.size(), v).eval() == expected;
+        const int n = 300;
+        std::vector<double> cols[2], out(n);
+        std::vector<float> fcols[2], fout(n);
+        for (int i=0; i<n; i++) {
+            cols[0].push_back(i*0.01 - 1); cols[1].push_back(2 - i*0.02);
+            fcols[0].push_back(float(cols[0][i])); fcols[1].push_back(float(cols[1][i]));
+        }
+        int ix = e.variableIndex(&x), iy = e.variableIndex(&y);
+        const double *c[2] = { &cols[ix][0], &cols[iy][0] };
+        const float *fc[2] = { &fcols[ix][0], &fcols[iy][0] };
+        e.eval(n, c, &out[0]);
+        e.eval(n, fc, &fout[0]);
+        ok = ok && k.batches == 2*((n + Expr::BATCH_SIZE - 1)/Expr::BATCH_SIZE);
+        for (int i=0; i<n; i++) {
+            x = cols[0][i]; y = cols[1][i];
+            double r = e.eval();
+            ok = ok && out[i] == r && fabs(fout[i] - r) < 1e-4*(1 + fabs(r));
+        }
+        std::vector<std::string> wrt;
+        wrt.push_back("x"); wrt.push_back("y");
+        Expr g = Expr::gradient("dot3(x, y*y, 1)", v, wrt);
+        double d[3];
+        g.evalAll(d);
+        ok = ok && d[1] == 2 && d[2] == -3*2*y;
+        if (!ok) {
+            errors++;
+            printf("TEST FAILED: general functions\n");
+        }
+    }
+
+    {
+        // Vectorized math in batch evaluation stays within 1 ulp (ACCURATE)
+        // or 3 ulp (FAST) of the C library, also for the arguments that
+        // the kernels leave to the library (and for arguments whose
+        // reduction modulo pi/2 needs all the bits), with each instruction
+        // set the CPU supports
+        std::map<std::string, double> v;
+        double& x = v["x"] = 0, & y = v["y"] = 0;
+        const char *fs[] = { "sin(x)", "cos(x)", "tan(x)", "atan(x)", "atan2(x, y)",
+                             "exp(x)", "log(x)", "pow(x, y)", "floor(x)" };
+        double special[] = { 0, -0.0, 1, -2.5, 1e300, -1e-310, 709.5, -745.5, 3e6, 1e-20,
+                             INFINITY, -INFINITY, NAN, 2.0767781972396415, -365.49093572718436 };
+        const int n = 700, ns = sizeof(special)/sizeof(special[0]);
+        std::vector<double> cols[2], out(n);
+        std::vector<float> fcols[2], fout(n);
+        for (int i=0; i<n; i++) {
+            bool s = i < ns*ns;
+            cols[0].push_back(s ? special[i%ns] : (i - 450)*0.173);
+            cols[1].push_back(s ? special[i/ns] : 3 - i*0.011);
+            fcols[0].push_back(float(cols[0][i])); fcols[1].push_back(float(cols[1][i]));
+        }
+        Expr::VectorLevel best = Expr::vectorLevel();
+        bool ok = !Expr::setVectorLevel(Expr::VectorLevel(best + 1)) && Expr::vectorLevel() == best;
+        for (int level=Expr::VECTOR_NONE; level<=best; level++) {
+            ok = ok && Expr::setVectorLevel(Expr::VectorLevel(level));
+            for (int f=0; f<int(sizeof(fs)/sizeof(fs[0])); f++) {
+                Expr e = Expr::parse(fs[f], v);
+                ok = ok && e.accuracy() == Expr::EXACT;
+                for (int a=Expr::EXACT; a<=Expr::FAST; a++) {
+                    e.setAccuracy(Expr::Accuracy(a));
+                    Expr c = e;
+                    std::vector<const double *> cp(c.variableCount());
+                    std::vector<const float *> fcp(c.variableCount());
+                    cp[c.variableIndex(&x)] = &cols[0][0]; fcp[c.variableIndex(&x)] = &fcols[0][0];
+                    if (c.variableCount() > 1) {
+                        cp[c.variableIndex(&y)] = &cols[1][0]; fcp[c.variableIndex(&y)] = &fcols[1][0];
+                    }
+                    c.eval(n, &cp[0], &out[0]);
+                    c.eval(n, &fcp[0], &fout[0]);
+                    for (int i=0; i<n; i++) {
+                        x = cols[0][i]; y = cols[1][i];
+                        double r = c.eval();
+                        x = fcols[0][i]; y = fcols[1][i];
+                        double fr = c.eval();
+                        ok = ok && ulps(out[i], r) <= (a == Expr::EXACT ? 0 : a == Expr::ACCURATE ? 1 : 3) &&
+                             (fr != fr ? fout[i] != fout[i] :
+                              fout[i] == float(fr) || fabs(fout[i] - fr) <= 1e-6*fabs(fr));
+                    }
+                }
+            }
+        }
+        Expr::setVectorLevel(best);
+        if (!ok) {
+            errors++;
+            printf("TEST FAILED: vectorized math\n");
+        }
+    }
+
+    {
+        // random() depends only on seed, row and call: scalar, batch, grid
+        // (with any number of threads), native and loaded code agree
+        std::map<std::string, double> v;
+        double& x = v["x"] = 0;
+        v["y"] = 0;
+        Expr e = Expr::parse("x < 300 ? random() : random() - random() + 2", v);
+        bool ok = e.seed() == 0;
+        Expr r0 = Expr::parse("random()", v);
+        ok = ok && r0.eval() == ldexp(double(0x6627e8d5e169c58dULL >> 12), -52);
+        e.setSeed(12345);
+        const int n = 600;
+        std::vector<double> xs(n), out(n), regs(e.registerCount());
+        std::vector<float> fxs(n), fout(n);
+        e.initRegisters(&regs[0]);
+        for (int i=0; i<n; i++) { xs[i] = fxs[i] = (i*7) % n; }
+        const double *cols[] = { &xs[0] };
+        const float *fcols[] = { &fxs[0] };
+        e.eval(n, cols, &out[0]);
+        e.eval(n, fcols, &fout[0]);
+        Expr j = e;
+        j.jit();
+        std::string bin;
+        e.save(bin, v);
+        const char *p = bin.data();
+        Expr l = Expr::load(p, bin.size(), v);
+        l.setSeed(12345);
+        double sum = 0;
+        for (int i=0; i<n; i++) {
+            x = xs[i];
+            double s = e.eval(), t = j.eval();
+            e.seedRegisters(&regs[0], 12345, i);
+            ok = ok && s == out[i] && t == s && l.eval() == s && e.eval(&regs[0]) == s &&
+                 (x >= 300 || fout[i] < 1) && fabs(fout[i] - s) < 1e-6;
+            if (x < 300) sum += s;
+            ok = ok && (x < 300 ? s >= 0 && s < 1 : s > 1 && s < 3);
+        }
+        ok = ok && fabs(sum/(n/2) - 0.5) < 0.1;
+        e.setSeed(12346);
+        x = 0;
+        ok = ok && e.seed() == 12346 && e.eval() != out[0];
+        Expr g = Expr::parse("random() + floor(x/4)*0.5 + y", v);
+        g.setSeed(7, 1000);
+        std::vector<Expr::Axis> axes;
+        axes.push_back(Expr::Axis("x", 0, 1, 300));
+        axes.push_back(Expr::Axis("y", 0, 1, 40));
+        std::vector<double> g1(300*40), g4(300*40), gc(300*40);
+        g.evalGrid(v, axes, &g1[0], 1);
+        g.evalGrid(v, axes, &g4[0], 4);
+        g.evalGridCulled(v, axes, &gc[0], -INFINITY, INFINITY, 3);
+        ok = ok && g1 == g4 && g1 == gc;
+        std::vector<double> gr(g.registerCount());
+        g.initRegisters(&gr[0]);
+        for (int i=0; i<300*40; i+=97) {
+            x = i % 300; v["y"] = i / 300;
+            g.seedRegisters(&gr[0], 7, 1000 + i);
+            ok = ok && g.eval(&gr[0]) == g1[i];
+        }
+        if (!ok) {
+            errors++;
+            printf("TEST FAILED: random\n");
+        }
+    }
+
+    {
+        // Constant folding and simplifications must shrink the code
+        struct SizeTest { const char *expr; int instructions; } sizes[] = {
+            {"2*3+x1", 1},
+            {"pow(x1, 2)", 2},
+            {"x1*1", 1},
+            {"-(-x1)", 1},
+            {"cos(0)", 0},
+            {"x1/4", 1},
+            {"x1+0", 1},
+            {"random() + 1", 2},
+            {"(x1-3)*(x1-3)", 2},
+            {"sqrt(x1*x1+y1*y1) + sqrt(y1*y1+x1*x1)", 6},
+            {"random() - random()", 3},
+            {"x1*y1", 2},
+            {"x1*y1 + x0*y0", 5},
+            {"(x1+y1)/(x1-y1)", 5},
+            {"x1 > 0 && y1 < 1", 5},
+            {"x1 > 0 && sqrt(y1) < 1", 7},
+            {"1 < 2 ? x1 : y1", 1},
+            {"x1 ? y1 : 2", 5},
+            {"floor(x1 & 3)", 2},
+            {"floor(floor(x1)*2 - 1)", 4},
+        };
+        for (int i=0,n=sizeof(sizes)/sizeof(sizes[0]); i<n; i++) {
+            std::string code = Expr::parse(sizes[i].expr, vars).disassemble();
+            int count = std::count(code.begin(), code.end(), '\n');
+            if (count != sizes[i].instructions) {
+                errors++;
+                printf("TEST FAILED: \"%s\" compiled to %i instructions instead of %i\n",
+                       sizes[i].expr, count, sizes[i].instructions);
+            }
+        }
+    }
+
+    {
+        // Profiled evaluation counts each instruction and user function call
+        Expr e = Expr::parse("x0 > 0 ? counted(x0) * y0 : sqrt(y0)", vars);
+        Expr::Profile profile;
+        double x0 = vars["x0"];
+        bool ok = true;
+        for (int i=0; i<10; i++) {
+            vars["x0"] = i - 2.5;
+            if (e.profile(profile) != e.eval()) ok = false;
+        }
+        vars["x0"] = x0;
+        std::string code = e.disassemble(), annotated = e.disassemble(profile);
+        if (!ok || profile.evaluations != 10 ||
+            profile.opcodes(e)["FUNC1 counted"].count != 7 || profile.opcodes(e)["FSQRT"].count != 3 ||
+            std::count(code.begin(), code.end(), '\n') != std::count(annotated.begin(), annotated.end(), '\n') ||
+            annotated.find("counted") == std::string::npos) {
+            errors++;
+            printf("TEST FAILED: profiled evaluation\n");
+        }
+    }
+
+    {
+        // Multi-output programs share loads and subexpressions and can use
+        // previous results by name
+        const char *script = "d = sqrt(x1*x1 + y1*y1) ; distance\n"
+                             "\n"
+                             "d > 100 ? x1/d : y1/d\n"
+                             "   ; only a comment\n"
+                             "s = x1*x1 + y1*y1 + d";
+        Expr p = Expr::parseMany(script, vars);
+        double out[3];
+        p.evalAll(out);
+        double d = Expr::parse("sqrt(x1*x1 + y1*y1)", vars).eval();
+        bool ok = p.outputCount() == 3 && p.outputName(0) == "d" && p.outputName(1) == "" &&
+                  p.outputIndex("s") == 2 && out[0] == d &&
+                  out[1] == Expr::parse("x1/sqrt(x1*x1 + y1*y1)", vars).eval() &&
+                  out[2] == Expr::parse("x1*x1 + y1*y1 + sqrt(x1*x1 + y1*y1)", vars).eval();
+        std::string code = p.disassemble();
+        int loads = 0;
+        for (size_t i=code.find("LOAD"); i!=std::string::npos; i=code.find("LOAD", i+1)) loads++;
+        ok = ok && loads == 2;
+        std::string bin;
+        p.save(bin, vars);
+        const char *b = bin.data();
+        double loaded[3];
+        Expr::load(b, bin.size(), vars).evalAll(loaded);
+        ok = ok && loaded[0] == out[0] && loaded[1] == out[1] && loaded[2] == out[2];
+        std::vector<std::string> exprs;
+        exprs.push_back("x + y");
+        exprs.push_back("x - y");
+        Expr::Symbols symbols;
+        symbols.add("y"); symbols.add("x");
+        double frame[] = { 2, 7 };
+        Expr::parseMany(exprs, symbols).evalFrameAll(frame, out);
+        ok = ok && out[0] == 9 && out[1] == 5;
+        struct { const char *script; int position; } errs[] = {
+            {"a = x1\nb = a + z9", 17},
+            {"a = x1\na = 2", 12},
+            {" ; nothing", 0},
+        };
+        for (int i=0; i<3; i++) {
+            try {
+                Expr::parseMany(errs[i].script, vars);
+                ok = false;
+            } catch (Expr::Error& err) {
+                ok = ok && err.position == errs[i].position;
+            }
+        }
+        if (!ok) {
+            errors++;
+            printf("TEST FAILED: multi-output programs\n");
+        }
+    }
+
+    {
+        // A graph of formulas evaluates only what depends on the changes
+        std::map<std::string, double> v;
+        v["x"] = 1; v["y"] = 2; v["g"] = 0;
+        Expr::Graph graph(v);
+        graph.add("a", "x + 1");
+        graph.add("b", "a*2");
+        graph.add("c", "y*3");
+        graph.add("d", "b + c");
+        graph.add("h", "g*2");
+        graph.add("g", "x*3");
+        graph.add("e", "x > 0");
+        graph.add("f", "e*10");
+        bool ok = graph.update() == 8 && v["d"] == 10 && v["h"] == 6 && v["f"] == 10;
+        graph.set("x", 5);
+        ok = ok && graph.update() == 6 && v["d"] == 18 && v["h"] == 30;
+        graph.set("x", 5);
+        ok = ok && graph.update() == 0;
+        v["y"] = 1;
+        graph.changed("y");
+        ok = ok && graph.update() == 2 && v["d"] == 15;
+        const char *bad[] = { "x", "a" };
+        for (int i=0; i<2; i++) {
+            try {
+                graph.add(bad[i], "d + 1");
+                ok = false;
+            } catch (Expr::Error&) {
+            }
+        }
+        try {
+            graph.add("z", "z + 1");
+            ok = false;
+        } catch (Expr::Error&) {
+            ok = ok && v.count("z") == 0;
+        }
+        if (!ok) {
+            errors++;
+            printf("TEST FAILED: expression graph\n");
+        }
+    }
+
+    {
+        // Binary form: loaded expressions are relinked by name and damaged
+        // data gives an error
+        const char *texts[] = { "x1 > 0 && counted(x1) > 1 ? len2(x1, y1) : -y0",
+                                "(x0 - 3)*(x0 - 3) + sin(y1)*y0", "42" };
+        std::map<std::string, double> other(vars);
+        std::string bin;
+        std::vector<std::string> programs;
+        for (int i=0; i<3; i++) {
+            std::string one;
+            Expr::parse(texts[i], vars).save(one, vars);
+            bin += one;
+            programs.push_back(one);
+        }
+        Expr::Library::write("test.exprlib", programs);
+        Expr::Library lib("test.exprlib");
+        bool ok = lib.size() == 3;
+        const char *p = bin.data(), *end = p + bin.size();
+        for (int i=0; ok && i<3; i++) {
+            Expr e = Expr::load(p, end - p, other);
+            Expr f = lib.load(i, vars);
+            ok = e.eval() == Expr::parse(texts[i], other).eval() &&
+                 f.eval() == Expr::parse(texts[i], vars).eval();
+        }
+        ok = ok && p == end;
+        Expr::Symbols s1, s2;
+        s1.add("x"); s1.add("y");
+        s2.add("z"); s2.add("y"); s2.add("x");
+        std::string sym;
+        Expr::parse("x*10 + y", s1).save(sym, s1);
+        p = sym.data();
+        double frame[] = { 5, 2, 1 };
+        ok = ok && Expr::load(p, sym.size(), s2).evalFrame(frame) == 12;
+        int failures = 0;
+        for (int i=0,n=bin.size(); i<n; i++) {
+            std::string damaged(bin);
+            damaged[i] ^= 1 + (i % 255);
+            try {
+                p = damaged.data();
+                Expr::load(p, damaged.size(), vars).eval();
+            } catch (Expr::Error&) {
+                failures++;
+            }
+        }
+        ok = ok && failures > 0;
+        try {
+            p = bin.data();
+            Expr::load(p, bin.size(), s1);
+            ok = false;
+        } catch (Expr::Error&) {
+        }
+        if (!ok) {
+            errors++;
+            printf("TEST FAILED: binary form\n");
+        }
+    }
+
     printf("%i errors on %i tests\n", errors, ntests);
 
+    {
+        // Parsing speed on a mix of formulas
+        const char *formulas[] = {
+            "x1*y1 + x0*y0",
+            "(x1 - 320)*(x1 - 320) + (y1 - 240)*(y1 - 240) < 10000",
+            "sqrt(x0*x0 + y0*y0) * cos(atan2(y0, x0) + 0.5)",
+            "x1 > 0 && y1 < 100 ? floor(x1/128) + floor(y1/96) : -1",
+            "((128 + sin(x0*k)*127) ^ (255 * ((floor(x1/128)+floor(y1/96)) & 1))) + random()*32-16",
+            "abs(x0 - y0) <= 1E-6 || (x0 != x0) ; same value or NaN",
+            "pow(x1, 2) - 2*x1*y1 + pow(y1, 2)",
+            "len2(x0 - 1.5, y0 + 2.25) >= sqr(zero + 3)",
+        };
+        vars["k"] = 0.1;
+        int nf = sizeof(formulas)/sizeof(formulas[0]), reps = 5000;
+        size_t bytes = 0;
+        for (int i=0; i<nf; i++) bytes += strlen(formulas[i]);
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        for (int rep=0; rep<reps; rep++) {
+            for (int i=0; i<nf; i++) Expr::parse(formulas[i], vars);
+        }
+        double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        printf("Parsed %i expressions in %0.3fms (%.0f expressions/sec, %0.2f MB/sec)\n",
+               nf*reps, secs*1000, nf*reps/secs, bytes*reps/secs/1E6);
+        std::string bin;
+        for (int i=0; i<nf; i++) Expr::parse(formulas[i], vars).save(bin, vars);
+        start = std::chrono::steady_clock::now();
+        for (int rep=0; rep<reps; rep++) {
+            const char *p = bin.data(), *end = p + bin.size();
+            while (p != end) Expr::load(p, end - p, vars);
+        }
+        secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        printf("Loaded %i binary expressions in %0.3fms (%.0f expressions/sec)\n",
+               nf*reps, secs*1000, nf*reps/secs);
+    }
+
+
     int w=640, h=480;
     vars["k"] = 10*3.141592654 / ((w*w+h*h)/4);
     double& y = vars["y"];
@@ -120,15 +1108,73 @@ int main() {
         for (y=0; y<h; y++) {
             for (x=0; x<w; x++) {
                 int ie = int(e);
-                if (ie < 0) ie = 0; if (ie > 255) ie = 255;
+                if (ie < 0) ie = 0;
+                if (ie > 255) ie = 255;
                 img[i++] = ie;
             }
         }
     }
     clock_t stop = clock();
-    printf("Test image generated in %0.3fms (%.0f pixels/sec)\n",
-           (stop - start)*100.0/CLOCKS_PER_SEC,
+#if defined(EXPR_THREADED_DISPATCH)
+    const char *dispatch = "threaded";
+#else
+    const char *dispatch = "switch";
+#endif
+    printf("Test image generated (%s dispatch) in %0.3fms (%.0f pixels/sec)\n",
+           dispatch, (stop - start)*100.0/CLOCKS_PER_SEC,
            double(w*h*10)*CLOCKS_PER_SEC/(stop-start+1));
+
+    std::vector<double> xcol(w), row(w);
+    for (int i=0; i<w; i++) xcol[i] = i;
+    std::vector<const double *> cols(e.variableCount());
+    cols[e.variableIndex(&x)] = &xcol[0];
+    clock_t start_b = clock();
+    for (int rep=0; rep<10; rep++) {
+        int i = 0;
+        for (y=0; y<h; y++) {
+            e.eval(w, &cols[0], &row[0]);
+            for (int j=0; j<w; j++) {
+                int ie = int(row[j]);
+                if (ie < 0) ie = 0;
+                if (ie > 255) ie = 255;
+                img[i++] = ie;
+            }
+        }
+    }
+    clock_t stop_b = clock();
+    printf("Test image generated in batch mode in %0.3fms (%.0f pixels/sec)\n",
+           (stop_b - start_b)*100.0/CLOCKS_PER_SEC,
+           double(w*h*10)*CLOCKS_PER_SEC/(stop_b-start_b+1));
+
+    std::vector<Expr::Axis> axes;
+    axes.push_back(Expr::Axis("x", 0, 1, w));
+    axes.push_back(Expr::Axis("y", 0, 1, h));
+    std::vector<double> grid(w*h);
+    std::chrono::steady_clock::time_point start_g = std::chrono::steady_clock::now();
+    for (int rep=0; rep<10; rep++) {
+        e.evalGrid(vars, axes, &grid[0]);
+    }
+    double grid_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_g).count();
+    printf("Test image generated on a grid using %i threads in %0.3fms (%.0f pixels/sec)\n",
+           std::max(1, int(std::thread::hardware_concurrency())),
+           grid_s*100.0, double(w*h*10)/grid_s);
+
+    Expr ej = e;
+    if (ej.jit()) {
+        clock_t start_j = clock();
+        for (int rep=0; rep<10; rep++) {
+            for (y=0; y<h; y++) {
+                for (x=0; x<w; x++) {
+                    ej.eval();
+                }
+            }
+        }
+        clock_t stop_j = clock();
+        printf("Test image generated with native code in %0.3fms (%.0f pixels/sec)\n",
+               (stop_j - start_j)*100.0/CLOCKS_PER_SEC,
+               double(w*h*10)*CLOCKS_PER_SEC/(stop_j-start_j+1));
+    }
+
     FILE *f = fopen("test.pgm", "wb");
     if (f) {
         fprintf(f, "P5\n%i %i 255\n", w, h);
@@ -147,7 +1193,8 @@ int main() {
                 int ie = int(
                     (int(128 + sin(((x-320)*(x-320) + (y-240)*(y-240))*k)*127) ^
                      int(255 * (int(floor(x/128)+floor(y/96)) & 1))) + myrandom()*32-16);
-                if (ie < 0) ie = 0; if (ie > 255) ie = 255;
+                if (ie < 0) ie = 0;
+                if (ie > 255) ie = 255;
                 img[i++] = ie;
             }
         }